@@ -7,7 +7,6 @@
  * 
  * @copyright Copyright (c) arcticwolf666 2024
  * @note Photoshop 2024で日本語でレイヤー名を指定した所ShiftJIS(CP932 ANSI)で保存されている事を確認した。
- * @todo レイヤー名を読むにはまだ幾つかのセクションの読み込みを実装しなくてはならない。
  */
 #include <QCoreApplication>
 #include <QDataStream>
@@ -16,11 +15,86 @@
 #include <QList>
 #include <QStringDecoder>
 #include <QImage>
+#include <QCommandLineParser>
+#include <QRegularExpression>
+#include <QtEndian>
+#include <QHash>
+#include <QSet>
+#include <QVariant>
+#include <QPoint>
+#include <QRect>
+#include <QtConcurrent>
+#include <QtMath>
+#include <QStringEncoder>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QLoggingCategory>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QtAlgorithms>
+#include <QThreadPool>
+#include <QSemaphore>
+#include <zlib.h>
 #include <cstddef>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PSD_USE_SSE2
+#endif
+
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <cerrno>
+#endif
 
 static const quint32 PSDSignature8BPS = 0x38425053u;
 static const quint32 PSDSignature8BIM = 0x3842494Du;
 static const quint32 PSDSignature8B64 = 0x38623634u;
+static const quint32 PSDSignatureMani = 0x6D616E69u; // 'mani'
+
+static const quint32 PSDKeySectionDividerSetting = 0x6C736374u; // 'lsct'
+static const quint32 PSDKeyLayerId = 0x6C796964u; // 'lyid'
+static const quint32 PSDKeyUnicodeLayerName = 0x6C756E69u; // 'luni'
+static const quint32 PSDKeyMetadataSetting = 0x73686D64u; // 'shmd'
+static const quint32 PSDKeyLayerCompSetting = 0x636D6C73u; // 'cmls'
+static const quint32 PSDKeyAnimationFrameSetting = 0x6D6C7374u; // 'mlst'
+static const quint32 PSDKeyAnimationDescriptor = 0x416E4473u; // 'AnDs'
+static const quint32 PSDKeyArtboardData = 0x61727462u; // 'artb'
+static const quint32 PSDKeyArtboardData2 = 0x61727464u; // 'artd'
+static const quint32 PSDKeyArtboardData3 = 0x61626464u; // 'abdd'
+static const quint32 PSDKeyPatterns = 0x50617474u; // 'Patt'
+static const quint32 PSDKeyPatterns2 = 0x50617432u; // 'Pat2'
+static const quint32 PSDKeyPatterns3 = 0x50617433u; // 'Pat3'
+static const quint32 PSDKeyLayerInfo16 = 0x4C723136u; // 'Lr16'
+static const quint32 PSDKeyLayerInfo32 = 0x4C723332u; // 'Lr32'
+static const quint32 PSDKeySolidColorSheetSetting = 0x536F436Fu; // 'SoCo'
+static const quint32 PSDKeyGradientFillSetting = 0x4764466Cu; // 'GdFl'
+static const quint32 PSDKeyPatternFillSetting = 0x5074466Cu; // 'PtFl'
+static const quint32 PSDKeyVectorMask = 0x766D736Bu; // 'vmsk'
+static const quint32 PSDKeyVectorMask2 = 0x76736D73u; // 'vsms'
+static const quint32 PSDKeyEffects = 0x6C667832u; // 'lfx2'
+static const quint32 PSDKeyEffectsOld = 0x6C724658u; // 'lrFX'
+static const quint32 PSDKeyMultipleEffects = 0x6C6D6678u; // 'lmfx'
+
+static const quint32 PSDBlendModeNormal = 0x6E6F726Du; // 'norm'
+static const quint32 PSDBlendModePassThrough = 0x70617373u; // 'pass'
+
+// adjustment layers: levl curv brit blnc blwh 'hue ' hue2 selc mixr grdm phfl expA vibA thrs post nvrt clrL
+static const quint32 PSDAdjustmentLayerKeys[] = {
+    0x6C65766Cu, 0x63757276u, 0x62726974u, 0x626C6E63u, 0x626C7768u, 0x68756520u, 0x68756532u, 0x73656C63u, 0x6D697872u,
+    0x6772646Du, 0x7068666Cu, 0x65787041u, 0x76696241u, 0x74687273u, 0x706F7374u, 0x6E767274u, 0x636C724Cu,
+};
 
 /*
  * このコードを元に実実装を行うなら
@@ -46,12 +120,31 @@ struct PSDColorModeDataSection
     char    colorData[0];
 };
 
+struct PSDImageResourceBlock
+{
+    quint32     signature;
+    quint16     id;
+    QByteArray  name;
+    QByteArray  data;
+};
+
 struct PSDImageResouceSection
 {
-    quint32 length;
-    char    imageResouces[0];
+    quint32                         length;
+    QList<PSDImageResourceBlock>    imageResouces;
 };
 
+static const quint16 PSDImageResourceLayerStateInfo = 1024;
+static const quint16 PSDImageResourceLayerGroupInfo = 1026;
+static const quint16 PSDImageResourceThumbnailOld = 1033;
+static const quint16 PSDImageResourceThumbnail = 1036;
+static const quint16 PSDImageResourceSlices = 1050;
+static const quint16 PSDImageResourceVersionInfo = 1057;
+static const quint16 PSDImageResourceLayerComps = 1065;
+static const quint16 PSDImageResourceLayerSelectionIds = 1069;
+static const quint16 PSDImageResourceLayerGroupsEnabledId = 1072;
+static const quint16 PSDImageResourceAnimation = 4000;
+
 struct PSDLayerAndMaskInfoSection
 {
     quint32 length;
@@ -73,6 +166,23 @@ struct PSDChannelInfo
 
 static const quint32 PSDChannelInfosize = 6;
 
+struct PSDAdditionalLayerInfoBlock
+{
+    quint32     signature;
+    quint32     key;
+    QByteArray  data;
+    qint64      offset = -1; // file offset of data, -1 if not scanned from file.
+    qint64      length = 0;
+};
+
+struct PSDLayerExtraData
+{
+    QByteArray                          maskData;
+    QByteArray                          blendingRanges;
+    QByteArray                          pascalName;
+    QList<PSDAdditionalLayerInfoBlock>  additionalLayerInfos;
+};
+
 struct PSDLayerRecord
 {
     quint32                 top;
@@ -88,6 +198,7 @@ struct PSDLayerRecord
     quint8                  flags;
     quint8                  filler;
     quint32                 extraDataFieldLength;
+    PSDLayerExtraData       extraData;
 };
 
 static const quint32 PSDLayerRecordSize = 34;
@@ -115,6 +226,143 @@ struct PSDAdditionalLayerInfo
 static const quint32 PSDAdditionalLayerInfoDataOffset = 8;
 static const quint32 PSDAdditionalLayerInfoSize = 12;
 
+enum PSDSectionDividerType
+{
+    PSDSectionDividerAnyOther = 0,
+    PSDSectionDividerOpenFolder = 1,
+    PSDSectionDividerClosedFolder = 2,
+    PSDSectionDividerBoundingSection = 3, // hidden "</Layer group>" record.
+};
+
+enum PSDFillType
+{
+    PSDFillNone,
+    PSDFillSolid, // 'SoCo'
+    PSDFillGradient, // 'GdFl'
+    PSDFillPattern, // 'PtFl'
+};
+
+enum PSDGradientType
+{
+    PSDGradientLinear,
+    PSDGradientRadial,
+    PSDGradientAngle,
+    PSDGradientReflected,
+    PSDGradientDiamond,
+};
+
+static const int PSDGradientRampSize = 4096;
+
+/**
+ * @brief fill layer settings, fill layers have no pixel data to composite.
+ */
+struct PSDFillLayer
+{
+    PSDFillType     type = PSDFillNone;
+    QRect           bounds; // filled document rectangle, layer rectangle or whole document.
+    QRgb            color = 0xFF000000U; // solid color.
+    PSDGradientType gradientType = PSDGradientLinear;
+    double          angle = 90; // degrees, counterclockwise.
+    double          scale = 100; // percent.
+    double          offsetX = 0; // percent of bounds.
+    double          offsetY = 0;
+    bool            reverse = false;
+    QList<QRgb>     ramp; // PSDGradientRampSize colors from start to end of gradient.
+    QString         patternId;
+    double          phaseX = 0;
+    double          phaseY = 0;
+    QImage          pattern; // resolved from patterns of document.
+};
+
+/**
+ * @brief layer record placed in layer tree, resolved before any pixels are read.
+ */
+struct PSDLayerNode
+{
+    int     index; // index of records, same as layer%1.png.
+    QString name;
+    QString path; // group names and layer name joined by '/'.
+    qint32  layerId; // -1 if 'lyid' is missing.
+    quint32 sectionType;
+    int     parent; // index of enclosing group record, -1 if top level.
+    qint64  channelDataOffset; // file offset of first channel image data.
+    qint64  channelDataLength;
+    PSDFillLayer fill;
+    QByteArray blendIf; // empty if blending ranges are default, see readPSDBlendIfTables.
+};
+
+/**
+ * @brief visibility and position of layer, overridden by layer comps.
+ */
+struct PSDLayerState
+{
+    bool    visible;
+    QPoint  offset; // offset from position in layer record.
+};
+
+/**
+ * @brief layer comp stored in image resource 1065.
+ */
+struct PSDLayerComp
+{
+    qint32  id;
+    QString name;
+    quint32 capturedInfo; // 1=visibility 2=position 4=appearance.
+};
+
+/**
+ * @brief animation frame stored in 'AnDs' of image resource 4000.
+ */
+struct PSDAnimationFrame
+{
+    qint32  id;
+    qint32  delay; // 1/100 sec.
+};
+
+/**
+ * @brief layer state saved in metadata setting of layer,
+ * 'cmls' for layer comps and 'mlst' for animation frames.
+ */
+struct PSDLayerStateSetting
+{
+    QList<qint32>   ids; // comp ids or frame ids this state applies to.
+    bool            hasVisibility;
+    bool            visible;
+    bool            hasOffset;
+    QPoint          offset;
+};
+
+/**
+ * @brief file offsets of sections, unchanged parts are copied through by them.
+ */
+struct PSDFileLayout
+{
+    qint64  imageResouceOffset;
+    qint64  layerAndMaskInfoOffset;
+    qint64  layerRecordsOffset; // after layer info length and layer count.
+    qint64  channelImageDataOffset;
+    qint64  globalLayerMaskInfoOffset; // after channel image data.
+    qint64  imageDataOffset; // merged image data section.
+    quint32 layerInfoKey; // 0 if layers are in layer info, 'Lr16' or 'Lr32' if in global additional layer info.
+};
+
+/**
+ * @brief layer selector given by command line.
+ */
+struct PSDLayerSelector
+{
+    enum Kind
+    {
+        ByIndex,
+        ByLayerId,
+        ByName,
+        ByPath,
+    };
+    Kind                kind;
+    qint64              number;
+    QRegularExpression  pattern;
+};
+
 void dumpPSDFileHeaderSection(const PSDFileHeaderSection& d)
 {
     qDebug() << QString("--- PSD File Header Section ---");
@@ -142,6 +390,10 @@ void dumpPSDImageResouceSection(const PSDImageResouceSection& d)
 {
     qDebug() << QString("--- PSD Image Resouce Section ---");
     qDebug() << QString("              length: %1").arg(d.length);
+    foreach(const PSDImageResourceBlock &block, d.imageResouces)
+    {
+        qDebug() << QString("    resource id %1 length %2").arg(block.id).arg(block.data.size());
+    }
 }
 
 void dumpPSDLayerAndMaskInfoSection(const PSDLayerAndMaskInfoSection& d)
@@ -224,6 +476,20 @@ void dumpPSDLayerRecord(const PSDLayerRecord& d)
     qDebug() << QString("               flags: %1").arg(static_cast<uint>(d.flags), 2, 16, QChar('0'));
     qDebug() << QString("              filler: %1").arg(d.filler);
     qDebug() << QString("        extra length: %1").arg(d.extraDataFieldLength);
+    qDebug() << QString("    mask data length: %1").arg(d.extraData.maskData.size());
+    qDebug() << QString("     blending length: %1").arg(d.extraData.blendingRanges.size());
+    qDebug() << QString("   additional blocks: %1").arg(d.extraData.additionalLayerInfos.size());
+}
+
+void dumpPSDLayerNode(const PSDLayerNode& d)
+{
+    qDebug() << QString("layer %1 id %2 type %3 parent %4 path \"%5\"")
+        .arg(d.index)
+        .arg(d.layerId)
+        .arg(d.sectionType)
+        .arg(d.parent)
+        .arg(d.path)
+        ;
 }
 
 static QDataStream& operator>>(QDataStream& ds, PSDFileHeaderSection& d)
@@ -260,7 +526,65 @@ static QDataStream& operator>>(QDataStream& ds, PSDImageResouceSection& d)
     const auto currentEndian = ds.byteOrder();
     ds.setByteOrder(QDataStream::BigEndian);
     ds >> d.length;
-    ds.skipRawData(d.length);
+    QByteArray bytes(d.length, Qt::Uninitialized);
+    if (ds.readRawData(bytes.data(), d.length) != static_cast<int>(d.length))
+    {
+        ds.setByteOrder(currentEndian);
+        return ds;
+    }
+
+    // Pascal String の名前とデータはそれぞれ偶数長にパディングされている。
+    QDataStream in(bytes);
+    in.setByteOrder(QDataStream::BigEndian);
+    while (bytes.size() - in.device()->pos() >= 12)
+    {
+        PSDImageResourceBlock block;
+        quint8 nameLength;
+        quint32 dataLength;
+        in >> block.signature;
+        in >> block.id;
+        in >> nameLength;
+        block.name = bytes.mid(in.device()->pos(), nameLength);
+        in.skipRawData(nameLength + ((nameLength + 1) % 2));
+        in >> dataLength;
+        const auto pos = in.device()->pos();
+        if (in.status() != QDataStream::Ok || block.signature != PSDSignature8BIM || dataLength > bytes.size() - pos)
+        {
+            qDebug() << QString("invalid image resource block at section offset %1").arg(pos);
+            break;
+        }
+        block.data = bytes.mid(pos, dataLength);
+        in.skipRawData(dataLength + (dataLength % 2));
+        d.imageResouces.append(block);
+    }
+    ds.setByteOrder(currentEndian);
+    return ds;
+}
+
+static QDataStream& operator<<(QDataStream& ds, const PSDImageResouceSection& d)
+{
+    QByteArray bytes;
+    QDataStream out(&bytes, QIODevice::WriteOnly);
+    out.setByteOrder(QDataStream::BigEndian);
+    foreach(const PSDImageResourceBlock &block, d.imageResouces)
+    {
+        const quint8 nameLength = static_cast<quint8>(qMin<qsizetype>(block.name.size(), 255));
+        out << block.signature;
+        out << block.id;
+        out << nameLength;
+        out.writeRawData(block.name.constData(), nameLength);
+        if ((nameLength + 1) % 2)
+            out << static_cast<quint8>(0);
+        out << static_cast<quint32>(block.data.size());
+        out.writeRawData(block.data.constData(), block.data.size());
+        if (block.data.size() % 2)
+            out << static_cast<quint8>(0);
+    }
+
+    const auto currentEndian = ds.byteOrder();
+    ds.setByteOrder(QDataStream::BigEndian);
+    ds << static_cast<quint32>(bytes.size());
+    ds.writeRawData(bytes.constData(), bytes.size());
     ds.setByteOrder(currentEndian);
     return ds;
 }
@@ -325,7 +649,6 @@ static QDataStream& operator>>(QDataStream& ds, PSDAdditionalLayerInfo& d)
 
 static QDataStream& operator>>(QDataStream& ds, PSDLayerRecord& d)
 {
-    qDebug() << QString("PSDLayerRecord offset: 0x%1").arg(ds.device()->pos(), 0, 16);
     const auto currentEndian = ds.byteOrder();
     ds.setByteOrder(QDataStream::BigEndian);
     ds >> d.top;
@@ -363,7 +686,508 @@ static QDataStream& operator>>(QDataStream& ds, PSDLayerRecord& d)
     return ds;
 }
 
-int scanAdditionalLayerInfo(QFile &file, QDataStream& ds, qint64 remBytes)
+/**
+ * @brief read extra data of layer record.
+ *
+ * @param ds binary data stream, positioned at top of extra data.
+ * @param length extraDataFieldLength of layer record, exactly this bytes are consumed.
+ * @param d destination.
+ * @return int 0 if successfully, -1 failed.
+ */
+int readPSDLayerExtraData(QDataStream &ds, quint32 length, PSDLayerExtraData &d)
+{
+    QByteArray bytes(length, Qt::Uninitialized);
+    if (ds.readRawData(bytes.data(), length) != static_cast<int>(length))
+    {
+        qDebug() << QString("can't read layer extra data, length %1").arg(length);
+        return -1;
+    }
+
+    QDataStream in(bytes);
+    in.setByteOrder(QDataStream::BigEndian);
+    auto readLengthBlock = [&](QByteArray &block) -> bool
+    {
+        quint32 blockLength;
+        in >> blockLength;
+        const auto pos = in.device()->pos();
+        if (in.status() != QDataStream::Ok || blockLength > bytes.size() - pos)
+            return false;
+        block = bytes.mid(pos, blockLength);
+        in.skipRawData(blockLength);
+        return true;
+    };
+
+    if (!readLengthBlock(d.maskData) || !readLengthBlock(d.blendingRanges))
+    {
+        qDebug() << QString("invalid layer mask or blending ranges length.");
+        return -1;
+    }
+
+    // Pascal String は長さバイトを含めて4バイト境界に揃えられている。
+    quint8 nameLength;
+    in >> nameLength;
+    const quint32 namePadding = (4 - (nameLength + 1) % 4) % 4;
+    if (in.status() != QDataStream::Ok || nameLength + namePadding > bytes.size() - in.device()->pos())
+    {
+        qDebug() << QString("invalid layer name length %1").arg(nameLength);
+        return -1;
+    }
+    d.pascalName = bytes.mid(in.device()->pos(), nameLength);
+    in.skipRawData(nameLength + namePadding);
+
+    // layer record に付く additional layer info は長さにパディングが含まれている。
+    while (bytes.size() - in.device()->pos() >= PSDAdditionalLayerInfoSize)
+    {
+        PSDAdditionalLayerInfoBlock block;
+        quint32 blockLength;
+        in >> block.signature;
+        in >> block.key;
+        in >> blockLength;
+        const auto pos = in.device()->pos();
+        if ((block.signature != PSDSignature8BIM && block.signature != PSDSignature8B64) || blockLength > bytes.size() - pos)
+        {
+            qDebug() << QString("invalid layer additional info at extra data offset %1").arg(pos - PSDAdditionalLayerInfoSize);
+            return -1;
+        }
+        block.data = bytes.mid(pos, blockLength);
+        in.skipRawData(blockLength);
+        d.additionalLayerInfos.append(block);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief write extra data of layer record, reverse of readPSDLayerExtraData.
+ *
+ * @param ds binary data stream, big endian.
+ * @param d source.
+ */
+void writePSDLayerExtraData(QDataStream &ds, const PSDLayerExtraData &d)
+{
+    ds << static_cast<quint32>(d.maskData.size());
+    ds.writeRawData(d.maskData.constData(), d.maskData.size());
+    ds << static_cast<quint32>(d.blendingRanges.size());
+    ds.writeRawData(d.blendingRanges.constData(), d.blendingRanges.size());
+
+    const quint8 nameLength = static_cast<quint8>(qMin<qsizetype>(d.pascalName.size(), 255));
+    const quint32 namePadding = (4 - (nameLength + 1) % 4) % 4;
+    ds << nameLength;
+    ds.writeRawData(d.pascalName.constData(), nameLength);
+    for (quint32 i = 0; i < namePadding; i++)
+        ds << static_cast<quint8>(0);
+
+    foreach(const PSDAdditionalLayerInfoBlock &block, d.additionalLayerInfos)
+    {
+        ds << block.signature;
+        ds << block.key;
+        ds << static_cast<quint32>(block.data.size());
+        ds.writeRawData(block.data.constData(), block.data.size());
+    }
+}
+
+/**
+ * @brief find additional layer info block in extra data.
+ *
+ * @return const PSDAdditionalLayerInfoBlock* nullptr if not found.
+ */
+const PSDAdditionalLayerInfoBlock *findPSDAdditionalLayerInfo(const PSDLayerExtraData &d, quint32 key)
+{
+    for (const auto &block : d.additionalLayerInfos)
+    {
+        if (block.key == key)
+            return &block;
+    }
+    return nullptr;
+}
+
+static bool readPSDDescriptor(QDataStream &ds, QVariantMap *descriptor);
+
+/**
+ * @brief read unicode string(length in UTF-16 code units and UTF-16BE characters).
+ */
+static bool readPSDUnicodeString(QDataStream &ds, QString *string)
+{
+    quint32 length;
+    ds >> length;
+    if (ds.status() != QDataStream::Ok || length > (ds.device()->size() - ds.device()->pos()) / 2)
+        return false;
+    QList<char16_t> characters(length);
+    for (quint32 i = 0; i < length; i++)
+    {
+        quint16 character;
+        ds >> character;
+        characters[i] = character;
+    }
+    // 終端の NUL も長さに含まれている。
+    while (!characters.isEmpty() && characters.last() == 0)
+        characters.removeLast();
+    *string = QString::fromUtf16(characters.constData(), characters.size());
+    return ds.status() == QDataStream::Ok;
+}
+
+/**
+ * @brief read descriptor key or class id, 4 byte id if length is zero.
+ */
+static bool readPSDDescriptorKey(QDataStream &ds, QString *key)
+{
+    quint32 length;
+    ds >> length;
+    if (length == 0)
+        length = 4;
+    if (ds.status() != QDataStream::Ok || length > ds.device()->size() - ds.device()->pos())
+        return false;
+    QByteArray bytes(length, Qt::Uninitialized);
+    ds.readRawData(bytes.data(), length);
+    *key = QString::fromLatin1(bytes);
+    return ds.status() == QDataStream::Ok;
+}
+
+/**
+ * @brief read raw data item(4 byte length and bytes).
+ */
+static bool readPSDDescriptorRawData(QDataStream &ds, QByteArray *data)
+{
+    quint32 length;
+    ds >> length;
+    if (ds.status() != QDataStream::Ok || length > ds.device()->size() - ds.device()->pos())
+        return false;
+    data->resize(length);
+    ds.readRawData(data->data(), length);
+    return ds.status() == QDataStream::Ok;
+}
+
+/**
+ * @brief read descriptor item value.
+ *
+ * Values are mapped to QVariant:
+ * 'long'=int, 'comp'=qint64, 'doub'=double, 'bool'=bool, 'TEXT'=QString,
+ * 'enum'=QString(enum id), 'type'/'GlbC'=QString(class id),
+ * 'UntF'=QVariantMap{"unit","value"}, 'UnFl'=QVariantMap{"unit","values"},
+ * 'Objc'/'GlbO'=QVariantMap, 'VlLs'/'obj '=QVariantList, 'tdta'/'alis'/'Pth '=QByteArray.
+ */
+static bool readPSDDescriptorValue(QDataStream &ds, quint32 type, QVariant *value)
+{
+    switch (type)
+    {
+    case 0x4F626A63u: // 'Objc'
+    case 0x476C624Fu: // 'GlbO'
+        {
+            QVariantMap descriptor;
+            if (!readPSDDescriptor(ds, &descriptor))
+                return false;
+            *value = descriptor;
+        }
+        break;
+    case 0x566C4C73u: // 'VlLs'
+        {
+            quint32 count;
+            ds >> count;
+            QVariantList list;
+            for (quint32 i = 0; i < count && ds.status() == QDataStream::Ok; i++)
+            {
+                quint32 itemType;
+                QVariant item;
+                ds >> itemType;
+                if (!readPSDDescriptorValue(ds, itemType, &item))
+                    return false;
+                list.append(item);
+            }
+            *value = list;
+        }
+        break;
+    case 0x646F7562u: // 'doub'
+        {
+            double d;
+            ds >> d;
+            *value = d;
+        }
+        break;
+    case 0x556E7446u: // 'UntF'
+        {
+            QByteArray unit(4, Qt::Uninitialized);
+            double d;
+            ds.readRawData(unit.data(), 4);
+            ds >> d;
+            QVariantMap unitFloat;
+            unitFloat.insert("unit", QString::fromLatin1(unit));
+            unitFloat.insert("value", d);
+            *value = unitFloat;
+        }
+        break;
+    case 0x556E466Cu: // 'UnFl'
+        {
+            QByteArray unit(4, Qt::Uninitialized);
+            quint32 count;
+            ds.readRawData(unit.data(), 4);
+            ds >> count;
+            if (count > (ds.device()->size() - ds.device()->pos()) / 8)
+                return false;
+            QVariantList values;
+            for (quint32 i = 0; i < count; i++)
+            {
+                double d;
+                ds >> d;
+                values.append(d);
+            }
+            QVariantMap unitFloats;
+            unitFloats.insert("unit", QString::fromLatin1(unit));
+            unitFloats.insert("values", values);
+            *value = unitFloats;
+        }
+        break;
+    case 0x54455854u: // 'TEXT'
+        {
+            QString string;
+            if (!readPSDUnicodeString(ds, &string))
+                return false;
+            *value = string;
+        }
+        break;
+    case 0x656E756Du: // 'enum'
+        {
+            QString typeId, enumId;
+            if (!readPSDDescriptorKey(ds, &typeId) || !readPSDDescriptorKey(ds, &enumId))
+                return false;
+            *value = enumId;
+        }
+        break;
+    case 0x6C6F6E67u: // 'long'
+        {
+            qint32 i;
+            ds >> i;
+            *value = i;
+        }
+        break;
+    case 0x636F6D70u: // 'comp'
+        {
+            qint64 i;
+            ds >> i;
+            *value = i;
+        }
+        break;
+    case 0x626F6F6Cu: // 'bool'
+        {
+            quint8 b;
+            ds >> b;
+            *value = (b != 0);
+        }
+        break;
+    case 0x74797065u: // 'type'
+    case 0x476C6243u: // 'GlbC'
+        {
+            QString name, classId;
+            if (!readPSDUnicodeString(ds, &name) || !readPSDDescriptorKey(ds, &classId))
+                return false;
+            *value = classId;
+        }
+        break;
+    case 0x616C6973u: // 'alis'
+    case 0x74647461u: // 'tdta'
+    case 0x50746820u: // 'Pth '
+        {
+            QByteArray data;
+            if (!readPSDDescriptorRawData(ds, &data))
+                return false;
+            *value = data;
+        }
+        break;
+    case 0x6F626A20u: // 'obj ' reference, only class and key ids are kept.
+        {
+            quint32 count;
+            ds >> count;
+            QVariantList references;
+            for (quint32 i = 0; i < count && ds.status() == QDataStream::Ok; i++)
+            {
+                quint32 referenceType;
+                QString name, classId, keyId, enumId;
+                qint32 number;
+                ds >> referenceType;
+                switch (referenceType)
+                {
+                case 0x70726F70u: // 'prop'
+                    if (!readPSDUnicodeString(ds, &name) || !readPSDDescriptorKey(ds, &classId) || !readPSDDescriptorKey(ds, &keyId))
+                        return false;
+                    references.append(keyId);
+                    break;
+                case 0x436C7373u: // 'Clss'
+                    if (!readPSDUnicodeString(ds, &name) || !readPSDDescriptorKey(ds, &classId))
+                        return false;
+                    references.append(classId);
+                    break;
+                case 0x456E6D72u: // 'Enmr'
+                    if (!readPSDUnicodeString(ds, &name) || !readPSDDescriptorKey(ds, &classId)
+                        || !readPSDDescriptorKey(ds, &keyId) || !readPSDDescriptorKey(ds, &enumId))
+                        return false;
+                    references.append(enumId);
+                    break;
+                case 0x72656C65u: // 'rele'
+                    if (!readPSDUnicodeString(ds, &name) || !readPSDDescriptorKey(ds, &classId))
+                        return false;
+                    ds >> number;
+                    references.append(number);
+                    break;
+                case 0x49646E74u: // 'Idnt'
+                case 0x696E6478u: // 'indx'
+                    ds >> number;
+                    references.append(number);
+                    break;
+                case 0x6E616D65u: // 'name'
+                    if (!readPSDUnicodeString(ds, &name) || !readPSDDescriptorKey(ds, &classId) || !readPSDUnicodeString(ds, &name))
+                        return false;
+                    references.append(name);
+                    break;
+                default:
+                    qDebug() << QString("unknown descriptor reference type %1").arg(referenceType, 8, 16, QChar('0'));
+                    return false;
+                }
+            }
+            *value = references;
+        }
+        break;
+    default:
+        qDebug() << QString("unknown descriptor item type %1").arg(type, 8, 16, QChar('0'));
+        return false;
+    }
+    return ds.status() == QDataStream::Ok;
+}
+
+/**
+ * @brief read descriptor structure.
+ *
+ * @param ds binary data stream, big endian.
+ * @param descriptor items by key, class id of descriptor is stored as "classID".
+ * @return true if read successfully.
+ */
+static bool readPSDDescriptor(QDataStream &ds, QVariantMap *descriptor)
+{
+    QString name, classId;
+    quint32 count;
+    if (!readPSDUnicodeString(ds, &name) || !readPSDDescriptorKey(ds, &classId))
+        return false;
+    descriptor->insert("classID", classId);
+    ds >> count;
+    for (quint32 i = 0; i < count && ds.status() == QDataStream::Ok; i++)
+    {
+        QString key;
+        quint32 type;
+        QVariant value;
+        if (!readPSDDescriptorKey(ds, &key))
+            return false;
+        ds >> type;
+        if (!readPSDDescriptorValue(ds, type, &value))
+            return false;
+        descriptor->insert(key, value);
+    }
+    return ds.status() == QDataStream::Ok;
+}
+
+/**
+ * @brief read versioned descriptor(4 byte version 16 and descriptor) from bytes.
+ *
+ * @param bytes source bytes.
+ * @param offset offset of descriptor version in bytes.
+ * @param descriptor destination.
+ * @return true if read successfully.
+ */
+bool readPSDVersionedDescriptor(const QByteArray &bytes, qsizetype offset, QVariantMap *descriptor)
+{
+    QDataStream in(bytes);
+    in.setByteOrder(QDataStream::BigEndian);
+    in.skipRawData(offset);
+    quint32 version;
+    in >> version;
+    if (in.status() != QDataStream::Ok || version != 16)
+    {
+        qDebug() << QString("unsupported descriptor version %1").arg(version);
+        return false;
+    }
+    return readPSDDescriptor(in, descriptor);
+}
+
+/**
+ * @brief find metadata setting('shmd') item of layer.
+ *
+ * @param d layer extra data.
+ * @param key metadata key such as 'cmls' or 'mlst'.
+ * @return QByteArray item data, empty if not found.
+ */
+QByteArray findPSDMetadataSetting(const PSDLayerExtraData &d, quint32 key)
+{
+    const auto *shmd = findPSDAdditionalLayerInfo(d, PSDKeyMetadataSetting);
+    if (!shmd)
+        return QByteArray();
+
+    QDataStream in(shmd->data);
+    in.setByteOrder(QDataStream::BigEndian);
+    quint32 count;
+    in >> count;
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++)
+    {
+        quint32 signature, itemKey, length;
+        quint8 copyOnSheetDuplication;
+        in >> signature;
+        in >> itemKey;
+        in >> copyOnSheetDuplication;
+        in.skipRawData(3);
+        in >> length;
+        const auto pos = in.device()->pos();
+        if (in.status() != QDataStream::Ok || signature != PSDSignature8BIM || length > shmd->data.size() - pos)
+            break;
+        if (itemKey == key)
+            return shmd->data.mid(pos, length);
+        in.skipRawData(length);
+    }
+    return QByteArray();
+}
+
+/**
+ * @brief write layer record, extraDataFieldLength is recomputed from extraData.
+ */
+static QDataStream& operator<<(QDataStream& ds, const PSDLayerRecord& d)
+{
+    QByteArray extraData;
+    QDataStream extra(&extraData, QIODevice::WriteOnly);
+    extra.setByteOrder(QDataStream::BigEndian);
+    writePSDLayerExtraData(extra, d.extraData);
+
+    const auto currentEndian = ds.byteOrder();
+    ds.setByteOrder(QDataStream::BigEndian);
+    ds << d.top;
+    ds << d.left;
+    ds << d.bottom;
+    ds << d.right;
+    ds << static_cast<quint16>(d.channelInfos.size());
+    foreach(const PSDChannelInfo &info, d.channelInfos)
+    {
+        ds << info.channelId;
+        ds << info.correspondingChannelDataLength;
+    }
+    ds << d.signature;
+    ds << d.blendModeKey;
+    ds << d.opacity;
+    ds << d.clipping;
+    ds << d.flags;
+    ds << d.filler;
+    ds << static_cast<quint32>(extraData.size());
+    ds.writeRawData(extraData.constData(), extraData.size());
+    ds.setByteOrder(currentEndian);
+    return ds;
+}
+
+/**
+ * @brief scan additional layer info blocks following global layer mask info.
+ *
+ * @param file PSD file.
+ * @param ds binary data stream.
+ * @param remBytes remainder bytes of layer and mask information section.
+ * @param keys keys of blocks to keep.
+ * @param blocks receives blocks whose key is in keys, may be nullptr.
+ * @param readData false to receive only offset and length of blocks, for blocks too large to hold such as 'Lr16'.
+ * @return int 0 if successfully, -1 failed.
+ */
+int scanAdditionalLayerInfo(QFile &file, QDataStream& ds, qint64 remBytes,
+    const QList<quint32> &keys = QList<quint32>(), QList<PSDAdditionalLayerInfoBlock> *blocks = nullptr, bool readData = true)
 {
     while(remBytes > 0)
     {
@@ -401,7 +1225,27 @@ int scanAdditionalLayerInfo(QFile &file, QDataStream& ds, qint64 remBytes)
         const quint32 align = 4;
         const quint32 rem = additionalLayerInfo.length % align;
         const quint32 padding = (rem == 0 ? 0 : align - rem);
-        ds.skipRawData(additionalLayerInfo.length + padding);
+        if (blocks && keys.contains(additionalLayerInfo.characterCode))
+        {
+            PSDAdditionalLayerInfoBlock block { additionalLayerInfo.signature, additionalLayerInfo.characterCode, QByteArray() };
+            block.offset = file.pos();
+            block.length = additionalLayerInfo.length;
+            if (!readData)
+                ds.skipRawData(additionalLayerInfo.length);
+            else
+            {
+                block.data.resize(additionalLayerInfo.length);
+                if (ds.readRawData(block.data.data(), block.data.size()) != block.data.size())
+                {
+                    qDebug() << "can't read additional layer info.";
+                    return -1;
+                }
+            }
+            ds.skipRawData(padding);
+            blocks->append(block);
+        }
+        else
+            ds.skipRawData(additionalLayerInfo.length + padding);
         remBytes -= additionalLayerInfo.length + padding + PSDAdditionalLayerInfoSize;
         qDebug() << QString("remBytes: %1").arg(remBytes);
         dumpPSDAdditionalLayerInfo(additionalLayerInfo);
@@ -411,229 +1255,6101 @@ int scanAdditionalLayerInfo(QFile &file, QDataStream& ds, qint64 remBytes)
 }
 
 /**
- * @brief compostite layer channel.
- * 
- * @param img source/destination image.
- * @param bytes raw channel data.
- * @param channel 0=red/1=green/3=blue/-1=alpha
+ * @brief decodes and interns layer names of one document.
+ *
+ * Pascal String names are in system code page(CP932 on Japanese Windows), 'luni' names are UTF-16.
+ * One decoder is reused for whole document, ASCII names skip it, and equal names such as
+ * "Layer 1" or "</Layer group>" share one QString.
  */
-void compoundLayerChannel(QImage &img, const QByteArray &bytes, int channel)
+class PSDLayerNamePool
 {
-    for (int y = 0; y < img.height(); y++)
+public:
+    /**
+     * @brief decode Pascal String name without length byte.
+     */
+    QString fromPascal(const QByteArray &bytes)
     {
-        for (int x = 0; x < img.width(); x++)
+        const auto cached = pascalNames.constFind(bytes);
+        if (cached != pascalNames.constEnd())
+            return *cached;
+        const bool ascii = std::all_of(bytes.cbegin(), bytes.cend(), [](char c) { return static_cast<uchar>(c) < 0x80; });
+        const QString name = intern(ascii ? QString::fromLatin1(bytes) : QString(decoder.decode(bytes)));
+        pascalNames.insert(bytes, name);
+        return name;
+    }
+
+    /**
+     * @brief decode data of 'luni' additional layer info, UTF-16 length(u32) and big-endian UTF-16 characters.
+     */
+    QString fromUnicode(const QByteArray &luni)
+    {
+        const auto cached = unicodeNames.constFind(luni);
+        if (cached != unicodeNames.constEnd())
+            return *cached;
+        if (luni.size() < 4)
+            return QString();
+        const quint32 length = qMin<quint32>(qFromBigEndian<quint32>(luni.constData()), (luni.size() - 4) / 2);
+        QString decoded(length, Qt::Uninitialized);
+        for (quint32 i = 0; i < length; i++)
+            decoded[i] = QChar(qFromBigEndian<quint16>(luni.constData() + 4 + 2 * i));
+        // 末尾の NUL は名前に含めない。
+        while (!decoded.isEmpty() && decoded.endsWith(QChar(0)))
+            decoded.chop(1);
+        const QString name = intern(decoded);
+        unicodeNames.insert(luni, name);
+        return name;
+    }
+
+    QString intern(const QString &name)
+    {
+        return *strings.insert(name);
+    }
+
+private:
+    // 不正なバイト列の状態が次の名前に持ち越されないよう stateless にする。
+    QStringDecoder              decoder { QStringDecoder::System, QStringDecoder::Flag::Stateless };
+    QSet<QString>               strings;
+    QHash<QByteArray, QString>  pascalNames;
+    QHash<QByteArray, QString>  unicodeNames;
+};
+
+/**
+ * @brief color of descriptor, RGB and grayscale colors are supported.
+ */
+QRgb psdDescriptorColor(const QVariantMap &color)
+{
+    const QString classId = color.value("classID").toString();
+    if (classId == "Grsc")
+    {
+        const int gray = qBound(0, qRound(255.0 * (1.0 - color.value("Gry ").toDouble() / 100.0)), 255);
+        return qRgb(gray, gray, gray);
+    }
+    if (classId != "RGBC")
+        qDebug() << QString("unsupported color class %1").arg(classId);
+    return qRgb(qBound(0, qRound(color.value("Rd  ").toDouble()), 255),
+        qBound(0, qRound(color.value("Grn ").toDouble()), 255), qBound(0, qRound(color.value("Bl  ").toDouble()), 255));
+}
+
+/**
+ * @brief build color ramp of gradient from its color and transparency stops.
+ *
+ * @param gradient "Grad" object of gradient fill.
+ * @return QList<QRgb> PSDGradientRampSize colors.
+ */
+QList<QRgb> buildPSDGradientRamp(const QVariantMap &gradient)
+{
+    struct Stop
+    {
+        double  location; // 0-1.
+        double  midpoint; // 0-1, between previous stop and this stop.
+        double  value[4];
+    };
+    QList<Stop> colors, opacities;
+    foreach(const QVariant &item, gradient.value("Clrs").toList())
+    {
+        const QVariantMap stop = item.toMap();
+        const QString type = stop.value("Type").toString();
+        const QRgb color = type == "FrgC" ? qRgb(0, 0, 0) : type == "BckC" ? qRgb(255, 255, 255) : psdDescriptorColor(stop.value("Clr ").toMap());
+        colors.append(Stop { stop.value("Lctn").toInt() / 4096.0, stop.value("Mdpn", 50).toInt() / 100.0,
+            { double(qRed(color)), double(qGreen(color)), double(qBlue(color)), 0 } });
+    }
+    foreach(const QVariant &item, gradient.value("Trns").toList())
+    {
+        const QVariantMap stop = item.toMap();
+        opacities.append(Stop { stop.value("Lctn").toInt() / 4096.0, stop.value("Mdpn", 50).toInt() / 100.0,
+            { 0, 0, 0, 255.0 * stop.value("Opct").toMap().value("value", 100).toDouble() / 100.0 } });
+    }
+    if (colors.isEmpty())
+        colors = { Stop { 0, 0.5, { 0, 0, 0, 0 } }, Stop { 1, 0.5, { 255, 255, 255, 0 } } };
+    if (opacities.isEmpty())
+        opacities = { Stop { 0, 0.5, { 0, 0, 0, 255 } } };
+    const auto byLocation = [](const Stop &a, const Stop &b) { return a.location < b.location; };
+    std::stable_sort(colors.begin(), colors.end(), byLocation);
+    std::stable_sort(opacities.begin(), opacities.end(), byLocation);
+    const auto sample = [](const QList<Stop> &stops, double t, int c) -> double
+    {
+        if (t <= stops.first().location)
+            return stops.first().value[c];
+        for (int k = 1; k < stops.size(); k++)
         {
-            quint32 pixel = img.pixel(x, y);
-            const auto offset = y * img.width() + x;
-            if (offset >= bytes.size())
+            const Stop &a = stops.at(k - 1), &b = stops.at(k);
+            if (t > b.location)
+                continue;
+            double f = b.location > a.location ? (t - a.location) / (b.location - a.location) : 1.0;
+            // 中間点では半分の色になるよう曲げる。
+            if (b.midpoint > 0 && b.midpoint < 1 && b.midpoint != 0.5)
+                f = std::pow(f, std::log(0.5) / std::log(b.midpoint));
+            return a.value[c] + (b.value[c] - a.value[c]) * f;
+        }
+        return stops.last().value[c];
+    };
+    QList<QRgb> ramp(PSDGradientRampSize);
+    for (int i = 0; i < PSDGradientRampSize; i++)
+    {
+        const double t = static_cast<double>(i) / (PSDGradientRampSize - 1);
+        ramp[i] = qRgba(qRound(sample(colors, t, 0)), qRound(sample(colors, t, 1)), qRound(sample(colors, t, 2)), qRound(sample(opacities, t, 3)));
+    }
+    return ramp;
+}
+
+/**
+ * @brief read fill layer settings('SoCo', 'GdFl' or 'PtFl') of layer.
+ *
+ * @param d layer extra data.
+ * @param fill receives settings, fill->type is left PSDFillNone if layer is not fill layer.
+ * @return true if layer is fill layer.
+ */
+bool readPSDFillLayer(const PSDLayerExtraData &d, PSDFillLayer *fill)
+{
+    QVariantMap descriptor;
+    if (const auto *soco = findPSDAdditionalLayerInfo(d, PSDKeySolidColorSheetSetting))
+    {
+        if (!readPSDVersionedDescriptor(soco->data, 0, &descriptor))
+            return false;
+        fill->type = PSDFillSolid;
+        fill->color = psdDescriptorColor(descriptor.value("Clr ").toMap());
+    }
+    else if (const auto *gdfl = findPSDAdditionalLayerInfo(d, PSDKeyGradientFillSetting))
+    {
+        if (!readPSDVersionedDescriptor(gdfl->data, 0, &descriptor))
+            return false;
+        const QStringList types = { "Lnr ", "Rdl ", "Angl", "Rflc", "Dmnd" };
+        const QVariantMap gradient = descriptor.value("Grad").toMap();
+        const QVariantMap offset = descriptor.value("Ofst").toMap();
+        fill->type = PSDFillGradient;
+        fill->gradientType = static_cast<PSDGradientType>(qMax(0, static_cast<int>(types.indexOf(descriptor.value("Type").toString()))));
+        fill->angle = descriptor.value("Angl").toMap().value("value", 90).toDouble();
+        fill->scale = descriptor.value("Scl ").toMap().value("value", 100).toDouble();
+        fill->offsetX = offset.value("Hrzn").toMap().value("value").toDouble();
+        fill->offsetY = offset.value("Vrtc").toMap().value("value").toDouble();
+        fill->reverse = descriptor.value("Rvrs").toBool();
+        if (gradient.value("GrdF").toString() != "CstS")
+            qDebug() << QString("unsupported gradient form %1, rendered as solid gradient.").arg(gradient.value("GrdF").toString());
+        fill->ramp = buildPSDGradientRamp(gradient);
+    }
+    else if (const auto *ptfl = findPSDAdditionalLayerInfo(d, PSDKeyPatternFillSetting))
+    {
+        if (!readPSDVersionedDescriptor(ptfl->data, 0, &descriptor))
+            return false;
+        const QVariantMap phase = descriptor.value("phase").toMap();
+        fill->type = PSDFillPattern;
+        fill->patternId = descriptor.value("Ptrn").toMap().value("Idnt").toString();
+        fill->scale = descriptor.value("Scl ").toMap().value("value", 100).toDouble();
+        fill->phaseX = phase.value("Hrzn").toDouble();
+        fill->phaseY = phase.value("Vrtc").toDouble();
+    }
+    if (fill->scale <= 0)
+        fill->scale = 100;
+    return fill->type != PSDFillNone;
+}
+
+/**
+ * @brief build "Blend If" weight tables from layer blending ranges.
+ *
+ * Each range is black low, black high, white low and white high, the weight is 0 outside of
+ * black low to white high and ramps linearly between the low and high of each split.
+ *
+ * @param ranges blending ranges of layer extra data, gray range pair followed by pair of each channel.
+ * @return QByteArray 8 tables of 256 weights(0-255) for gray, red, green and blue of layer pixel
+ *         then of underlying pixel, empty if all ranges are default.
+ */
+QByteArray readPSDBlendIfTables(const QByteArray &ranges)
+{
+    const int pairs = qMin<int>(ranges.size() / 8, 4);
+    bool isDefault = true;
+    for (int i = 0; i < pairs * 8; i += 4)
+    {
+        const uchar *range = reinterpret_cast<const uchar *>(ranges.constData()) + i;
+        isDefault = isDefault && range[0] == 0 && range[1] == 0 && range[2] == 255 && range[3] == 255;
+    }
+    if (isDefault)
+        return QByteArray();
+
+    QByteArray tables(8 * 256, char(255));
+    for (int pair = 0; pair < pairs; pair++)
+    {
+        for (int side = 0; side < 2; side++)
+        {
+            const uchar *range = reinterpret_cast<const uchar *>(ranges.constData()) + pair * 8 + side * 4;
+            const int blackLow = range[0], blackHigh = qMax<int>(range[0], range[1]);
+            const int whiteLow = qMax(blackHigh, int(range[2])), whiteHigh = qMax<int>(whiteLow, range[3]);
+            uchar *table = reinterpret_cast<uchar *>(tables.data()) + (side * 4 + pair) * 256;
+            for (int v = 0; v < 256; v++)
             {
-                qDebug() << QString("compoundLayerChannel: source bytes offset out of range");
-                return;
+                int weight = 255;
+                if (v < blackLow)
+                    weight = 0;
+                else if (v < blackHigh)
+                    weight = ((v - blackLow) * 255 + (blackHigh - blackLow) / 2) / (blackHigh - blackLow);
+                else if (v > whiteHigh)
+                    weight = 0;
+                else if (v > whiteLow)
+                    weight = ((whiteHigh - v) * 255 + (whiteHigh - whiteLow) / 2) / (whiteHigh - whiteLow);
+                table[v] = static_cast<uchar>(weight);
             }
-            const quint32 subPixel = bytes.at(offset) & 0xFFU;
-            switch(channel)
+        }
+    }
+    return tables;
+}
+
+/**
+ * @brief build layer tree from layer records.
+ *
+ * Layer records are stored bottom to top, so a group record(open/closed folder)
+ * comes after its children and the hidden bounding section record comes before them.
+ * Layer name is taken from 'luni' if present, otherwise from Pascal String.
+ *
+ * @param records layer records.
+ * @param channelImageDataOffset file offset of channel image data of first layer.
+ * @return QList<PSDLayerNode> nodes in same order as records.
+ */
+QList<PSDLayerNode> buildPSDLayerTree(const QList<PSDLayerRecord> &records, qint64 channelImageDataOffset)
+{
+    PSDLayerNamePool names;
+    QList<PSDLayerNode> nodes(records.size());
+
+    qint64 offset = channelImageDataOffset;
+    for (int i = 0; i < records.size(); i++)
+    {
+        const auto &record = records.at(i);
+        auto &node = nodes[i];
+        node.index = i;
+        const auto *luni = findPSDAdditionalLayerInfo(record.extraData, PSDKeyUnicodeLayerName);
+        node.name = luni ? names.fromUnicode(luni->data) : names.fromPascal(record.extraData.pascalName);
+        node.layerId = -1;
+        node.sectionType = PSDSectionDividerAnyOther;
+        node.parent = -1;
+        node.channelDataOffset = offset;
+        node.channelDataLength = 0;
+        foreach(const PSDChannelInfo &info, record.channelInfos)
+        {
+            node.channelDataLength += info.correspondingChannelDataLength;
+        }
+        offset += node.channelDataLength;
+
+        const auto *lsct = findPSDAdditionalLayerInfo(record.extraData, PSDKeySectionDividerSetting);
+        if (lsct && lsct->data.size() >= 4)
+            node.sectionType = qFromBigEndian<quint32>(lsct->data.constData());
+        const auto *lyid = findPSDAdditionalLayerInfo(record.extraData, PSDKeyLayerId);
+        if (lyid && lyid->data.size() >= 4)
+            node.layerId = qFromBigEndian<qint32>(lyid->data.constData());
+        node.blendIf = readPSDBlendIfTables(record.extraData.blendingRanges);
+        if (readPSDFillLayer(record.extraData, &node.fill))
+            node.fill.bounds = QRect(QPoint(record.left, record.top), QPoint(record.right - 1, record.bottom - 1));
+    }
+
+    // walk top to bottom to resolve parent groups.
+    QList<int> groups;
+    for (int i = records.size() - 1; i >= 0; i--)
+    {
+        auto &node = nodes[i];
+        node.parent = groups.isEmpty() ? -1 : groups.last();
+        node.path = node.parent < 0 ? node.name : nodes.at(node.parent).path + QChar('/') + node.name;
+        if (node.sectionType == PSDSectionDividerOpenFolder || node.sectionType == PSDSectionDividerClosedFolder)
+            groups.append(i);
+        else if (node.sectionType == PSDSectionDividerBoundingSection && !groups.isEmpty())
+            groups.removeLast();
+    }
+
+    return nodes;
+}
+
+/**
+ * @brief parse layer selector.
+ *
+ * @param text "#<index>", "id:<layer id>", "path:<group/name glob>" or "<name glob>".
+ * @param selector destination.
+ * @return true if parsed successfully.
+ */
+bool parsePSDLayerSelector(const QString &text, PSDLayerSelector *selector)
+{
+    bool ok = true;
+    if (text.startsWith(QChar('#')))
+    {
+        selector->kind = PSDLayerSelector::ByIndex;
+        selector->number = text.mid(1).toLongLong(&ok);
+    }
+    else if (text.startsWith("id:"))
+    {
+        selector->kind = PSDLayerSelector::ByLayerId;
+        selector->number = text.mid(3).toLongLong(&ok);
+    }
+    else if (text.startsWith("path:"))
+    {
+        // '*' と '?' はパス区切りを跨がない。
+        selector->kind = PSDLayerSelector::ByPath;
+        selector->pattern = QRegularExpression(QRegularExpression::wildcardToRegularExpression(text.mid(5)));
+    }
+    else
+    {
+        selector->kind = PSDLayerSelector::ByName;
+        selector->pattern = QRegularExpression(QRegularExpression::wildcardToRegularExpression(text, QRegularExpression::NonPathWildcardConversion));
+    }
+    if (!ok || (selector->kind >= PSDLayerSelector::ByName && !selector->pattern.isValid()))
+    {
+        qDebug() << QString("invalid layer selector: %1").arg(text);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief true if layer node matches selector, parent groups are not considered.
+ */
+bool matchPSDLayerSelector(const PSDLayerNode &node, const PSDLayerSelector &selector)
+{
+    switch (selector.kind)
+    {
+    case PSDLayerSelector::ByIndex:
+        return node.index == selector.number;
+    case PSDLayerSelector::ByLayerId:
+        return node.layerId == selector.number;
+    case PSDLayerSelector::ByName:
+        return selector.pattern.match(node.name).hasMatch();
+    case PSDLayerSelector::ByPath:
+        return selector.pattern.match(node.path).hasMatch();
+    }
+    return false;
+}
+
+/**
+ * @brief evaluate selectors against layer tree.
+ *
+ * A selected group selects all of its descendants.
+ * No selectors select all layers.
+ *
+ * @return QList<bool> selected flag per layer record.
+ */
+QList<bool> selectPSDLayers(const QList<PSDLayerNode> &nodes, const QList<PSDLayerSelector> &selectors)
+{
+    QList<bool> selected(nodes.size(), selectors.isEmpty());
+    if (selectors.isEmpty())
+        return selected;
+
+    // parent group always has larger index than its children.
+    for (int i = nodes.size() - 1; i >= 0; i--)
+    {
+        const auto &node = nodes.at(i);
+        if (node.parent >= 0 && selected.at(node.parent))
+        {
+            selected[i] = true;
+            continue;
+        }
+        for (const auto &selector : selectors)
+        {
+            if (matchPSDLayerSelector(node, selector))
             {
-            case -1: // A
-                pixel = (pixel & 0x00FFFFFFU) | (subPixel << 24);
-                break;
-            case 0: // R
-                pixel = (pixel & 0xFF00FFFFU) | (subPixel << 16);
-                break;
-            case 1: // G
-                pixel = (pixel & 0xFFFF00FFU) | (subPixel << 8);
-                break;
-            case 2: // B
-                pixel = (pixel & 0xFFFFFF00U) | (subPixel << 0);
+                selected[i] = true;
                 break;
-            default:
-                qDebug() << QString("unknown channels is passed %1").arg(channel);
-                return;
             }
-            img.setPixel(x, y, pixel);
         }
     }
+    return selected;
 }
 
-QByteArray uncompressRLE(int width, int height, const QByteArray &compressed)
+/**
+ * @brief span event recorded by PSDTraceScope.
+ */
+struct PSDTraceEvent
 {
-    qDebug() << QString("uncompressRLE width=%1 height=%2 compression=%3").arg(width).arg(height).arg(compressed.size());
+    const char *name;
+    qint64      begin; // nsec from start of trace.
+    qint64      duration;
+    qint64      arg; // layer index, channel id and so on, -1 if none.
+};
 
-    QDataStream in(compressed);
-    in.setByteOrder(QDataStream::BigEndian);
+/**
+ * @brief span tracer writing Chrome trace event JSON(viewable in Perfetto), enabled by --trace.
+ *
+ * Each thread records spans to its own ring buffer without locking,
+ * buffers are written to file when the process finishes.
+ */
+class PSDTracer
+{
+public:
+    static PSDTracer &instance()
+    {
+        static PSDTracer tracer;
+        return tracer;
+    }
 
-    // read length table.
-    QList<quint16> lengthTable(height, 0);
-    for (int i = 0; i < height; i++)
+    ~PSDTracer()
+    {
+        qDeleteAll(buffers);
+    }
+
+    void start()
+    {
+        timer.start();
+        enabled.storeRelease(1);
+    }
+
+    bool isEnabled() const
     {
-        if (in.atEnd())
+        return enabled.loadRelaxed() != 0;
+    }
+
+    qint64 now() const
+    {
+        return timer.nsecsElapsed();
+    }
+
+    void record(const PSDTraceEvent &event)
+    {
+        // バッファはスレッド終了後も書き出しまで残すためヒープに置いてトレーサーが所有する。
+        thread_local Buffer *buffer = nullptr;
+        if (!buffer)
         {
-            qDebug() << QString("can't uncompress RLE, compression source byte too small.");
-            return QByteArray();
+            QMutexLocker locker(&mutex);
+            buffer = new Buffer { static_cast<int>(buffers.size()), 0, QList<PSDTraceEvent>(Capacity) };
+            buffers.append(buffer);
         }
-        in >> lengthTable[i];
+        // 溢れた場合は古いイベントから上書きする。
+        buffer->events[buffer->next % Capacity] = event;
+        buffer->next++;
     }
-    qDebug() << "scanline length table loaded.";
 
-    // uncompress scanlines.
-    QByteArray channel(width * height, '\0');
-    for (int y = 0; y < height; y++)
+    /**
+     * @brief stop tracing and write recorded spans as Chrome trace JSON.
+     *
+     * @param path output file path.
+     * @return int 0 if successfully, -1 failed.
+     */
+    int write(const QString &path)
     {
-        QByteArray scanLine(width, '\0');
-        int scanLinePos = 0;
-        for (int i = 0; i < lengthTable[y];)
+        enabled.storeRelease(0);
+        QFile file(path);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
         {
-            char code;
-            in >> code;
-            i++;
-            //qDebug() << QString("code %1 i=%2 length=%3").arg(code).arg(i).arg(length);
-            if (code < 0)
+            qDebug() << QString("can't open trace file %1").arg(path);
+            return -1;
+        }
+
+        QMutexLocker locker(&mutex);
+        QByteArray json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        foreach(const Buffer *buffer, buffers)
+        {
+            json += QString("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%1,\"args\":{\"name\":\"%2\"}},\n")
+                .arg(buffer->threadId)
+                .arg(buffer->threadId == 0 ? QString("main") : QString("worker %1").arg(buffer->threadId))
+                .toUtf8();
+            const quint64 first = buffer->next > Capacity ? buffer->next - Capacity : 0;
+            for (quint64 i = first; i < buffer->next; i++)
             {
-                // continuous
-                int continuousLength = 1 - code;
-                if ((continuousLength + scanLinePos) > width) 
-                {
-                    qDebug() << QString("continuous length too large length=%1 width=%2").arg(continuousLength + scanLinePos).arg(width);
-                    return QByteArray();
-                }
-                char data;
-                in >> data;
-                i++;
-                for (int j = 0; j < continuousLength; j++, scanLinePos++)
-                {
-                    scanLine[scanLinePos] = data;
-                    //qDebug() << QString("C scanLinePos %1 rem %2").arg(scanLinePos).arg(continuousLength - j);
-                }
+                const auto &event = buffer->events.at(i % Capacity);
+                json += QString("{\"name\":\"%1\",\"ph\":\"X\",\"pid\":1,\"tid\":%2,\"ts\":%3,\"dur\":%4,\"args\":{\"arg\":%5}},\n")
+                    .arg(event.name)
+                    .arg(buffer->threadId)
+                    .arg(event.begin / 1000.0, 0, 'f', 3)
+                    .arg(event.duration / 1000.0, 0, 'f', 3)
+                    .arg(event.arg)
+                    .toUtf8();
+            }
+            if (first > 0)
+                qDebug() << QString("trace buffer of thread %1 overflowed, %2 events dropped.").arg(buffer->threadId).arg(first);
+        }
+        if (json.endsWith(",\n"))
+            json.chop(2);
+        json += "\n]}\n";
+        if (file.write(json) != json.size())
+        {
+            qDebug() << QString("can't write trace file %1").arg(path);
+            return -1;
+        }
+        qDebug() << QString("trace saved to %1").arg(path);
+        return 0;
+    }
+
+private:
+    struct Buffer
+    {
+        int                     threadId; // 0 is the thread which recorded first, usually main.
+        quint64                 next;
+        QList<PSDTraceEvent>    events;
+    };
+
+    static const quint64 Capacity = 1 << 16;
+
+    QElapsedTimer   timer;
+    QAtomicInt      enabled;
+    QMutex          mutex;
+    QList<Buffer *> buffers;
+};
+
+/**
+ * @brief record span from construction to destruction, does nothing unless tracing is enabled.
+ */
+class PSDTraceScope
+{
+public:
+    explicit PSDTraceScope(const char *name, qint64 arg = -1)
+        : name(name), arg(arg), begin(PSDTracer::instance().isEnabled() ? PSDTracer::instance().now() : -1)
+    {
+    }
+
+    ~PSDTraceScope()
+    {
+        finish();
+    }
+
+    /**
+     * @brief close current span and open next one, for sequential sections in one function.
+     */
+    void restart(const char *nextName, qint64 nextArg = -1)
+    {
+        finish();
+        name = nextName;
+        arg = nextArg;
+        begin = PSDTracer::instance().isEnabled() ? PSDTracer::instance().now() : -1;
+    }
+
+private:
+    void finish()
+    {
+        if (begin < 0)
+            return;
+        PSDTracer::instance().record(PSDTraceEvent { name, begin, PSDTracer::instance().now() - begin, arg });
+        begin = -1;
+    }
+
+    const char  *name;
+    qint64      arg;
+    qint64      begin;
+};
+
+/**
+ * @brief thread local pool of buffers for channel, scanline and compressed data.
+ *
+ * Buffers are recycled by power of two size class across channels, layers and files.
+ * Acquired buffers are not initialized, callers overwrite them anyway.
+ * Pooled bytes are capped for whole process, a pool releases its buffers when its thread exits.
+ */
+class PSDBufferPool
+{
+public:
+    static PSDBufferPool &local()
+    {
+        thread_local PSDBufferPool pool;
+        return pool;
+    }
+
+    ~PSDBufferPool()
+    {
+        clear();
+    }
+
+    /**
+     * @brief free all pooled buffers of this thread.
+     */
+    void clear()
+    {
+        for (auto &buffers : freeBuffers)
+            buffers.clear();
+        totalPooledBytes().fetchAndAddRelaxed(-pooledBytes);
+        pooledBytes = 0;
+    }
+
+    /**
+     * @brief acquire uninitialized buffer of size bytes.
+     */
+    QByteArray acquire(qsizetype size)
+    {
+        const int sizeClass = sizeClassOf(size);
+        if (sizeClass < MinSizeClass || sizeClass > MaxSizeClass)
+            return QByteArray(size, Qt::Uninitialized);
+        auto &buffers = freeBuffers[sizeClass];
+        QByteArray buffer;
+        if (!buffers.isEmpty())
+        {
+            buffer = buffers.takeLast();
+            pooledBytes -= buffer.capacity();
+            totalPooledBytes().fetchAndAddRelaxed(-buffer.capacity());
+        }
+        else
+        {
+            buffer.reserve(static_cast<qsizetype>(1) << sizeClass);
+        }
+        buffer.resize(size);
+        return buffer;
+    }
+
+    /**
+     * @brief return buffer to pool, buffer is left null.
+     */
+    void release(QByteArray &buffer)
+    {
+        // capacity を下回るサイズクラスなら、そのクラスのどの要求にも再確保なしで応えられる。
+        int sizeClass = sizeClassOf(buffer.capacity());
+        if ((static_cast<qsizetype>(1) << sizeClass) > buffer.capacity())
+            sizeClass--;
+        if (sizeClass >= MinSizeClass && sizeClass <= MaxSizeClass && buffer.isDetached()
+            && freeBuffers[sizeClass].size() < MaxBuffersPerClass)
+        {
+            // 全スレッドの合計で上限を超えるなら取り消して捨てる。
+            const qint64 capacity = buffer.capacity();
+            if (totalPooledBytes().fetchAndAddRelaxed(capacity) + capacity <= MaxPooledBytes)
+            {
+                pooledBytes += capacity;
+                freeBuffers[sizeClass].append(std::move(buffer));
             }
             else
             {
-                // discontinuity
-                int discontinuousLength = code + 1;
-                if ((discontinuousLength + scanLinePos) > width) 
-                {
-                    qDebug() << QString("discontinuous length too large length=%1 width=%2").arg(discontinuousLength + scanLinePos).arg(width);
-                    return QByteArray();
-                }
-                for (int j = 0; j < discontinuousLength; j++, scanLinePos++)
-                {
-                    char data;
-                    in >> data;
-                    i++;
-                    scanLine[scanLinePos] = data;
-                    //qDebug() << QString("D scanLinePos %1 rem %2").arg(scanLinePos).arg(discontinuousLength - j);
-                }
+                totalPooledBytes().fetchAndAddRelaxed(-capacity);
             }
         }
-        // transfer scanline.
-        for (int x = 0; x < width; x++)
+        buffer = QByteArray();
+    }
+
+    /**
+     * @brief acquire uninitialized Format_ARGB32 image, its buffer returns to pool when the image is destroyed.
+     */
+    QImage acquireImage(int width, int height)
+    {
+        if (width <= 0 || height <= 0)
+            return QImage();
+        auto *buffer = new QByteArray(acquire(static_cast<qsizetype>(width) * height * sizeof(QRgb)));
+        return QImage(reinterpret_cast<uchar *>(buffer->data()), width, height, width * sizeof(QRgb), QImage::Format_ARGB32,
+            [](void *info)
+            {
+                auto *buffer = static_cast<QByteArray *>(info);
+                PSDBufferPool::local().release(*buffer);
+                delete buffer;
+            }, buffer);
+    }
+
+private:
+    static QAtomicInteger<qint64> &totalPooledBytes()
+    {
+        static QAtomicInteger<qint64> total;
+        return total;
+    }
+
+    static int sizeClassOf(qsizetype size)
+    {
+        int sizeClass = 0;
+        while ((static_cast<qsizetype>(1) << sizeClass) < size)
+            sizeClass++;
+        return sizeClass;
+    }
+
+    static const int MinSizeClass = 12; // 4 KiB, smaller buffers are cheap enough.
+    static const int MaxSizeClass = 30; // 1 GiB
+    static const int MaxBuffersPerClass = 4;
+    static const qint64 MaxPooledBytes = static_cast<qint64>(512) << 20; // all threads
+
+    QList<QByteArray>   freeBuffers[MaxSizeClass + 1];
+    qint64              pooledBytes = 0;
+};
+
+/**
+ * @brief CPUs of each NUMA node, read from /sys/devices/system/node.
+ *
+ * Only CPUs the process may run on are kept and nodes without such CPUs(memory only nodes) are dropped.
+ * Without NUMA information there is one node whose CPU list is empty, its threads are not pinned.
+ */
+class PSDNumaTopology
+{
+public:
+    static const PSDNumaTopology &instance()
+    {
+        static const PSDNumaTopology topology;
+        return topology;
+    }
+
+    int nodeCount() const { return nodes.size(); }
+    const QList<int> &cpus(int node) const { return nodes.at(node); }
+    int cpuCount() const
+    {
+        int count = 0;
+        for (const auto &cpus : nodes)
+            count += cpus.size();
+        return count;
+    }
+
+    /**
+     * @brief parse cpulist format such as "0-7,16-23".
+     */
+    static QList<int> parseCpuList(const QString &text)
+    {
+        QList<int> cpus;
+        foreach(const QString &range, text.trimmed().split(QChar(','), Qt::SkipEmptyParts))
+        {
+            const QStringList bounds = range.split(QChar('-'));
+            bool firstOk, lastOk;
+            const int first = bounds.first().toInt(&firstOk);
+            const int last = bounds.last().toInt(&lastOk);
+            if (!firstOk || !lastOk || bounds.size() > 2)
+                return QList<int>();
+            for (int cpu = first; cpu <= last; cpu++)
+                cpus.append(cpu);
+        }
+        return cpus;
+    }
+
+private:
+    PSDNumaTopology()
+    {
+#ifdef Q_OS_LINUX
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        const bool hasAllowed = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+        QDir dir("/sys/devices/system/node");
+        QStringList entries = dir.entryList(QStringList() << "node*", QDir::Dirs);
+        std::sort(entries.begin(), entries.end(), [](const QString &a, const QString &b) { return a.mid(4).toInt() < b.mid(4).toInt(); });
+        foreach(const QString &entry, entries)
+        {
+            QFile file(dir.filePath(entry + "/cpulist"));
+            if (!file.open(QIODevice::ReadOnly))
+                continue;
+            QList<int> cpus;
+            foreach(int cpu, parseCpuList(QString::fromLatin1(file.readAll())))
+            {
+                if (cpu < CPU_SETSIZE && (!hasAllowed || CPU_ISSET(cpu, &allowed)))
+                    cpus.append(cpu);
+            }
+            if (!cpus.isEmpty())
+                nodes.append(cpus);
+        }
+#endif
+        if (nodes.isEmpty())
+            nodes.append(QList<int>());
+        for (int node = 0; node < nodes.size(); node++)
+            qDebug() << QString("NUMA node %1: %2 cpus").arg(node).arg(nodes.at(node).size());
+    }
+
+    QList<QList<int>> nodes;
+};
+
+/**
+ * @brief thread pool of NUMA node the current thread is pinned to, global thread pool otherwise.
+ *
+ * Parallel work is started on this pool so that work spawned while decoding a file stays on the node
+ * which read the file, buffers of PSDBufferPool are thread local and so they stay on the node too.
+ */
+static thread_local QThreadPool *psdNodeThreadPool = nullptr;
+
+QThreadPool *psdThreadPool()
+{
+    return psdNodeThreadPool ? psdNodeThreadPool : QThreadPool::globalInstance();
+}
+
+/**
+ * @brief pin current thread to CPUs.
+ */
+static bool pinPSDThread(const QList<int> &cpus)
+{
+#ifdef Q_OS_LINUX
+    if (cpus.isEmpty())
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    Q_UNUSED(cpus);
+    return false;
+#endif
+}
+
+/**
+ * @brief one thread pool per NUMA node with workers pinned to CPUs of the node.
+ *
+ * Threads are divided among nodes in proportion to their CPUs. Every worker is started and pinned up front
+ * and never expires, so any task run by a node pool runs on that node.
+ */
+class PSDNumaScheduler
+{
+public:
+    explicit PSDNumaScheduler(int maxThreads)
+    {
+        const auto &topology = PSDNumaTopology::instance();
+        const int cpuCount = qMax(1, topology.cpuCount());
+        int assigned = 0;
+        QList<int> threads;
+        for (int node = 0; node < topology.nodeCount(); node++)
+        {
+            const int share = topology.nodeCount() == 1 ? maxThreads : maxThreads * topology.cpus(node).size() / cpuCount;
+            threads.append(share);
+            assigned += share;
+        }
+        // 端数は先頭のノードから配り、スレッドが無いノードは使わない。
+        for (int node = 0; assigned < maxThreads; node = (node + 1) % threads.size(), assigned++)
+            threads[node]++;
+        for (int node = 0; node < threads.size(); node++)
+        {
+            if (threads.at(node) == 0)
+                continue;
+            auto *pool = new QThreadPool();
+            pool->setMaxThreadCount(threads.at(node));
+            pool->setExpiryTimeout(-1);
+            const QList<int> cpus = topology.cpus(node);
+            for (int i = 0; i < threads.at(node); i++)
+            {
+                // 全員がそろうまで待たせ、各タスクが別スレッドで動くようにする。
+                pool->start([this, pool, cpus]()
+                {
+                    pinPSDThread(cpus);
+                    psdNodeThreadPool = pool;
+                    started.release();
+                    proceed.acquire();
+                    finished.release();
+                });
+            }
+            started.acquire(threads.at(node));
+            proceed.release(threads.at(node));
+            finished.acquire(threads.at(node));
+            pools.append(pool);
+            qDebug() << QString("NUMA node %1: %2 workers").arg(node).arg(threads.at(node));
+        }
+    }
+
+    ~PSDNumaScheduler()
+    {
+        // プールの破棄でワーカーが終了し、スレッドローカルなバッファプールも解放される。
+        qDeleteAll(pools);
+    }
+
+    int poolCount() const { return pools.size(); }
+    QThreadPool *pool(int index) const { return pools.at(index); }
+
+    /**
+     * @brief run body(index of pool) on a worker of each node pool and wait for all of them.
+     */
+    template<typename Body>
+    void runOnEachNode(Body body)
+    {
+        QList<QFuture<void>> futures;
+        for (int i = 0; i < pools.size(); i++)
+            futures.append(QtConcurrent::run(pools.at(i), [body, i]() { body(i); }));
+        for (auto &future : futures)
+            future.waitForFinished();
+    }
+
+private:
+    QList<QThreadPool *> pools;
+    QSemaphore started;
+    QSemaphore proceed;
+    QSemaphore finished;
+};
+
+/**
+ * @brief compostite layer channel.
+ * 
+ * @param img source/destination image.
+ * @param bytes raw channel data.
+ * @param channel 0=red/1=green/3=blue/-1=alpha
+ */
+void compoundLayerChannel(QImage &img, const QByteArray &bytes, int channel)
+{
+    PSDTraceScope trace("compoundLayerChannel", channel);
+    for (int y = 0; y < img.height(); y++)
+    {
+        for (int x = 0; x < img.width(); x++)
+        {
+            quint32 pixel = img.pixel(x, y);
+            const auto offset = y * img.width() + x;
+            if (offset >= bytes.size())
+            {
+                qDebug() << QString("compoundLayerChannel: source bytes offset out of range");
+                return;
+            }
+            const quint32 subPixel = bytes.at(offset) & 0xFFU;
+            switch(channel)
+            {
+            case -1: // A
+                pixel = (pixel & 0x00FFFFFFU) | (subPixel << 24);
+                break;
+            case 0: // R
+                pixel = (pixel & 0xFF00FFFFU) | (subPixel << 16);
+                break;
+            case 1: // G
+                pixel = (pixel & 0xFFFF00FFU) | (subPixel << 8);
+                break;
+            case 2: // B
+                pixel = (pixel & 0xFFFFFF00U) | (subPixel << 0);
+                break;
+            default:
+                qDebug() << QString("unknown channels is passed %1").arg(channel);
+                return;
+            }
+            img.setPixel(x, y, pixel);
+        }
+    }
+}
+
+QByteArray uncompressRLE(int width, int height, const QByteArray &compressed)
+{
+    PSDTraceScope trace("uncompressRLE", height);
+    qDebug() << QString("uncompressRLE width=%1 height=%2 compression=%3").arg(width).arg(height).arg(compressed.size());
+
+    const uchar *src = reinterpret_cast<const uchar *>(compressed.constData());
+    const uchar *srcEnd = src + compressed.size();
+
+    // read length table.
+    if (compressed.size() < 2 * static_cast<qsizetype>(height))
+    {
+        qDebug() << QString("can't uncompress RLE, compression source byte too small.");
+        return QByteArray();
+    }
+    const uchar *lengthTable = src;
+    src += 2 * static_cast<qsizetype>(height);
+    qDebug() << "scanline length table loaded.";
+
+    // uncompress scanlines directly into channel, every byte is written so the buffer is not zero filled.
+    QByteArray channel = PSDBufferPool::local().acquire(static_cast<qsizetype>(width) * height);
+    uchar *dst = reinterpret_cast<uchar *>(channel.data());
+    for (int y = 0; y < height; y++, dst += width)
+    {
+        const uchar *scanLineEnd = src + qFromBigEndian<quint16>(lengthTable + 2 * y);
+        if (scanLineEnd > srcEnd)
+        {
+            qDebug() << QString("scanline length too large y=%1").arg(y);
+            return QByteArray();
+        }
+        int scanLinePos = 0;
+        while (src < scanLineEnd)
+        {
+            const int code = static_cast<qint8>(*src++);
+            if (code < 0)
+            {
+                // continuous
+                int continuousLength = 1 - code;
+                if ((continuousLength + scanLinePos) > width || src >= scanLineEnd)
+                {
+                    qDebug() << QString("continuous length too large length=%1 width=%2").arg(continuousLength + scanLinePos).arg(width);
+                    return QByteArray();
+                }
+                memset(dst + scanLinePos, *src++, continuousLength);
+                scanLinePos += continuousLength;
+            }
+            else
+            {
+                // discontinuity
+                int discontinuousLength = code + 1;
+                if ((discontinuousLength + scanLinePos) > width || discontinuousLength > scanLineEnd - src)
+                {
+                    qDebug() << QString("discontinuous length too large length=%1 width=%2").arg(discontinuousLength + scanLinePos).arg(width);
+                    return QByteArray();
+                }
+                memcpy(dst + scanLinePos, src, discontinuousLength);
+                src += discontinuousLength;
+                scanLinePos += discontinuousLength;
+            }
+        }
+        // short scanline is zero filled.
+        memset(dst + scanLinePos, 0, width - scanLinePos);
+    }
+    qDebug() << "uncompress RLE done.";
+    return channel;
+}
+
+/**
+ * @brief compress scanline by PackBits, reverse of uncompressRLE.
+ *
+ * @param src source scanline.
+ * @param width bytes in scanline.
+ * @param dst compressed bytes are appended.
+ */
+void compressRLE(const uchar *src, int width, QByteArray &dst)
+{
+    int x = 0;
+    while (x < width)
+    {
+        int run = 1;
+        while (x + run < width && run < 128 && src[x + run] == src[x])
+            run++;
+        if (run >= 2)
+        {
+            // continuous
+            dst.append(static_cast<char>(1 - run));
+            dst.append(static_cast<char>(src[x]));
+            x += run;
+            continue;
+        }
+        // discontinuity, until next two same bytes.
+        int literal = 1;
+        while (x + literal < width && literal < 128
+            && !(x + literal + 1 < width && src[x + literal] == src[x + literal + 1]))
+            literal++;
+        dst.append(static_cast<char>(literal - 1));
+        dst.append(reinterpret_cast<const char *>(src + x), literal);
+        x += literal;
+    }
+}
+
+enum PSDSpanKind : quint8
+{
+    PSDSpanTransparent, // alpha 0, nothing to composite.
+    PSDSpanOpaque, // alpha 255, copied without blending.
+    PSDSpanMixed,
+};
+
+/**
+ * @brief run of pixels in a row of layer alpha.
+ */
+struct PSDSpan
+{
+    qint32      begin; // x in layer.
+    qint32      length;
+    PSDSpanKind kind;
+};
+
+/**
+ * @brief alpha of layer as spans of each row.
+ */
+struct PSDLayerSpans
+{
+    QList<PSDSpan>  spans; // spans of all rows, adjacent spans of same kind are merged.
+    QList<qint32>   rows; // index of first span of each row in spans, height + 1 entries.
+};
+
+/**
+ * @brief append span to current row of spans, merging with previous span of same kind.
+ */
+static inline void appendPSDSpan(PSDLayerSpans *spans, qint32 rowStart, qint32 begin, qint32 length, PSDSpanKind kind)
+{
+    if (length <= 0)
+        return;
+    if (spans->spans.size() > rowStart && spans->spans.last().kind == kind)
+        spans->spans.last().length += length;
+    else
+        spans->spans.append(PSDSpan { begin, length, kind });
+}
+
+static inline PSDSpanKind psdSpanKindOf(uchar alpha)
+{
+    return alpha == 0 ? PSDSpanTransparent : alpha == 255 ? PSDSpanOpaque : PSDSpanMixed;
+}
+
+/**
+ * @brief build spans directly from PackBits compressed alpha, runs are classified without expanding them.
+ *
+ * @param width width of layer.
+ * @param height height of layer.
+ * @param compressed RLE compressed alpha channel with length table.
+ * @param spans receives spans.
+ * @return true if compressed data is valid.
+ */
+bool decodePSDAlphaSpans(int width, int height, const QByteArray &compressed, PSDLayerSpans *spans)
+{
+    PSDTraceScope trace("decodePSDAlphaSpans", height);
+    spans->spans.clear();
+    spans->rows.clear();
+    if (compressed.size() < 2 * static_cast<qsizetype>(height))
+        return false;
+    const uchar *lengthTable = reinterpret_cast<const uchar *>(compressed.constData());
+    const uchar *src = lengthTable + 2 * static_cast<qsizetype>(height);
+    const uchar *srcEnd = lengthTable + compressed.size();
+    spans->rows.reserve(height + 1);
+    for (int y = 0; y < height; y++)
+    {
+        const qint32 rowStart = static_cast<qint32>(spans->spans.size());
+        spans->rows.append(rowStart);
+        const uchar *scanLineEnd = src + qFromBigEndian<quint16>(lengthTable + 2 * y);
+        if (scanLineEnd > srcEnd)
+            return false;
+        int x = 0;
+        while (src < scanLineEnd)
+        {
+            const int code = static_cast<qint8>(*src++);
+            if (code < 0)
+            {
+                const int length = 1 - code;
+                if (x + length > width || src >= scanLineEnd)
+                    return false;
+                appendPSDSpan(spans, rowStart, x, length, psdSpanKindOf(*src++));
+                x += length;
+            }
+            else
+            {
+                // 非連続部分も 0 と 255 の並びは分けておく。
+                const int length = code + 1;
+                if (x + length > width || length > scanLineEnd - src)
+                    return false;
+                for (int i = 0; i < length; i++)
+                    appendPSDSpan(spans, rowStart, x + i, 1, psdSpanKindOf(src[i]));
+                src += length;
+                x += length;
+            }
+        }
+        // short scanline is zero filled.
+        appendPSDSpan(spans, rowStart, x, width - x, PSDSpanTransparent);
+    }
+    spans->rows.append(static_cast<qint32>(spans->spans.size()));
+    return true;
+}
+
+/**
+ * @brief build spans from uncompressed alpha, nullptr alpha means layer has no transparency.
+ */
+void buildPSDAlphaSpans(int width, int height, const uchar *alpha, PSDLayerSpans *spans)
+{
+    spans->spans.clear();
+    spans->rows.clear();
+    spans->rows.reserve(height + 1);
+    for (int y = 0; y < height; y++)
+    {
+        const qint32 rowStart = static_cast<qint32>(spans->spans.size());
+        spans->rows.append(rowStart);
+        if (!alpha)
+        {
+            appendPSDSpan(spans, rowStart, 0, width, PSDSpanOpaque);
+            continue;
+        }
+        const uchar *row = alpha + qsizetype(y) * width;
+        for (int x = 0; x < width;)
+        {
+            const PSDSpanKind kind = psdSpanKindOf(row[x]);
+            int end = x + 1;
+            while (end < width && psdSpanKindOf(row[end]) == kind)
+                end++;
+            appendPSDSpan(spans, rowStart, x, end - x, kind);
+            x = end;
+        }
+    }
+    spans->rows.append(static_cast<qint32>(spans->spans.size()));
+}
+
+/**
+ * @brief tight bounds of non-zero alpha, computed from PackBits control bytes without expanding rows.
+ *
+ * Runs only look at their value byte, literals are checked from both ends for first and last non-zero byte.
+ *
+ * @param width width of layer.
+ * @param height height of layer.
+ * @param compressed RLE compressed alpha channel with length table.
+ * @param bounds receives bounds in layer coordinates, null QRect if alpha is all zero.
+ * @return true if compressed data is valid.
+ */
+bool scanPSDAlphaBounds(int width, int height, const QByteArray &compressed, QRect *bounds)
+{
+    PSDTraceScope trace("scanPSDAlphaBounds", height);
+    *bounds = QRect();
+    if (compressed.size() < 2 * static_cast<qsizetype>(height))
+        return false;
+    const uchar *lengthTable = reinterpret_cast<const uchar *>(compressed.constData());
+    const uchar *src = lengthTable + 2 * static_cast<qsizetype>(height);
+    const uchar *srcEnd = lengthTable + compressed.size();
+    int left = width, right = -1, top = -1, bottom = -1;
+    for (int y = 0; y < height; y++)
+    {
+        const uchar *scanLineEnd = src + qFromBigEndian<quint16>(lengthTable + 2 * y);
+        if (scanLineEnd > srcEnd)
+            return false;
+        int x = 0, first = -1, last = -1;
+        while (src < scanLineEnd)
+        {
+            const int code = static_cast<qint8>(*src++);
+            const int length = code < 0 ? 1 - code : code + 1;
+            if (x + length > width || (code < 0 ? src >= scanLineEnd : length > scanLineEnd - src))
+                return false;
+            if (code < 0)
+            {
+                if (*src++)
+                {
+                    if (first < 0)
+                        first = x;
+                    last = x + length - 1;
+                }
+            }
+            else
+            {
+                // 左端はまだ見つかっていない時だけ、右端は後ろから探す。
+                int i = 0;
+                if (first < 0)
+                {
+                    while (i < length && !src[i])
+                        i++;
+                    if (i < length)
+                        first = x + i;
+                }
+                for (int j = length - 1; j >= i; j--)
+                {
+                    if (src[j])
+                    {
+                        last = x + j;
+                        break;
+                    }
+                }
+                src += length;
+            }
+            x += length;
+        }
+        if (first < 0)
+            continue;
+        left = qMin(left, first);
+        right = qMax(right, last);
+        if (top < 0)
+            top = y;
+        bottom = y;
+    }
+    if (top >= 0)
+        *bounds = QRect(QPoint(left, top), QPoint(right, bottom));
+    return true;
+}
+
+/**
+ * @brief load PSD layer.
+ * 
+ * @param ds binary data stream.
+ * @param record layer record.
+ * @param ok set true if load successfully, false failed.
+ * @param spans receives spans of alpha if not nullptr, RLE alpha is read as runs.
+ * @return QImage loaded layer image(channels are compounded).
+ */
+QImage loadPSDLayer(QDataStream &ds, const PSDLayerRecord &record, bool *ok, PSDLayerSpans *spans = nullptr)
+{
+    PSDTraceScope trace("loadPSDLayer", record.channelInfos.size());
+    *ok = false;
+
+    const auto currentEndian = ds.byteOrder();
+    ds.setByteOrder(QDataStream::BigEndian);
+
+    qsizetype totalSize = 0;
+
+    const int width = record.right - record.left;
+    const int height = record.bottom - record.top;
+    auto &pool = PSDBufferPool::local();
+    QImage image = pool.acquireImage(width, height);
+    // background layer has no alpha channel, fill only if some channel won't overwrite the image.
+    int channelBits = 0;
+    foreach(const PSDChannelInfo &info, record.channelInfos)
+    {
+        if (info.channelId >= -1 && info.channelId <= 2)
+            channelBits |= 1 << (info.channelId + 1);
+    }
+    if (channelBits != 0x0F)
+        image.fill(0xFF000000U);
+    foreach(const PSDChannelInfo &info, record.channelInfos)
+    {
+        PSDTraceScope channelTrace("loadPSDChannel", info.channelId);
+        const auto fileOffset = ds.device()->pos();
+        qDebug() << QString("loadPSDLayer file offset %1 length %2").arg(fileOffset, 8, 16, QChar('0')).arg(info.correspondingChannelDataLength);
+
+        // user supplied layer mask(-2, -3) has its own rectangle in mask data, not composited here.
+        if (info.channelId < -1)
+        {
+            ds.skipRawData(info.correspondingChannelDataLength);
+            continue;
+        }
+
+        quint16 compressionMode;
+        ds >> compressionMode;
+        if (ds.status() != QDataStream::Ok)
+        {
+            qDebug() << "loadPSDLayer: bad data stream status.";
+            goto compression_error;
+        }
+
+        const qsizetype length = info.correspondingChannelDataLength - 2;
+        totalSize += info.correspondingChannelDataLength;
+
+        switch(compressionMode)
+        {
+        case 0: // raw image.
+            {
+                QByteArray raw = pool.acquire(length);
+                ds.readRawData(raw.data(), length);
+                compoundLayerChannel(image, raw, info.channelId);
+                if (spans && info.channelId == -1 && raw.size() == qsizetype(width) * height)
+                    buildPSDAlphaSpans(width, height, reinterpret_cast<const uchar *>(raw.constData()), spans);
+                pool.release(raw);
+            }
+            break;
+        case 1: // RLE compressed image.
+            {
+                QByteArray compressed = pool.acquire(length);
+                ds.readRawData(compressed.data(), length);
+                QByteArray raw = uncompressRLE(width, height, compressed);
+                if (raw.size() != (width * height))
+                {
+                    qDebug() << QString("uncompressRLE failed. compression length %1").arg(compressed.size());
+                    goto compression_error;
+                }
+                compoundLayerChannel(image, raw, info.channelId);
+                if (spans && info.channelId == -1)
+                    decodePSDAlphaSpans(width, height, compressed, spans);
+                qDebug() << QString("RLE compression channel %1 loaded.").arg(info.channelId);
+                pool.release(raw);
+                pool.release(compressed);
+            }
+            break;
+        case 2:
+            qDebug() << QString("ZIP without prediction not supported.");
+            goto compression_error;
+        case 3:
+            qDebug() << QString("ZIP with prediction not supported.");
+            goto compression_error;
+        default:
+            qDebug() << QString("unsupported compression mode %1").arg(compressionMode);
+            goto compression_error;
+        }
+    }
+
+    if (spans && !(channelBits & 1))
+        buildPSDAlphaSpans(width, height, nullptr, spans);
+    ds.setByteOrder(currentEndian);
+    *ok = true;
+    return image;
+compression_error:
+    ds.setByteOrder(currentEndian);
+    *ok = false;
+    return QImage();
+}
+
+/**
+ * @brief channel planes of layer decoded without conversion, used for 16 and 32 bit export.
+ */
+struct PSDLayerPlanes
+{
+    int                 width = 0;
+    int                 height = 0;
+    int                 depth = 8; // bits per sample.
+    int                 colorMode = 3;
+    QList<qint16>       channelIds;
+    QList<QByteArray>   planes; // big-endian samples as stored in PSD, width * height * depth / 8 bytes each.
+};
+
+/**
+ * @brief undo prediction of ZIP with prediction compression in place.
+ *
+ * 8 and 16 bit samples are delta encoded per scanline. 32 bit scanlines are split into
+ * 4 byte planes(most significant first) and delta encoded byte by byte over whole scanline.
+ */
+void unpredictPSDPlane(QByteArray &plane, int width, int height, int depth)
+{
+    uchar *row = reinterpret_cast<uchar *>(plane.data());
+    const qsizetype rowBytes = static_cast<qsizetype>(width) * depth / 8;
+    QByteArray bytePlanes(depth == 32 ? rowBytes : 0, Qt::Uninitialized);
+    for (int y = 0; y < height; y++, row += rowBytes)
+    {
+        switch (depth)
+        {
+        case 8:
+            for (qsizetype x = 1; x < rowBytes; x++)
+                row[x] = static_cast<uchar>(row[x] + row[x - 1]);
+            break;
+        case 16:
+            for (int x = 1; x < width; x++)
+            {
+                const quint16 value = qFromBigEndian<quint16>(row + 2 * x) + qFromBigEndian<quint16>(row + 2 * (x - 1));
+                qToBigEndian<quint16>(value, row + 2 * x);
+            }
+            break;
+        case 32:
+            {
+                for (qsizetype x = 1; x < rowBytes; x++)
+                    row[x] = static_cast<uchar>(row[x] + row[x - 1]);
+                uchar *planes = reinterpret_cast<uchar *>(bytePlanes.data());
+                memcpy(planes, row, rowBytes);
+                for (int x = 0; x < width; x++)
+                {
+                    row[4 * x + 0] = planes[x];
+                    row[4 * x + 1] = planes[width + x];
+                    row[4 * x + 2] = planes[2 * width + x];
+                    row[4 * x + 3] = planes[3 * width + x];
+                }
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * @brief decode one channel image data into big-endian plane.
+ *
+ * All of raw, RLE, ZIP and ZIP with prediction are supported for any depth(8, 16, 32).
+ *
+ * @param ds binary data stream, positioned at compression mode of channel.
+ * @param length channel data length including compression mode.
+ * @param width width of channel.
+ * @param height height of channel.
+ * @param depth bits per sample.
+ * @return QByteArray width * height * depth / 8 bytes of samples as stored, empty if failed.
+ */
+QByteArray loadPSDChannelPlane(QDataStream &ds, qsizetype length, int width, int height, int depth)
+{
+    const auto currentEndian = ds.byteOrder();
+    ds.setByteOrder(QDataStream::BigEndian);
+    const qsizetype rowBytes = static_cast<qsizetype>(width) * depth / 8;
+    const qsizetype planeSize = rowBytes * height;
+    auto &pool = PSDBufferPool::local();
+    quint16 compressionMode;
+    ds >> compressionMode;
+    ds.setByteOrder(currentEndian);
+    length -= 2;
+    // ZIP は qUncompress が期待する 4 byte の展開後サイズを先頭に置けるよう、その後ろに読み込む。
+    QByteArray compressed = pool.acquire(4 + length);
+    qToBigEndian<quint32>(static_cast<quint32>(planeSize), compressed.data());
+    if (ds.status() != QDataStream::Ok || ds.readRawData(compressed.data() + 4, length) != length)
+    {
+        qDebug() << "loadPSDChannelPlane: can't read channel image data.";
+        return QByteArray();
+    }
+
+    QByteArray plane;
+    switch (compressionMode)
+    {
+    case 0: // raw image.
+        plane = compressed.mid(4);
+        break;
+    case 1: // RLE compressed image, scanlines are rowBytes long.
+        plane = uncompressRLE(rowBytes, height, compressed.mid(4));
+        break;
+    case 2: // ZIP without prediction.
+    case 3: // ZIP with prediction.
+        plane = qUncompress(compressed);
+        if (compressionMode == 3 && plane.size() == planeSize)
+            unpredictPSDPlane(plane, width, height, depth);
+        break;
+    default:
+        qDebug() << QString("unsupported compression mode %1").arg(compressionMode);
+        break;
+    }
+    pool.release(compressed);
+    if (plane.size() != planeSize)
+    {
+        qDebug() << QString("channel size mismatch %1 != %2, compression %3").arg(plane.size()).arg(planeSize).arg(compressionMode);
+        return QByteArray();
+    }
+    return plane;
+}
+
+/**
+ * @brief load rows of layer, only rows in range are read for raw and RLE channels.
+ *
+ * @param ds binary data stream, positioned at first channel image data of layer.
+ * @param record layer record.
+ * @param top first row in layer coordinates.
+ * @param height number of rows.
+ * @param ok receives true if loaded successfully.
+ * @return QImage rows of layer, top row of image is row top of layer.
+ */
+QImage loadPSDLayerRows(QDataStream &ds, const PSDLayerRecord &record, int top, int height, bool *ok)
+{
+    PSDTraceScope trace("loadPSDLayerRows", height);
+    *ok = false;
+    const int width = record.right - record.left;
+    const int layerHeight = record.bottom - record.top;
+    auto &pool = PSDBufferPool::local();
+    QImage image = pool.acquireImage(width, height);
+    int channelBits = 0;
+    foreach(const PSDChannelInfo &info, record.channelInfos)
+    {
+        if (info.channelId >= -1 && info.channelId <= 2)
+            channelBits |= 1 << (info.channelId + 1);
+    }
+    if (channelBits != 0x0F)
+        image.fill(0xFF000000U);
+
+    const auto currentEndian = ds.byteOrder();
+    ds.setByteOrder(QDataStream::BigEndian);
+    qint64 channelOffset = ds.device()->pos();
+    foreach(const PSDChannelInfo &info, record.channelInfos)
+    {
+        const qint64 nextOffset = channelOffset + info.correspondingChannelDataLength;
+        if (info.channelId < -1)
+        {
+            channelOffset = nextOffset;
+            continue;
+        }
+        if (!ds.device()->seek(channelOffset))
+            break;
+        quint16 compressionMode;
+        ds >> compressionMode;
+        QByteArray raw;
+        switch (compressionMode)
+        {
+        case 0: // raw image, rows are seeked directly.
+            ds.skipRawData(static_cast<int>(qsizetype(top) * width));
+            raw = pool.acquire(qsizetype(width) * height);
+            if (ds.readRawData(raw.data(), raw.size()) != raw.size())
+                raw.clear();
+            break;
+        case 1: // RLE compressed image, skip rows above by row length table.
+            {
+                QList<quint16> rowLengths(layerHeight);
+                qsizetype skip = 0, length = 0;
+                for (int y = 0; y < layerHeight; y++)
+                {
+                    ds >> rowLengths[y];
+                    if (y < top)
+                        skip += rowLengths.at(y);
+                    else if (y < top + height)
+                        length += rowLengths.at(y);
+                }
+                QByteArray compressed = pool.acquire(2 * qsizetype(height) + length);
+                for (int y = 0; y < height; y++)
+                    qToBigEndian<quint16>(rowLengths.at(top + y), compressed.data() + 2 * y);
+                ds.skipRawData(static_cast<int>(skip));
+                if (ds.status() == QDataStream::Ok && ds.readRawData(compressed.data() + 2 * height, length) == length)
+                    raw = uncompressRLE(width, height, compressed);
+                pool.release(compressed);
+            }
+            break;
+        default: // ZIP has to be inflated entirely.
+            {
+                ds.device()->seek(channelOffset);
+                QByteArray plane = loadPSDChannelPlane(ds, info.correspondingChannelDataLength, width, layerHeight, 8);
+                if (!plane.isEmpty())
+                    raw = plane.mid(qsizetype(top) * width, qsizetype(width) * height);
+            }
+            break;
+        }
+        if (raw.size() != qsizetype(width) * height)
+        {
+            qDebug() << QString("loadPSDLayerRows: can't load channel %1, compression %2").arg(info.channelId).arg(compressionMode);
+            ds.setByteOrder(currentEndian);
+            return QImage();
+        }
+        compoundLayerChannel(image, raw, info.channelId);
+        pool.release(raw);
+        channelOffset = nextOffset;
+    }
+    ds.setByteOrder(currentEndian);
+    *ok = ds.device()->seek(channelOffset);
+    return image;
+}
+
+/**
+ * @brief read layer records and their extra data in two phases.
+ *
+ * First phase reads bytes of each record sequentially, using channel count and extra data length
+ * only to find where next record starts. Second phase parses records and extra data in parallel
+ * from memory, which dominates for documents with tens of thousands of layers.
+ *
+ * @param ds binary data stream, positioned at first layer record.
+ * @param count number of layer records.
+ * @param maxLength bytes records may occupy(rest of layer info), lengths read from records are checked against it.
+ * @param records receives parsed records in file order.
+ * @param consumed receives total byte size of records.
+ * @return int 0 if successfully, -1 failed.
+ */
+int readPSDLayerRecords(QDataStream &ds, int count, qint64 maxLength, QList<PSDLayerRecord> &records, quint32 *consumed)
+{
+    PSDTraceScope trace("readPSDLayerRecords", count);
+    QByteArray bytes;
+    QList<QPair<qsizetype, qsizetype>> spans; // offset in bytes and length of each record.
+    // 壊れた長さで巨大な確保をしないよう、layer info とファイルの残りで制限する。
+    const qint64 limit = qMin(maxLength, ds.device()->size() - ds.device()->pos());
+    if (count > limit / PSDLayerRecordSize)
+    {
+        qDebug() << QString("layer count %1 exceeds layer info of %2 bytes.").arg(count).arg(limit);
+        return -1;
+    }
+    spans.reserve(count);
+    const auto readInto = [&](qint64 length) -> bool
+    {
+        if (length > limit - bytes.size())
+        {
+            qDebug() << QString("layer record length %1 exceeds layer info.").arg(length);
+            return false;
+        }
+        const qsizetype position = bytes.size();
+        bytes.resize(position + length);
+        return ds.readRawData(bytes.data() + position, length) == length;
+    };
+    for (int layer = 0; layer < count; layer++)
+    {
+        qDebug() << QString("PSDLayerRecord offset: 0x%1").arg(ds.device()->pos(), 0, 16);
+        const qsizetype start = bytes.size();
+        // rectangle(16) と channel 数(2)。
+        if (!readInto(18))
+            goto io_error;
+        {
+            const quint16 channels = qFromBigEndian<quint16>(bytes.constData() + start + 16);
+            // channel info, signature, blend mode key, opacity, clipping, flags, filler と extra data length.
+            if (!readInto(PSDChannelInfosize * channels + 16))
+                goto io_error;
+            const quint32 extraLength = qFromBigEndian<quint32>(bytes.constData() + bytes.size() - 4);
+            if (!readInto(extraLength))
+                goto io_error;
+        }
+        spans.append(qMakePair(start, bytes.size() - start));
+    }
+    {
+        QList<int> indices;
+        for (int layer = 0; layer < count; layer++)
+            indices.append(layer);
+        QAtomicInt failures;
+        const auto parse = [&](int layer) -> PSDLayerRecord
+        {
+            PSDLayerRecord record;
+            const QByteArray slice = QByteArray::fromRawData(bytes.constData() + spans.at(layer).first, spans.at(layer).second);
+            QDataStream in(slice);
+            in.setByteOrder(QDataStream::BigEndian);
+            in >> record;
+            if (in.status() != QDataStream::Ok || record.signature != PSDSignature8BIM
+                || readPSDLayerExtraData(in, record.extraDataFieldLength, record.extraData) != 0)
+            {
+                qDebug() << QString("can't parse layer record=%1").arg(layer);
+                failures.fetchAndAddRelaxed(1);
+            }
+            return record;
+        };
+        records = QtConcurrent::blockingMapped<QList<PSDLayerRecord>>(psdThreadPool(), indices, parse);
+        if (failures.loadRelaxed() != 0)
+            return -1;
+    }
+    *consumed = static_cast<quint32>(bytes.size());
+    return 0;
+io_error:
+    qDebug() << "can't read layer records, file i/o error occurred.";
+    return -1;
+}
+
+/**
+ * @brief decode channel image data of layer into big-endian planes.
+ *
+ * Unlike loadPSDLayer any depth and compression are supported,
+ * samples are kept as stored so that exporters can write them without conversion.
+ * User supplied layer masks(-2, -3) are skipped.
+ *
+ * @param ds binary data stream, positioned at channel image data of layer.
+ * @param record layer record.
+ * @param header file header, depth and color mode.
+ * @param planes receives decoded planes.
+ * @return int 0 if successfully, -1 failed.
+ */
+int loadPSDLayerPlanes(QDataStream &ds, const PSDLayerRecord &record, const PSDFileHeaderSection &header, PSDLayerPlanes &planes)
+{
+    PSDTraceScope trace("loadPSDLayerPlanes", record.channelInfos.size());
+    planes.width = record.right - record.left;
+    planes.height = record.bottom - record.top;
+    planes.depth = header.depth;
+    planes.colorMode = header.colorMode;
+    planes.channelIds.clear();
+    planes.planes.clear();
+    foreach(const PSDChannelInfo &info, record.channelInfos)
+    {
+        PSDTraceScope channelTrace("loadPSDChannel", info.channelId);
+        if (info.channelId < -1)
+        {
+            ds.skipRawData(info.correspondingChannelDataLength);
+            continue;
+        }
+        const QByteArray plane = loadPSDChannelPlane(ds, info.correspondingChannelDataLength, planes.width, planes.height, header.depth);
+        if (plane.isEmpty())
+        {
+            qDebug() << QString("can't decode channel %1").arg(info.channelId);
+            return -1;
+        }
+        planes.channelIds.append(info.channelId);
+        planes.planes.append(plane);
+    }
+    return 0;
+}
+
+/**
+ * @brief default layer states taken from layer records.
+ */
+QList<PSDLayerState> defaultPSDLayerStates(const QList<PSDLayerRecord> &records)
+{
+    QList<PSDLayerState> states(records.size());
+    for (int i = 0; i < records.size(); i++)
+    {
+        // flags bit 1 = visible が 0 の時に表示。
+        states[i].visible = (records.at(i).flags & 0x02) == 0;
+        states[i].offset = QPoint(0, 0);
+    }
+    return states;
+}
+
+/**
+ * @brief true if layer and all of its parent groups are visible.
+ */
+bool isPSDLayerVisible(const QList<PSDLayerNode> &tree, const QList<PSDLayerState> &states, int index)
+{
+    for (int i = index; i >= 0; i = tree.at(i).parent)
+    {
+        if (!states.at(i).visible)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief source-over composite non-premultiplied pixel.
+ */
+static inline QRgb blendPSDPixel(QRgb dst, QRgb src, int opacity)
+{
+    const int sa = (qAlpha(src) * opacity + 127) / 255;
+    if (sa == 0)
+        return dst;
+    const int da = qAlpha(dst);
+    const int ia = da * (255 - sa);
+    const int oa = sa * 255 + ia; // output alpha * 255
+    if (oa == 0)
+        return 0;
+    const auto mix = [&](int s, int d) { return (s * sa * 255 + d * ia + oa / 2) / oa; };
+    return qRgba(mix(qRed(src), qRed(dst)), mix(qGreen(src), qGreen(dst)), mix(qBlue(src), qBlue(dst)), (oa + 127) / 255);
+}
+
+/**
+ * @brief "Blend If" weight of pixel, product of gray, red, green and blue table weights.
+ */
+static inline int psdBlendIfWeight(const uchar *tables, int red, int green, int blue)
+{
+    const int gray = (77 * red + 151 * green + 28 * blue + 128) >> 8;
+    const int gr = (tables[gray] * tables[256 + red] + 127) / 255;
+    const int gb = (tables[512 + green] * tables[768 + blue] + 127) / 255;
+    return (gr * gb + 127) / 255;
+}
+
+/**
+ * @brief composite layer image onto canvas.
+ *
+ * @param canvas destination, Format_ARGB32.
+ * @param area document rectangle covered by canvas.
+ * @param layer decoded layer image, Format_ARGB32.
+ * @param position document position of top left of layer.
+ * @param opacity layer opacity 0-255.
+ * @param blendIf "Blend If" tables of readPSDBlendIfTables, nullptr if not used.
+ */
+void compositePSDLayer(QImage &canvas, const QRect &area, const QImage &layer, const QPoint &position, int opacity,
+    const uchar *blendIf = nullptr)
+{
+    const QRect target = QRect(position, layer.size()).intersected(area);
+    for (int y = target.top(); y <= target.bottom(); y++)
+    {
+        const QRgb *src = reinterpret_cast<const QRgb *>(layer.constScanLine(y - position.y())) + (target.left() - position.x());
+        QRgb *dst = reinterpret_cast<QRgb *>(canvas.scanLine(y - area.top())) + (target.left() - area.left());
+        if (!blendIf)
+        {
+            for (int x = 0; x < target.width(); x++)
+            {
+                dst[x] = blendPSDPixel(dst[x], src[x], opacity);
+            }
+            continue;
+        }
+        // 重みは表引きと乗算だけで求め、アルファに掛けてから通常通り合成する。
+        for (int x = 0; x < target.width(); x++)
+        {
+            const QRgb s = src[x], d = dst[x];
+            const int weight = (psdBlendIfWeight(blendIf, qRed(s), qGreen(s), qBlue(s))
+                * psdBlendIfWeight(blendIf + 1024, qRed(d), qGreen(d), qBlue(d)) + 127) / 255;
+            const QRgb weighted = (s & 0x00FFFFFFU) | (QRgb((qAlpha(s) * weight + 127) / 255) << 24);
+            dst[x] = blendPSDPixel(d, weighted, opacity);
+        }
+    }
+}
+
+/**
+ * @brief composite layer image onto canvas by alpha spans.
+ *
+ * Transparent spans are skipped and opaque spans are copied when layer opacity is 100%,
+ * only mixed spans are blended per pixel.
+ *
+ * @param canvas destination, Format_ARGB32.
+ * @param area document rectangle covered by canvas.
+ * @param layer decoded layer image, Format_ARGB32.
+ * @param position document position of top left of layer.
+ * @param opacity layer opacity 0-255.
+ * @param spans alpha spans of layer.
+ */
+void compositePSDLayerSpans(QImage &canvas, const QRect &area, const QImage &layer, const QPoint &position, int opacity,
+    const PSDLayerSpans &spans)
+{
+    const QRect target = QRect(position, layer.size()).intersected(area);
+    for (int y = target.top(); y <= target.bottom(); y++)
+    {
+        const int row = y - position.y();
+        const QRgb *src = reinterpret_cast<const QRgb *>(layer.constScanLine(row)) - position.x();
+        QRgb *dst = reinterpret_cast<QRgb *>(canvas.scanLine(y - area.top())) - area.left();
+        for (qint32 i = spans.rows.at(row); i < spans.rows.at(row + 1); i++)
+        {
+            const PSDSpan &span = spans.spans.at(i);
+            if (span.kind == PSDSpanTransparent)
+                continue;
+            const int begin = qMax(position.x() + span.begin, target.left());
+            const int end = qMin(position.x() + span.begin + span.length, target.right() + 1);
+            if (begin >= end)
+                continue;
+            if (span.kind == PSDSpanOpaque && opacity == 255)
+            {
+                memcpy(dst + begin, src + begin, (end - begin) * sizeof(QRgb));
+                continue;
+            }
+            for (int x = begin; x < end; x++)
+                dst[x] = blendPSDPixel(dst[x], src[x], opacity);
+        }
+    }
+}
+
+/**
+ * @brief color space in which layers are blended.
+ */
+enum PSDBlendSpace
+{
+    PSDBlendSpaceSRGB, // blend 8 bit sRGB values directly, same as Photoshop default.
+    PSDBlendSpaceLinear, // blend in linear light, 16 bit premultiplied.
+};
+
+/**
+ * @brief lookup tables between 8 bit sRGB and 16 bit linear light.
+ */
+struct PSDLinearLightTables
+{
+    quint16 toLinear[256];
+    uchar   toSRGB[65536]; // indexed by linear value, 64KiB stays in L2 cache.
+
+    PSDLinearLightTables()
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            const double c = i / 255.0;
+            const double l = c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+            toLinear[i] = static_cast<quint16>(std::lround(l * 65535.0));
+        }
+        for (int i = 0; i < 65536; i++)
+        {
+            const double l = i / 65535.0;
+            const double c = l <= 0.0031308 ? l * 12.92 : 1.055 * std::pow(l, 1.0 / 2.4) - 0.055;
+            toSRGB[i] = static_cast<uchar>(qBound(0L, std::lround(c * 255.0), 255L));
+        }
+    }
+
+    static const PSDLinearLightTables &instance()
+    {
+        static const PSDLinearLightTables tables;
+        return tables;
+    }
+};
+
+/**
+ * @brief composite layer image onto linear light canvas.
+ *
+ * Row is converted to linear premultiplied through LUT first, then blended by plain loop over
+ * 16 bit components which compiler can vectorize.
+ *
+ * @param canvas destination, premultiplied linear RGBA 16 bit per component, area.width() * area.height() * 4.
+ * @param area document rectangle covered by canvas.
+ * @param layer decoded layer image, Format_ARGB32.
+ * @param position document position of top left of layer.
+ * @param opacity layer opacity 0-255.
+ * @param blendIf "Blend If" tables of readPSDBlendIfTables, nullptr if not used.
+ * @param spans alpha spans of layer, each row is narrowed to its non-transparent spans, may be nullptr.
+ */
+void compositePSDLayerLinear(QList<quint16> &canvas, const QRect &area, const QImage &layer, const QPoint &position, int opacity,
+    const uchar *blendIf = nullptr, const PSDLayerSpans *spans = nullptr)
+{
+    const QRect layerTarget = QRect(position, layer.size()).intersected(area);
+    if (layerTarget.isEmpty())
+        return;
+    const auto &tables = PSDLinearLightTables::instance();
+    QList<quint16> source(layerTarget.width() * 4);
+    QList<quint16> inverseAlpha(layerTarget.width() * 4);
+    quint16 *s = source.data();
+    quint16 *ia = inverseAlpha.data();
+    quint16 *canvasData = canvas.data();
+    for (int y = layerTarget.top(); y <= layerTarget.bottom(); y++)
+    {
+        QRect target = layerTarget;
+        if (spans)
+        {
+            // 行の両端の透明な span は変換も合成もしない。
+            const int row = y - position.y();
+            qint32 first = spans->rows.at(row), last = spans->rows.at(row + 1) - 1;
+            while (first <= last && spans->spans.at(first).kind == PSDSpanTransparent)
+                first++;
+            while (last >= first && spans->spans.at(last).kind == PSDSpanTransparent)
+                last--;
+            if (first > last)
+                continue;
+            const int begin = position.x() + spans->spans.at(first).begin;
+            const int end = position.x() + spans->spans.at(last).begin + spans->spans.at(last).length;
+            target.setLeft(qMax(target.left(), begin));
+            target.setRight(qMin(target.right(), end - 1));
+            if (target.isEmpty())
+                continue;
+        }
+        const int count = target.width() * 4;
+        const QRgb *src = reinterpret_cast<const QRgb *>(layer.constScanLine(y - position.y())) + (target.left() - position.x());
+        quint16 *dst = canvasData + (qsizetype(y - area.top()) * area.width() + (target.left() - area.left())) * 4;
+        for (int x = 0; x < target.width(); x++)
+        {
+            quint32 a = (qAlpha(src[x]) * opacity * 257u + 127) / 255; // 0-65535
+            if (blendIf)
+            {
+                // 下の画素は sRGB 8 bit に戻してから表を引く。
+                const quint32 da = dst[x * 4 + 3];
+                const auto toSRGB = [&](quint32 c) { return da ? tables.toSRGB[qMin<quint32>((c * 65535 + da / 2) / da, 65535)] : 0; };
+                const int weight = (psdBlendIfWeight(blendIf, qRed(src[x]), qGreen(src[x]), qBlue(src[x]))
+                    * psdBlendIfWeight(blendIf + 1024, toSRGB(dst[x * 4 + 0]), toSRGB(dst[x * 4 + 1]), toSRGB(dst[x * 4 + 2])) + 127) / 255;
+                a = (a * weight + 127) / 255;
+            }
+            s[x * 4 + 0] = static_cast<quint16>((tables.toLinear[qRed(src[x])] * a + 32767) / 65535);
+            s[x * 4 + 1] = static_cast<quint16>((tables.toLinear[qGreen(src[x])] * a + 32767) / 65535);
+            s[x * 4 + 2] = static_cast<quint16>((tables.toLinear[qBlue(src[x])] * a + 32767) / 65535);
+            s[x * 4 + 3] = static_cast<quint16>(a);
+            ia[x * 4 + 0] = ia[x * 4 + 1] = ia[x * 4 + 2] = ia[x * 4 + 3] = static_cast<quint16>(65535 - a);
+        }
+        // premultiplied source-over, x / 65535 ≈ (x + (x >> 16) + 1) >> 16 で除算を避ける。
+        for (int i = 0; i < count; i++)
+        {
+            const quint32 t = quint32(dst[i]) * ia[i] + 32768;
+            dst[i] = static_cast<quint16>(s[i] + ((t + (t >> 16)) >> 16));
+        }
+    }
+}
+
+/**
+ * @brief convert linear light canvas to non-premultiplied sRGB image.
+ */
+QImage linearPSDCanvasToImage(const QList<quint16> &canvas, const QSize &size)
+{
+    const auto &tables = PSDLinearLightTables::instance();
+    QImage image(size, QImage::Format_ARGB32);
+    for (int y = 0; y < size.height(); y++)
+    {
+        const quint16 *src = canvas.constData() + qsizetype(y) * size.width() * 4;
+        QRgb *dst = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < size.width(); x++, src += 4)
+        {
+            const quint32 a = src[3];
+            if (a == 0)
+            {
+                dst[x] = 0;
+                continue;
+            }
+            const auto unpremultiply = [&](quint32 c) { return tables.toSRGB[qMin<quint32>((c * 65535 + a / 2) / a, 65535)]; };
+            dst[x] = qRgba(unpremultiply(src[0]), unpremultiply(src[1]), unpremultiply(src[2]), (a * 255 + 32767) / 65535);
+        }
+    }
+    return image;
+}
+
+/**
+ * @brief gradient placement in document coordinates, derived from fill bounds.
+ */
+struct PSDGradientGeometry
+{
+    PSDGradientType type;
+    float   centerX;
+    float   centerY;
+    float   cosAngle;
+    float   sinAngle;
+    float   angle; // radians.
+    float   inverseHalfLength; // linear and reflected gradients.
+    float   inverseRadius; // radial and diamond gradients.
+};
+
+static PSDGradientGeometry makePSDGradientGeometry(const PSDFillLayer &fill)
+{
+    const double width = fill.bounds.width();
+    const double height = fill.bounds.height();
+    const double angle = qDegreesToRadians(fill.angle);
+    const double scale = fill.scale / 100.0;
+    const double c = std::cos(angle), s = std::sin(angle);
+    // 線形は境界矩形の角から角まで、円形は対角線の半分を半径とする。
+    const double halfLength = qMax(0.5, (std::abs(width * c) + std::abs(height * s)) / 2 * scale);
+    const double radius = qMax(0.5, std::hypot(width, height) / 2 * scale);
+    return PSDGradientGeometry {
+        fill.gradientType,
+        static_cast<float>(fill.bounds.left() + width / 2 + fill.offsetX / 100.0 * width),
+        static_cast<float>(fill.bounds.top() + height / 2 + fill.offsetY / 100.0 * height),
+        static_cast<float>(c), static_cast<float>(s), static_cast<float>(angle),
+        static_cast<float>(1.0 / halfLength), static_cast<float>(1.0 / radius),
+    };
+}
+
+/**
+ * @brief atan2 by minimax polynomial, error is below 1e-5 radians.
+ */
+static inline float psdFastAtan2(float y, float x)
+{
+    const float ax = std::abs(x), ay = std::abs(y);
+    const float z = qMax(ax, ay) > 0 ? qMin(ax, ay) / qMax(ax, ay) : 0.0f;
+    const float z2 = z * z;
+    float a = z * (0.99997726f + z2 * (-0.33262347f + z2 * (0.19354346f + z2 * (-0.11643287f + z2 * (0.05265332f + z2 * -0.01172120f)))));
+    if (ay > ax)
+        a = 1.57079637f - a;
+    if (x < 0)
+        a = 3.14159274f - a;
+    return y < 0 ? -a : a;
+}
+
+static inline float psdGradientPosition(const PSDGradientGeometry &g, float dx, float dy)
+{
+    const float u = dx * g.cosAngle - dy * g.sinAngle;
+    const float v = dx * g.sinAngle + dy * g.cosAngle;
+    switch (g.type)
+    {
+    case PSDGradientLinear: return u * g.inverseHalfLength * 0.5f + 0.5f;
+    case PSDGradientRadial: return std::sqrt(dx * dx + dy * dy) * g.inverseRadius;
+    case PSDGradientAngle:
+        {
+            const float t = (psdFastAtan2(-dy, dx) - g.angle) * 0.159154943f;
+            return t - std::floor(t);
+        }
+    case PSDGradientReflected: return std::abs(u) * g.inverseHalfLength;
+    case PSDGradientDiamond: return (std::abs(u) + std::abs(v)) * g.inverseRadius;
+    }
+    return 0;
+}
+
+/**
+ * @brief evaluate gradient position of count pixels on scanline, 4 pixels at once with SSE2.
+ *
+ * @param g gradient geometry.
+ * @param dx horizontal distance of first pixel center from gradient center.
+ * @param dy vertical distance of scanline center from gradient center.
+ * @param count number of pixels.
+ * @param t receives positions, not clamped.
+ */
+static void evaluatePSDGradientRow(const PSDGradientGeometry &g, float dx, float dy, int count, float *t)
+{
+    int x = 0;
+#ifdef PSD_USE_SSE2
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    const __m128 cosAngle = _mm_set1_ps(g.cosAngle);
+    const __m128 sinAngle = _mm_set1_ps(g.sinAngle);
+    const __m128 vy = _mm_set1_ps(dy);
+    const __m128 uy = _mm_mul_ps(vy, sinAngle); // u = dx * cos - dy * sin
+    const __m128 wy = _mm_mul_ps(vy, cosAngle); // v = dx * sin + dy * cos
+    const __m128 halfLength = _mm_set1_ps(g.inverseHalfLength);
+    const __m128 radius = _mm_set1_ps(g.inverseRadius);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 lanes = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    for (; x + 4 <= count; x += 4)
+    {
+        const __m128 vx = _mm_add_ps(_mm_set1_ps(dx + x), lanes);
+        const __m128 u = _mm_sub_ps(_mm_mul_ps(vx, cosAngle), uy);
+        __m128 r;
+        switch (g.type)
+        {
+        case PSDGradientLinear:
+            r = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(u, halfLength), half), half);
+            break;
+        case PSDGradientRadial:
+            r = _mm_mul_ps(_mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy))), radius);
+            break;
+        case PSDGradientReflected:
+            r = _mm_mul_ps(_mm_andnot_ps(signMask, u), halfLength);
+            break;
+        case PSDGradientDiamond:
+            {
+                const __m128 w = _mm_add_ps(_mm_mul_ps(vx, sinAngle), wy);
+                r = _mm_mul_ps(_mm_add_ps(_mm_andnot_ps(signMask, u), _mm_andnot_ps(signMask, w)), radius);
+            }
+            break;
+        case PSDGradientAngle:
+        default:
+            {
+                // psdFastAtan2(-dy, dx) を分岐なしで 4 画素まとめて求める。
+                const __m128 ny = _mm_xor_ps(vy, signMask);
+                const __m128 ax = _mm_andnot_ps(signMask, vx);
+                const __m128 ay = _mm_andnot_ps(signMask, ny);
+                const __m128 z = _mm_div_ps(_mm_min_ps(ax, ay), _mm_max_ps(_mm_max_ps(ax, ay), _mm_set1_ps(1e-30f)));
+                const __m128 z2 = _mm_mul_ps(z, z);
+                __m128 p = _mm_set1_ps(-0.01172120f);
+                p = _mm_add_ps(_mm_mul_ps(p, z2), _mm_set1_ps(0.05265332f));
+                p = _mm_add_ps(_mm_mul_ps(p, z2), _mm_set1_ps(-0.11643287f));
+                p = _mm_add_ps(_mm_mul_ps(p, z2), _mm_set1_ps(0.19354346f));
+                p = _mm_add_ps(_mm_mul_ps(p, z2), _mm_set1_ps(-0.33262347f));
+                p = _mm_add_ps(_mm_mul_ps(p, z2), _mm_set1_ps(0.99997726f));
+                __m128 a = _mm_mul_ps(p, z);
+                const __m128 steep = _mm_cmpgt_ps(ay, ax);
+                a = _mm_or_ps(_mm_and_ps(steep, _mm_sub_ps(_mm_set1_ps(1.57079637f), a)), _mm_andnot_ps(steep, a));
+                const __m128 left = _mm_cmplt_ps(vx, _mm_setzero_ps());
+                a = _mm_or_ps(_mm_and_ps(left, _mm_sub_ps(_mm_set1_ps(3.14159274f), a)), _mm_andnot_ps(left, a));
+                a = _mm_xor_ps(a, _mm_and_ps(ny, signMask));
+                // 角度は -2π から 2π に収まるので 2 周足して小数部を取る。
+                r = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(a, _mm_set1_ps(g.angle)), _mm_set1_ps(0.159154943f)), _mm_set1_ps(2.0f));
+                r = _mm_sub_ps(r, _mm_cvtepi32_ps(_mm_cvttps_epi32(r)));
+            }
+            break;
+        }
+        _mm_storeu_ps(t + x, r);
+    }
+#endif
+    for (; x < count; x++)
+        t[x] = psdGradientPosition(g, dx + x, dy);
+}
+
+/**
+ * @brief render fill layer for document rectangle.
+ *
+ * @param fill fill layer settings.
+ * @param tile document rectangle to render.
+ * @return QImage Format_ARGB32 image of tile.
+ */
+QImage renderPSDFillTile(const PSDFillLayer &fill, const QRect &tile)
+{
+    PSDTraceScope trace("renderPSDFillTile", tile.height());
+    QImage image = PSDBufferPool::local().acquireImage(tile.width(), tile.height());
+    if (image.isNull())
+        return image;
+    switch (fill.type)
+    {
+    case PSDFillSolid:
+        image.fill(fill.color);
+        break;
+    case PSDFillGradient:
+        {
+            const PSDGradientGeometry g = makePSDGradientGeometry(fill);
+            const QRgb *ramp = fill.ramp.constData();
+            QList<float> positions(tile.width());
+            for (int y = 0; y < tile.height(); y++)
+            {
+                float *t = positions.data();
+                evaluatePSDGradientRow(g, tile.left() + 0.5f - g.centerX, tile.top() + y + 0.5f - g.centerY, tile.width(), t);
+                QRgb *dst = reinterpret_cast<QRgb *>(image.scanLine(y));
+                const float last = PSDGradientRampSize - 1;
+                for (int x = 0; x < tile.width(); x++)
+                {
+                    const float v = qBound(0.0f, fill.reverse ? 1.0f - t[x] : t[x], 1.0f);
+                    dst[x] = ramp[static_cast<int>(v * last + 0.5f)];
+                }
+            }
+        }
+        break;
+    case PSDFillPattern:
+        {
+            if (fill.pattern.isNull())
+            {
+                image.fill(0);
+                break;
+            }
+            const int width = fill.pattern.width();
+            const int height = fill.pattern.height();
+            const double inverseScale = 100.0 / fill.scale;
+            const auto wrap = [](int v, int size) { v %= size; return v < 0 ? v + size : v; };
+            QList<int> columns(tile.width());
+            for (int x = 0; x < tile.width(); x++)
+                columns[x] = wrap(static_cast<int>(std::floor((tile.left() + x + 0.5 - fill.phaseX) * inverseScale)), width);
+            for (int y = 0; y < tile.height(); y++)
+            {
+                const int row = wrap(static_cast<int>(std::floor((tile.top() + y + 0.5 - fill.phaseY) * inverseScale)), height);
+                const QRgb *src = reinterpret_cast<const QRgb *>(fill.pattern.constScanLine(row));
+                QRgb *dst = reinterpret_cast<QRgb *>(image.scanLine(y));
+                for (int x = 0; x < tile.width(); x++)
+                    dst[x] = src[columns.at(x)];
+            }
+        }
+        break;
+    case PSDFillNone:
+        image.fill(0);
+        break;
+    }
+    return image;
+}
+
+/**
+ * @brief multiply alpha of fill tile by transparency of decoded fill layer pixels.
+ *
+ * @param tile rendered fill tile.
+ * @param coverage decoded layer image, same size as fill bounds.
+ * @param origin position of tile in coverage.
+ */
+void maskPSDFillTile(QImage &tile, const QImage &coverage, const QPoint &origin)
+{
+    for (int y = 0; y < tile.height(); y++)
+    {
+        const QRgb *src = reinterpret_cast<const QRgb *>(coverage.constScanLine(origin.y() + y)) + origin.x();
+        QRgb *dst = reinterpret_cast<QRgb *>(tile.scanLine(y));
+        for (int x = 0; x < tile.width(); x++)
+            dst[x] = (dst[x] & 0x00FFFFFFU) | (QRgb((qAlpha(dst[x]) * qAlpha(src[x]) + 127) / 255) << 24);
+    }
+}
+
+static const int PSDFillTileRows = 64;
+
+/**
+ * @brief composite decoded layers.
+ *
+ * Blend mode, clipping and masks are not supported yet, all layers are composited as normal
+ * with their "Blend If" ranges.
+ * Fill layers are rendered from their settings in tiles of rows the area covers.
+ *
+ * @param records layer records.
+ * @param tree layer tree.
+ * @param decoded decoded layer images by record index, missing layers are skipped.
+ * @param states layer states.
+ * @param area document rectangle to render.
+ * @param blendSpace color space in which layers are blended.
+ * @param spans alpha spans of decoded layers, layers with spans skip transparent runs, may be nullptr.
+ * @return QImage composited image of area.
+ */
+QImage compositePSDLayers(const QList<PSDLayerRecord> &records, const QList<PSDLayerNode> &tree,
+    const QHash<int, QImage> &decoded, const QList<PSDLayerState> &states, const QRect &area,
+    PSDBlendSpace blendSpace = PSDBlendSpaceSRGB, const QHash<int, PSDLayerSpans> *spans = nullptr)
+{
+    PSDTraceScope trace("compositePSDLayers", area.height());
+    const bool linear = blendSpace == PSDBlendSpaceLinear;
+    QImage canvas;
+    QList<quint16> linearCanvas;
+    if (linear)
+        linearCanvas = QList<quint16>(qsizetype(area.width()) * area.height() * 4, 0);
+    else
+    {
+        canvas = QImage(area.size(), QImage::Format_ARGB32);
+        canvas.fill(0);
+    }
+    for (int i = 0; i < records.size(); i++)
+    {
+        if (tree.at(i).sectionType != PSDSectionDividerAnyOther || !isPSDLayerVisible(tree, states, i))
+            continue;
+        const auto it = decoded.constFind(i);
+        const auto &fill = tree.at(i).fill;
+        const uchar *blendIf = tree.at(i).blendIf.isEmpty() ? nullptr : reinterpret_cast<const uchar *>(tree.at(i).blendIf.constData());
+        if (fill.type != PSDFillNone)
+        {
+            const QPoint offset = states.at(i).offset;
+            const QRect target = fill.bounds.translated(offset).intersected(area);
+            const bool masked = it != decoded.constEnd() && it->size() == fill.bounds.size();
+            for (int top = target.top(); top <= target.bottom(); top += PSDFillTileRows)
+            {
+                const QRect rows(target.left(), top, target.width(), qMin(PSDFillTileRows, target.bottom() + 1 - top));
+                QImage tile = renderPSDFillTile(fill, rows.translated(-offset));
+                if (masked)
+                    maskPSDFillTile(tile, *it, rows.topLeft() - offset - fill.bounds.topLeft());
+                if (linear)
+                    compositePSDLayerLinear(linearCanvas, area, tile, rows.topLeft(), records.at(i).opacity, blendIf);
+                else
+                    compositePSDLayer(canvas, area, tile, rows.topLeft(), records.at(i).opacity, blendIf);
+            }
+            continue;
+        }
+        if (it == decoded.constEnd() || it->isNull())
+            continue;
+        const auto &record = records.at(i);
+        const QPoint position(static_cast<qint32>(record.left), static_cast<qint32>(record.top));
+        const auto layerSpans = spans ? spans->constFind(i) : QHash<int, PSDLayerSpans>::const_iterator();
+        const PSDLayerSpans *alphaSpans = spans && layerSpans != spans->constEnd() ? &*layerSpans : nullptr;
+        if (linear)
+            compositePSDLayerLinear(linearCanvas, area, *it, position + states.at(i).offset, record.opacity, blendIf, alphaSpans);
+        else if (alphaSpans && !blendIf)
+            compositePSDLayerSpans(canvas, area, *it, position + states.at(i).offset, record.opacity, *alphaSpans);
+        else
+            compositePSDLayer(canvas, area, *it, position + states.at(i).offset, record.opacity, blendIf);
+    }
+    return linear ? linearPSDCanvasToImage(linearCanvas, area.size()) : canvas;
+}
+
+/**
+ * @brief output path with prefix added to file name, prefix is used in batch mode.
+ */
+QString psdOutputPath(const QString &prefix, const QString &path)
+{
+    if (prefix.isEmpty())
+        return path;
+    const QFileInfo info(path);
+    return QDir(info.path()).filePath(prefix + info.fileName());
+}
+
+/**
+ * @brief decode layers into cache, each layer is decoded at most once.
+ *
+ * @param ds binary data stream.
+ * @param records layer records.
+ * @param tree layer tree.
+ * @param layers record indices to decode.
+ * @param decoded cache, already decoded layers are not read again.
+ * @param spans receives alpha spans of decoded layers if not nullptr.
+ * @return int 0 if successfully, -1 failed.
+ */
+int decodePSDLayers(QDataStream &ds, const QList<PSDLayerRecord> &records, const QList<PSDLayerNode> &tree,
+    const QList<int> &layers, QHash<int, QImage> &decoded, QHash<int, PSDLayerSpans> *spans = nullptr)
+{
+    foreach(int i, layers)
+    {
+        const auto &record = records.at(i);
+        if (decoded.contains(i) || record.right <= record.left || record.bottom <= record.top)
+            continue;
+        if (!ds.device()->seek(tree.at(i).channelDataOffset))
+        {
+            qDebug() << QString("can't seek to channel image data, layer record=%1").arg(i);
+            return -1;
+        }
+        bool ok;
+        PSDLayerSpans layerSpans;
+        QImage image = loadPSDLayer(ds, record, &ok, spans ? &layerSpans : nullptr);
+        if (!ok)
+        {
+            qDebug() << QString("loadPSDLayer failed, layer record=%1").arg(i);
+            return -1;
+        }
+        decoded.insert(i, image);
+        if (spans && layerSpans.rows.size() == image.height() + 1)
+            spans->insert(i, layerSpans);
+    }
+    return 0;
+}
+
+/**
+ * @brief read layer comps from image resource 1065.
+ */
+QList<PSDLayerComp> readPSDLayerComps(const PSDImageResouceSection &section)
+{
+    QList<PSDLayerComp> comps;
+    foreach(const PSDImageResourceBlock &block, section.imageResouces)
+    {
+        if (block.id != PSDImageResourceLayerComps)
+            continue;
+        QVariantMap descriptor;
+        if (!readPSDVersionedDescriptor(block.data, 0, &descriptor))
+        {
+            qDebug() << "can't read layer comps descriptor.";
+            break;
+        }
+        foreach(const QVariant &item, descriptor.value("list").toList())
+        {
+            const QVariantMap comp = item.toMap();
+            comps.append(PSDLayerComp {
+                comp.value("compID").toInt(),
+                comp.value("Nm  ").toString(),
+                comp.value("capturedInfo").toUInt(),
+            });
+        }
+    }
+    return comps;
+}
+
+/**
+ * @brief read layer state settings from metadata setting of layer.
+ *
+ * @param d layer extra data.
+ * @param key 'cmls' or 'mlst'.
+ * @param listKey "layerSettings" for 'cmls', "LaSt" for 'mlst'.
+ * @param idsKey "compList" for 'cmls', "FrLs" for 'mlst'.
+ */
+QList<PSDLayerStateSetting> readPSDLayerStateSettings(const PSDLayerExtraData &d, quint32 key, const QString &listKey, const QString &idsKey)
+{
+    QList<PSDLayerStateSetting> settings;
+    const QByteArray data = findPSDMetadataSetting(d, key);
+    QVariantMap descriptor;
+    if (data.isEmpty() || !readPSDVersionedDescriptor(data, 0, &descriptor))
+        return settings;
+
+    foreach(const QVariant &item, descriptor.value(listKey).toList())
+    {
+        const QVariantMap layerSetting = item.toMap();
+        PSDLayerStateSetting setting;
+        foreach(const QVariant &id, layerSetting.value(idsKey).toList())
+        {
+            setting.ids.append(id.toInt());
+        }
+        setting.hasVisibility = layerSetting.contains("enab");
+        setting.visible = layerSetting.value("enab").toBool();
+        setting.hasOffset = layerSetting.contains("Ofst");
+        const QVariantMap offset = layerSetting.value("Ofst").toMap();
+        setting.offset = QPoint(qRound(offset.value("Hrzn").toDouble()), qRound(offset.value("Vrtc").toDouble()));
+        settings.append(setting);
+    }
+    return settings;
+}
+
+/**
+ * @brief apply layer state settings of comp or frame over default states.
+ *
+ * @param settings settings per layer record.
+ * @param id comp id or frame id.
+ * @param applyVisibility apply visibility.
+ * @param applyOffset apply offset.
+ * @param states destination.
+ */
+void applyPSDLayerStateSettings(const QList<QList<PSDLayerStateSetting>> &settings, qint32 id,
+    bool applyVisibility, bool applyOffset, QList<PSDLayerState> &states)
+{
+    for (int i = 0; i < settings.size(); i++)
+    {
+        foreach(const PSDLayerStateSetting &setting, settings.at(i))
+        {
+            if (!setting.ids.contains(id))
+                continue;
+            if (applyVisibility && setting.hasVisibility)
+                states[i].visible = setting.visible;
+            if (applyOffset && setting.hasOffset)
+                states[i].offset = setting.offset;
+        }
+    }
+}
+
+/**
+ * @brief render all layer comps.
+ *
+ * Layers referenced by any comp are decoded once into shared cache,
+ * then comps are composited and saved in parallel.
+ *
+ * @param ds binary data stream.
+ * @param header file header.
+ * @param imageResouceSection image resources, layer comps are read from it.
+ * @param records layer records.
+ * @param tree layer tree.
+ * @param blendSpace color space in which layers are blended.
+ * @param outputPrefix prefix of output file names.
+ * @return int 0 if successfully, -1 failed.
+ */
+int renderPSDLayerComps(QDataStream &ds, const PSDFileHeaderSection &header, const PSDImageResouceSection &imageResouceSection,
+    const QList<PSDLayerRecord> &records, const QList<PSDLayerNode> &tree, PSDBlendSpace blendSpace, const QString &outputPrefix)
+{
+    const QList<PSDLayerComp> comps = readPSDLayerComps(imageResouceSection);
+    qDebug() << QString("layer comps: %1").arg(comps.size());
+
+    QList<QList<PSDLayerStateSetting>> layerSettings;
+    foreach(const PSDLayerRecord &record, records)
+    {
+        layerSettings.append(readPSDLayerStateSettings(record.extraData, PSDKeyLayerCompSetting, "layerSettings", "compList"));
+    }
+
+    // apply captured state of each comp over default state.
+    const QList<PSDLayerState> defaultStates = defaultPSDLayerStates(records);
+    QList<QList<PSDLayerState>> compStates;
+    QList<int> referenced;
+    QList<bool> isReferenced(records.size(), false);
+    foreach(const PSDLayerComp &comp, comps)
+    {
+        QList<PSDLayerState> states = defaultStates;
+        applyPSDLayerStateSettings(layerSettings, comp.id, comp.capturedInfo & 0x01, comp.capturedInfo & 0x02, states);
+        for (int i = 0; i < records.size(); i++)
+        {
+            if (!isReferenced.at(i) && tree.at(i).sectionType == PSDSectionDividerAnyOther && isPSDLayerVisible(tree, states, i))
+            {
+                isReferenced[i] = true;
+                referenced.append(i);
+            }
+        }
+        compStates.append(states);
+    }
+
+    QHash<int, QImage> decoded;
+    QHash<int, PSDLayerSpans> spans;
+    if (decodePSDLayers(ds, records, tree, referenced, decoded, &spans) != 0)
+        return -1;
+    qDebug() << QString("decoded %1 layers for %2 comps").arg(decoded.size()).arg(comps.size());
+
+    QList<int> compIndices;
+    for (int i = 0; i < comps.size(); i++)
+        compIndices.append(i);
+    const QRect area(0, 0, header.width, header.height);
+    const QList<bool> saved = QtConcurrent::blockingMapped<QList<bool>>(psdThreadPool(), compIndices, [&](int i) -> bool
+    {
+        const QImage image = compositePSDLayers(records, tree, decoded, compStates.at(i), area, blendSpace, &spans);
+        const QString fileName = psdOutputPath(outputPrefix, QString("comp%1.png").arg(i));
+        PSDTraceScope trace("savePNG", i);
+        if (!image.save(fileName, "PNG"))
+            return false;
+        qDebug() << QString("comp %1 \"%2\" saved to %3").arg(comps.at(i).id).arg(comps.at(i).name).arg(fileName);
+        return true;
+    });
+    return saved.contains(false) ? -1 : 0;
+}
+
+/**
+ * @brief read animation frames from 'AnDs' of image resource 4000.
+ *
+ * @return QList<PSDAnimationFrame> frames of active frame set in playback order.
+ */
+QList<PSDAnimationFrame> readPSDAnimationFrames(const PSDImageResouceSection &section)
+{
+    QList<PSDAnimationFrame> frames;
+    foreach(const PSDImageResourceBlock &block, section.imageResouces)
+    {
+        if (block.id != PSDImageResourceAnimation)
+            continue;
+        QDataStream in(block.data);
+        in.setByteOrder(QDataStream::BigEndian);
+        quint32 signature, type, length;
+        in >> signature;
+        in >> type;
+        in >> length;
+        if (in.status() != QDataStream::Ok || signature != PSDSignatureMani)
+            continue;
+
+        QVariantMap descriptor;
+        while (block.data.size() - in.device()->pos() >= PSDAdditionalLayerInfoSize)
+        {
+            quint32 key;
+            in >> signature;
+            in >> key;
+            in >> length;
+            const auto pos = in.device()->pos();
+            if (signature != PSDSignature8BIM || length > block.data.size() - pos)
+                break;
+            if (key == PSDKeyAnimationDescriptor)
+            {
+                if (!readPSDVersionedDescriptor(block.data, pos, &descriptor))
+                    qDebug() << "can't read animation descriptor.";
+                break;
+            }
+            in.skipRawData(length + (4 - length % 4) % 4);
+        }
+        if (descriptor.isEmpty())
+            continue;
+
+        QHash<qint32, qint32> delays;
+        QList<qint32> order;
+        foreach(const QVariant &item, descriptor.value("FrIn").toList())
+        {
+            const QVariantMap frameInfo = item.toMap();
+            delays.insert(frameInfo.value("FrID").toInt(), frameInfo.value("FrDl").toInt());
+            order.append(frameInfo.value("FrID").toInt());
+        }
+        const qint32 activeFrameSet = descriptor.value("AFSt").toInt();
+        foreach(const QVariant &item, descriptor.value("FSts").toList())
+        {
+            const QVariantMap frameSet = item.toMap();
+            if (frameSet.value("FsID").toInt() != activeFrameSet || !frameSet.contains("FsFr"))
+                continue;
+            order.clear();
+            foreach(const QVariant &id, frameSet.value("FsFr").toList())
+            {
+                order.append(id.toInt());
+            }
+        }
+        foreach(qint32 id, order)
+        {
+            frames.append(PSDAnimationFrame { id, delays.value(id) });
+        }
+    }
+    return frames;
+}
+
+/**
+ * @brief document rectangle covered by layer.
+ */
+QRect psdLayerRect(const PSDLayerRecord &record, const PSDLayerState &state)
+{
+    return QRect(static_cast<qint32>(record.left), static_cast<qint32>(record.top),
+        record.right - record.left, record.bottom - record.top).translated(state.offset);
+}
+
+/**
+ * @brief add dirty rectangle, rectangles intersecting with it are merged.
+ */
+void addPSDDirtyRect(QList<QRect> &dirtyRects, QRect rect)
+{
+    if (rect.isEmpty())
+        return;
+    for (int i = 0; i < dirtyRects.size();)
+    {
+        if (dirtyRects.at(i).intersects(rect))
+        {
+            rect = rect.united(dirtyRects.at(i));
+            dirtyRects.removeAt(i);
+            i = 0;
+            continue;
+        }
+        i++;
+    }
+    dirtyRects.append(rect);
+}
+
+/**
+ * @brief copy whole source image into destination at position, both are Format_ARGB32.
+ */
+void blitPSDImage(QImage &dst, const QPoint &position, const QImage &src)
+{
+    const QRect target = QRect(position, src.size()).intersected(dst.rect());
+    for (int y = target.top(); y <= target.bottom(); y++)
+    {
+        memcpy(dst.scanLine(y) + target.left() * sizeof(QRgb),
+            src.constScanLine(y - position.y()) + (target.left() - position.x()) * sizeof(QRgb),
+            target.width() * sizeof(QRgb));
+    }
+}
+
+/**
+ * @brief render animation frames to image sequence or sprite sheet.
+ *
+ * First frame is fully composited, following frames recomposite only the
+ * dirty rectangles of layers whose visibility or offset changed since the previous frame.
+ * Frames are encoded in parallel while next frames are rendered.
+ *
+ * @param ds binary data stream.
+ * @param header file header.
+ * @param imageResouceSection image resources, animation frames are read from it.
+ * @param records layer records.
+ * @param tree layer tree.
+ * @param spriteSheet save frames.png as sprite sheet instead of frame<n>.png.
+ * @param blendSpace color space in which layers are blended.
+ * @param outputPrefix prefix of output file names.
+ * @return int 0 if successfully, -1 failed.
+ */
+int renderPSDAnimationFrames(QDataStream &ds, const PSDFileHeaderSection &header, const PSDImageResouceSection &imageResouceSection,
+    const QList<PSDLayerRecord> &records, const QList<PSDLayerNode> &tree, bool spriteSheet, PSDBlendSpace blendSpace,
+    const QString &outputPrefix)
+{
+    const QList<PSDAnimationFrame> frames = readPSDAnimationFrames(imageResouceSection);
+    qDebug() << QString("animation frames: %1").arg(frames.size());
+    if (frames.isEmpty())
+    {
+        qDebug() << "no animation frames in image resources.";
+        return -1;
+    }
+
+    QList<QList<PSDLayerStateSetting>> layerSettings;
+    foreach(const PSDLayerRecord &record, records)
+    {
+        layerSettings.append(readPSDLayerStateSettings(record.extraData, PSDKeyAnimationFrameSetting, "LaSt", "FrLs"));
+    }
+
+    const QList<PSDLayerState> defaultStates = defaultPSDLayerStates(records);
+    QList<QList<PSDLayerState>> frameStates;
+    QList<int> referenced;
+    QList<bool> isReferenced(records.size(), false);
+    foreach(const PSDAnimationFrame &frame, frames)
+    {
+        QList<PSDLayerState> states = defaultStates;
+        applyPSDLayerStateSettings(layerSettings, frame.id, true, true, states);
+        for (int i = 0; i < records.size(); i++)
+        {
+            if (!isReferenced.at(i) && tree.at(i).sectionType == PSDSectionDividerAnyOther && isPSDLayerVisible(tree, states, i))
+            {
+                isReferenced[i] = true;
+                referenced.append(i);
+            }
+        }
+        frameStates.append(states);
+    }
+
+    QHash<int, QImage> decoded;
+    QHash<int, PSDLayerSpans> spans;
+    if (decodePSDLayers(ds, records, tree, referenced, decoded, &spans) != 0)
+        return -1;
+
+    const QRect area(0, 0, header.width, header.height);
+    QList<QImage> images;
+    QList<QFuture<bool>> saving;
+    for (int f = 0; f < frames.size(); f++)
+    {
+        const QList<PSDLayerState> &states = frameStates.at(f);
+        QImage image;
+        if (f == 0)
+        {
+            image = compositePSDLayers(records, tree, decoded, states, area, blendSpace, &spans);
+        }
+        else
+        {
+            const QList<PSDLayerState> &previous = frameStates.at(f - 1);
+            QList<QRect> dirtyRects;
+            foreach(int i, referenced)
+            {
+                const bool wasVisible = isPSDLayerVisible(tree, previous, i);
+                const bool isVisible = isPSDLayerVisible(tree, states, i);
+                if (wasVisible == isVisible && (!isVisible || previous.at(i).offset == states.at(i).offset))
+                    continue;
+                if (wasVisible)
+                    addPSDDirtyRect(dirtyRects, psdLayerRect(records.at(i), previous.at(i)).intersected(area));
+                if (isVisible)
+                    addPSDDirtyRect(dirtyRects, psdLayerRect(records.at(i), states.at(i)).intersected(area));
+            }
+            image = images.at(f - 1).copy();
+            foreach(const QRect &rect, dirtyRects)
+            {
+                blitPSDImage(image, rect.topLeft(), compositePSDLayers(records, tree, decoded, states, rect, blendSpace, &spans));
+            }
+            qDebug() << QString("frame %1 dirty rects %2").arg(f).arg(dirtyRects.size());
+        }
+        images.append(image);
+        qDebug() << QString("frame %1 id %2 delay %3").arg(f).arg(frames.at(f).id).arg(frames.at(f).delay);
+
+        if (!spriteSheet)
+        {
+            const QString fileName = psdOutputPath(outputPrefix, QString("frame%1.png").arg(f));
+            saving.append(QtConcurrent::run(psdThreadPool(), [image, fileName, f]()
+            {
+                PSDTraceScope trace("savePNG", f);
+                return image.save(fileName, "PNG");
+            }));
+        }
+    }
+
+    if (spriteSheet)
+    {
+        const int columns = qCeil(qSqrt(static_cast<qreal>(frames.size())));
+        const int rows = (frames.size() + columns - 1) / columns;
+        QImage sheet(area.width() * columns, area.height() * rows, QImage::Format_ARGB32);
+        sheet.fill(0);
+        for (int f = 0; f < images.size(); f++)
+        {
+            blitPSDImage(sheet, QPoint((f % columns) * area.width(), (f / columns) * area.height()), images.at(f));
+        }
+        const QString fileName = psdOutputPath(outputPrefix, "frames.png");
+        if (!sheet.save(fileName, "PNG"))
+            return -1;
+        qDebug() << QString("%1 frames saved to %2, %3 columns").arg(images.size()).arg(fileName).arg(columns);
+        return 0;
+    }
+
+    bool ok = true;
+    for (auto &future : saving)
+    {
+        ok &= future.result();
+    }
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief copy byte range of source file to current position of destination file.
+ *
+ * copy_file_range is used on Linux so that the kernel can share extents(reflink)
+ * or copy without going through user space, read/write is used otherwise.
+ *
+ * @param src source file.
+ * @param offset offset in source file.
+ * @param length bytes to copy.
+ * @param dst destination file, position is advanced by length.
+ * @return int 0 if successfully, -1 failed.
+ */
+int copyPSDFileRange(QFile &src, qint64 offset, qint64 length, QFileDevice &dst)
+{
+#ifdef Q_OS_LINUX
+    if (dst.flush())
+    {
+        loff_t in = offset;
+        loff_t out = dst.pos();
+        qint64 remain = length;
+        while (remain > 0)
+        {
+            const ssize_t copied = copy_file_range(src.handle(), &in, dst.handle(), &out, remain, 0);
+            if (copied <= 0)
+                break;
+            remain -= copied;
+        }
+        if (remain == 0)
+            return dst.seek(out) ? 0 : -1;
+        // EXDEV などで失敗した場合は途中から read/write で続ける。
+        offset = in;
+        length = remain;
+        if (!dst.seek(out))
+            return -1;
+    }
+#endif
+    if (!src.seek(offset))
+        return -1;
+    const qint64 chunkSize = 1 << 20;
+    while (length > 0)
+    {
+        const QByteArray chunk = src.read(qMin(chunkSize, length));
+        if (chunk.isEmpty() || dst.write(chunk) != chunk.size())
+            return -1;
+        length -= chunk.size();
+    }
+    return 0;
+}
+
+/**
+ * @brief layer metadata edit given by command line.
+ */
+struct PSDLayerEdit
+{
+    enum Kind
+    {
+        Rename,
+        Hide,
+        Show,
+        Opacity,
+        MoveUp,
+        MoveDown,
+    };
+    Kind                kind;
+    PSDLayerSelector    selector;
+    QString             value;
+};
+
+/**
+ * @brief parse layer edit, "<selector>=<value>" for rename and opacity, "<selector>" for others.
+ */
+bool parsePSDLayerEdit(PSDLayerEdit::Kind kind, const QString &text, PSDLayerEdit *edit)
+{
+    edit->kind = kind;
+    QString selector = text;
+    if (kind == PSDLayerEdit::Rename || kind == PSDLayerEdit::Opacity)
+    {
+        const auto separator = text.indexOf(QChar('='));
+        if (separator < 0)
+        {
+            qDebug() << QString("layer edit requires <selector>=<value>: %1").arg(text);
+            return false;
+        }
+        selector = text.left(separator);
+        edit->value = text.mid(separator + 1);
+        if (kind == PSDLayerEdit::Opacity)
+        {
+            bool ok = false;
+            const int opacity = edit->value.toInt(&ok);
+            if (!ok || opacity < 0 || opacity > 255)
+            {
+                qDebug() << QString("layer opacity must be 0-255: %1").arg(text);
+                return false;
+            }
+        }
+    }
+    return parsePSDLayerSelector(selector, &edit->selector);
+}
+
+/**
+ * @brief set layer name to Pascal String and 'luni' of extra data.
+ */
+void renamePSDLayer(PSDLayerRecord &record, const QString &name)
+{
+    // Pascal String は 255 バイトまでなので文字単位で切り詰める。
+    QStringEncoder fromUtf16 = QStringEncoder(QStringEncoder::System);
+    QString truncated = name;
+    QByteArray pascalName = fromUtf16(truncated);
+    while (pascalName.size() > 255)
+    {
+        truncated.chop(1);
+        pascalName = fromUtf16(truncated);
+    }
+    record.extraData.pascalName = pascalName;
+
+    QByteArray luni;
+    QDataStream out(&luni, QIODevice::WriteOnly);
+    out.setByteOrder(QDataStream::BigEndian);
+    out << static_cast<quint32>(name.size());
+    foreach(const QChar &c, name)
+    {
+        out << c.unicode();
+    }
+    while (luni.size() % 4)
+        out << static_cast<quint8>(0);
+
+    for (auto &block : record.extraData.additionalLayerInfos)
+    {
+        if (block.key == PSDKeyUnicodeLayerName)
+        {
+            block.data = luni;
+            return;
+        }
+    }
+    record.extraData.additionalLayerInfos.append(PSDAdditionalLayerInfoBlock { PSDSignature8BIM, PSDKeyUnicodeLayerName, luni });
+}
+
+/**
+ * @brief record index range(bottom, top) of layer or group with its children in current order.
+ */
+static QPair<int, int> psdLayerSpan(const QList<PSDLayerNode> &tree, const QList<int> &order, int index)
+{
+    const int top = order.indexOf(index);
+    int bottom = top;
+    // group の子は group record の直下に連続して並び、最下段が bounding section である。
+    for (int i = top - 1; i >= 0; i--)
+    {
+        int j = order.at(i);
+        while (j >= 0 && j != index)
+            j = tree.at(j).parent;
+        if (j != index)
+            break;
+        bottom = i;
+    }
+    return qMakePair(bottom, top);
+}
+
+/**
+ * @brief swap layer(or group) with its sibling above or below in the same group.
+ *
+ * @return true if moved, false if layer is already at the top or bottom of the group.
+ */
+bool movePSDLayer(const QList<PSDLayerNode> &tree, QList<int> &order, int index, bool up)
+{
+    const auto span = psdLayerSpan(tree, order, index);
+    const int parent = tree.at(index).parent;
+    const int neighbor = up ? span.second + 1 : span.first - 1;
+    if (neighbor < 0 || neighbor >= order.size())
+        return false;
+    int sibling = order.at(neighbor);
+    if (sibling == parent || (tree.at(sibling).sectionType == PSDSectionDividerBoundingSection && tree.at(sibling).parent == parent))
+        return false;
+    while (sibling >= 0 && tree.at(sibling).parent != parent)
+        sibling = tree.at(sibling).parent;
+    if (sibling < 0)
+        return false;
+
+    const auto siblingSpan = psdLayerSpan(tree, order, sibling);
+    const auto lower = up ? span : siblingSpan;
+    const auto upper = up ? siblingSpan : span;
+    const QList<int> reordered = order.mid(upper.first, upper.second - upper.first + 1)
+        + order.mid(lower.first, lower.second - lower.first + 1);
+    for (int i = 0; i < reordered.size(); i++)
+        order[lower.first + i] = reordered.at(i);
+    return true;
+}
+
+/**
+ * @brief reorder image resources indexed by layer record.
+ *
+ * Group ids(1026) and group enabled flags(1072) are permuted by order,
+ * target layer index(1024) is remapped to its new position.
+ *
+ * @param section image resources of source file.
+ * @param order source record index of each new record.
+ * @return PSDImageResouceSection reordered image resources.
+ */
+PSDImageResouceSection reorderPSDLayerResources(const PSDImageResouceSection &section, const QList<int> &order)
+{
+    PSDImageResouceSection reordered;
+    foreach(PSDImageResourceBlock block, section.imageResouces)
+    {
+        if (block.id == PSDImageResourceLayerGroupInfo || block.id == PSDImageResourceLayerGroupsEnabledId)
+        {
+            const int itemSize = block.id == PSDImageResourceLayerGroupInfo ? 2 : 1;
+            if (block.data.size() != qsizetype(order.size()) * itemSize)
+            {
+                qDebug() << QString("image resource %1 doesn't match layer count, dropped.").arg(block.id);
+                continue;
+            }
+            QByteArray data(block.data.size(), Qt::Uninitialized);
+            for (int i = 0; i < order.size(); i++)
+                memcpy(data.data() + i * itemSize, block.data.constData() + order.at(i) * itemSize, itemSize);
+            block.data = data;
+        }
+        else if (block.id == PSDImageResourceLayerStateInfo)
+        {
+            const int target = block.data.size() >= 2 ? order.indexOf(qFromBigEndian<quint16>(block.data.constData())) : -1;
+            if (target < 0)
+            {
+                qDebug() << "target layer index is out of range, dropped.";
+                continue;
+            }
+            qToBigEndian<quint16>(static_cast<quint16>(target), block.data.data());
+        }
+        reordered.imageResouces.append(block);
+    }
+    return reordered;
+}
+
+/**
+ * @brief edit layer metadata(name, visibility, opacity and order) without touching pixel data.
+ *
+ * Only layer records are rewritten, channel image data and the rest of the file are
+ * copied through as raw byte ranges. If the layer records keep their size and order,
+ * the source file is patched in place.
+ * When layers are moved, image resources indexed by layer(1024, 1026 and 1072) are reordered with them.
+ *
+ * @param file source file, opened read only.
+ * @param layout section offsets of source file.
+ * @param imageResouceSection image resources of source file.
+ * @param layerAndMaskInfoSection layer and mask info section of source file.
+ * @param layerInfo layer info of source file.
+ * @param records layer records.
+ * @param tree layer tree.
+ * @param edits edits to apply.
+ * @param outputPath destination path, empty to overwrite source file.
+ * @return int 0 if successfully, -1 failed.
+ */
+int editPSDLayers(QFile &file, const PSDFileLayout &layout, const PSDImageResouceSection &imageResouceSection,
+    const PSDLayerAndMaskInfoSection &layerAndMaskInfoSection,
+    const PSDLayerInfo &layerInfo, QList<PSDLayerRecord> records, const QList<PSDLayerNode> &tree,
+    const QList<PSDLayerEdit> &edits, const QString &outputPath)
+{
+    if (records.isEmpty())
+    {
+        qDebug() << "no layers to edit.";
+        return -1;
+    }
+
+    QList<int> order;
+    for (int i = 0; i < records.size(); i++)
+        order.append(i);
+    bool reordered = false;
+
+    foreach(const PSDLayerEdit &edit, edits)
+    {
+        for (int i = 0; i < records.size(); i++)
+        {
+            if (!matchPSDLayerSelector(tree.at(i), edit.selector))
+                continue;
+            auto &record = records[i];
+            switch (edit.kind)
+            {
+            case PSDLayerEdit::Rename:
+                renamePSDLayer(record, edit.value);
+                break;
+            case PSDLayerEdit::Hide:
+                record.flags |= 0x02;
+                break;
+            case PSDLayerEdit::Show:
+                record.flags &= ~0x02;
+                break;
+            case PSDLayerEdit::Opacity:
+                record.opacity = static_cast<quint8>(edit.value.toInt());
+                break;
+            case PSDLayerEdit::MoveUp:
+            case PSDLayerEdit::MoveDown:
+                if (!movePSDLayer(tree, order, i, edit.kind == PSDLayerEdit::MoveUp))
+                    qDebug() << QString("layer %1 can't be moved any further.").arg(i);
+                else
+                    reordered = true;
+                break;
+            }
+            qDebug() << QString("layer %1 \"%2\" edited.").arg(i).arg(tree.at(i).path);
+        }
+    }
+
+    QByteArray layerRecords;
+    QDataStream out(&layerRecords, QIODevice::WriteOnly);
+    out.setByteOrder(QDataStream::BigEndian);
+    foreach(int i, order)
+    {
+        out << records.at(i);
+    }
+    const qint64 oldSize = layout.channelImageDataOffset - layout.layerRecordsOffset;
+    const qint64 delta = layerRecords.size() - oldSize;
+
+    // 大きさも順序も変わらなければ layer record だけを上書きする。
+    if (outputPath.isEmpty() && !reordered && delta == 0)
+    {
+        QFile inPlace(file.fileName());
+        if (!inPlace.open(QIODevice::ReadWrite) || !inPlace.seek(layout.layerRecordsOffset)
+            || inPlace.write(layerRecords) != layerRecords.size())
+        {
+            qDebug() << QString("can't patch layer records: %1").arg(inPlace.errorString());
+            return -1;
+        }
+        qDebug() << QString("layer records patched in place, %1 bytes.").arg(layerRecords.size());
+        return 0;
+    }
+
+    QSaveFile output(outputPath.isEmpty() ? file.fileName() : outputPath);
+    if (!output.open(QIODevice::WriteOnly))
+    {
+        qDebug() << QString("can't open output file: %1").arg(output.errorString());
+        return -1;
+    }
+    QDataStream ds(&output);
+    ds.setByteOrder(QDataStream::BigEndian);
+    if (!reordered)
+    {
+        if (copyPSDFileRange(file, 0, layout.layerAndMaskInfoOffset, output) != 0)
+            goto io_error;
+    }
+    else
+    {
+        // レイヤー順に並ぶ image resource も並べ替えて書き直す。
+        if (copyPSDFileRange(file, 0, layout.imageResouceOffset, output) != 0)
+            goto io_error;
+        ds << reorderPSDLayerResources(imageResouceSection, order);
+    }
+    ds << static_cast<quint32>(layerAndMaskInfoSection.length + delta);
+    ds << static_cast<quint32>(layerInfo.length + delta);
+    ds << layerInfo.layerCount;
+    ds.writeRawData(layerRecords.constData(), layerRecords.size());
+    foreach(int i, order)
+    {
+        if (copyPSDFileRange(file, tree.at(i).channelDataOffset, tree.at(i).channelDataLength, output) != 0)
+            goto io_error;
+    }
+    // total channel image data size is unchanged, so padding and following sections are copied as is.
+    if (copyPSDFileRange(file, tree.last().channelDataOffset + tree.last().channelDataLength,
+            file.size() - (tree.last().channelDataOffset + tree.last().channelDataLength), output) != 0)
+        goto io_error;
+    if (!output.commit())
+        goto io_error;
+    qDebug() << QString("layer records rewritten, size changed by %1 bytes.").arg(delta);
+    return 0;
+io_error:
+    qDebug() << QString("failed to write edited file: %1").arg(output.errorString());
+    output.cancelWriting();
+    return -1;
+}
+
+/**
+ * @brief location of scanlines in merged image data section.
+ */
+struct PSDImageDataLayout
+{
+    quint16         compression = 0;
+    int             width = 0;
+    int             height = 0;
+    int             channels = 0;
+    QList<quint16>  rowLengths; // RLE only, channels * height.
+    QList<qint64>   rowOffsets; // file offset of each scanline, channels * height.
+};
+
+/**
+ * @brief read compression and scanline table of merged image data section.
+ *
+ * @param ds binary data stream.
+ * @param offset file offset of image data section.
+ * @param header file header.
+ * @param layout receives scanline locations.
+ * @return int 0 if successfully, -1 failed.
+ */
+int readPSDImageDataLayout(QDataStream &ds, qint64 offset, const PSDFileHeaderSection &header, PSDImageDataLayout &layout)
+{
+    if (!ds.device()->seek(offset))
+        return -1;
+    const auto currentEndian = ds.byteOrder();
+    ds.setByteOrder(QDataStream::BigEndian);
+    ds >> layout.compression;
+    layout.width = header.width;
+    layout.height = header.height;
+    layout.channels = header.channels;
+    const qsizetype rows = qsizetype(layout.channels) * layout.height;
+    layout.rowLengths.clear();
+    layout.rowOffsets.clear();
+    layout.rowOffsets.reserve(rows);
+    if (layout.compression == 1)
+    {
+        QByteArray table(rows * 2, Qt::Uninitialized);
+        if (ds.readRawData(table.data(), table.size()) != table.size())
+        {
+            ds.setByteOrder(currentEndian);
+            return -1;
+        }
+        qint64 rowOffset = ds.device()->pos();
+        layout.rowLengths.reserve(rows);
+        for (qsizetype r = 0; r < rows; r++)
+        {
+            const quint16 length = qFromBigEndian<quint16>(table.constData() + 2 * r);
+            layout.rowLengths.append(length);
+            layout.rowOffsets.append(rowOffset);
+            rowOffset += length;
+        }
+    }
+    else if (layout.compression == 0 && header.depth == 8)
+    {
+        const qint64 dataOffset = ds.device()->pos();
+        for (qsizetype r = 0; r < rows; r++)
+            layout.rowOffsets.append(dataOffset + r * layout.width);
+    }
+    else
+    {
+        qDebug() << QString("unsupported merged image compression %1 depth %2").arg(layout.compression).arg(header.depth);
+        ds.setByteOrder(currentEndian);
+        return -1;
+    }
+    ds.setByteOrder(currentEndian);
+    return ds.status() == QDataStream::Ok ? 0 : -1;
+}
+
+/**
+ * @brief read scanlines of one channel of merged image, 8 bit only.
+ *
+ * @return QByteArray width * height bytes, empty if failed.
+ */
+QByteArray readPSDImageDataBand(QDataStream &ds, const PSDImageDataLayout &layout, int channel, int top, int height)
+{
+    const qsizetype first = qsizetype(channel) * layout.height + top;
+    if (!ds.device()->seek(layout.rowOffsets.at(first)))
+        return QByteArray();
+    if (layout.compression == 0)
+    {
+        QByteArray band(qsizetype(layout.width) * height, Qt::Uninitialized);
+        if (ds.readRawData(band.data(), band.size()) != band.size())
+            return QByteArray();
+        return band;
+    }
+    // uncompressRLE が受け取れるよう帯の長さテーブルを前に付ける。
+    qsizetype length = 0;
+    for (int y = 0; y < height; y++)
+        length += layout.rowLengths.at(first + y);
+    QByteArray compressed(2 * qsizetype(height) + length, Qt::Uninitialized);
+    for (int y = 0; y < height; y++)
+        qToBigEndian<quint16>(layout.rowLengths.at(first + y), compressed.data() + 2 * y);
+    if (ds.readRawData(compressed.data() + 2 * height, length) != length)
+        return QByteArray();
+    return uncompressRLE(layout.width, height, compressed);
+}
+
+/**
+ * @brief read channels of merged image after color and transparency, saved alpha and spot channels.
+ *
+ * @param ds binary data stream.
+ * @param imageDataOffset offset of merged image data section.
+ * @param header file header.
+ * @param firstChannel first channel to read.
+ * @param planes receives width * height bytes for each channel, empty if file has no merged image.
+ * @return int 0 if successfully, -1 failed.
+ */
+int readPSDExtraChannels(QDataStream &ds, qint64 imageDataOffset, const PSDFileHeaderSection &header, int firstChannel,
+    QList<QByteArray> *planes)
+{
+    planes->clear();
+    if (firstChannel >= header.channels || imageDataOffset + 2 > ds.device()->size())
+        return 0;
+    PSDImageDataLayout imageData;
+    if (readPSDImageDataLayout(ds, imageDataOffset, header, imageData) != 0)
+        return -1;
+    for (int c = firstChannel; c < imageData.channels; c++)
+    {
+        const QByteArray plane = readPSDImageDataBand(ds, imageData, c, 0, imageData.height);
+        if (plane.isEmpty())
+        {
+            qDebug() << QString("can't read merged image channel %1").arg(c);
+            return -1;
+        }
+        planes->append(plane);
+    }
+    return 0;
+}
+
+/**
+ * @brief write image data section(merged image) compressed by RLE.
+ *
+ * Channels are compressed in parallel. Color is flattened over white as Photoshop does,
+ * channel 3 keeps the transparency if document has it. Later channels are saved alpha and spot channels,
+ * they are taken from extraChannels.
+ *
+ * @param ds binary data stream.
+ * @param image composited image, Format_ARGB32.
+ * @param channels number of channels in file header.
+ * @param transparency true if channel 3 is transparency(negative layer count).
+ * @param extraChannels planes of channels after color and transparency, missing ones are written as zero.
+ */
+void writePSDImageData(QDataStream &ds, const QImage &image, int channels, bool transparency, const QList<QByteArray> &extraChannels)
+{
+    const int width = image.width();
+    const int height = image.height();
+    QList<int> channelIndices;
+    for (int c = 0; c < channels; c++)
+        channelIndices.append(c);
+
+    // ARGB32 is stored as B, G, R, A in memory on little endian, use qRed() and so on to be portable.
+    const auto compressChannel = [&](int c) -> QPair<QList<quint16>, QByteArray>
+    {
+        PSDTraceScope trace("compressChannel", c);
+        QList<quint16> lengths(height, 0);
+        QByteArray compressed;
+        QByteArray scanLine(width, Qt::Uninitialized);
+        uchar *dst = reinterpret_cast<uchar *>(scanLine.data());
+        const int firstExtra = transparency ? 4 : 3;
+        if (c >= firstExtra)
+        {
+            // 保存されたアルファやスポットチャンネルは元の画素をそのまま圧縮し直す。
+            const QByteArray plane = extraChannels.value(c - firstExtra);
+            for (int y = 0; y < height; y++)
+            {
+                if (plane.size() == qsizetype(width) * height)
+                    memcpy(dst, plane.constData() + qsizetype(y) * width, width);
+                else
+                    memset(dst, 0, width);
+                const auto before = compressed.size();
+                compressRLE(dst, width, compressed);
+                lengths[y] = static_cast<quint16>(compressed.size() - before);
+            }
+            return qMakePair(lengths, compressed);
+        }
+        for (int y = 0; y < height; y++)
+        {
+            const QRgb *src = reinterpret_cast<const QRgb *>(image.constScanLine(y));
+            for (int x = 0; x < width; x++)
+            {
+                const int alpha = qAlpha(src[x]);
+                const auto flatten = [&](int v) { return (v * alpha + 255 * (255 - alpha) + 127) / 255; };
+                switch (c)
+                {
+                case 0: dst[x] = flatten(qRed(src[x])); break;
+                case 1: dst[x] = flatten(qGreen(src[x])); break;
+                case 2: dst[x] = flatten(qBlue(src[x])); break;
+                default: dst[x] = alpha; break;
+                }
+            }
+            const auto before = compressed.size();
+            compressRLE(dst, width, compressed);
+            lengths[y] = static_cast<quint16>(compressed.size() - before);
+        }
+        return qMakePair(lengths, compressed);
+    };
+    const auto compressedChannels = QtConcurrent::blockingMapped<QList<QPair<QList<quint16>, QByteArray>>>(psdThreadPool(), channelIndices, compressChannel);
+
+    const auto currentEndian = ds.byteOrder();
+    ds.setByteOrder(QDataStream::BigEndian);
+    ds << static_cast<quint16>(1);
+    for (const auto &channel : compressedChannels)
+    {
+        foreach(quint16 length, channel.first)
+            ds << length;
+    }
+    for (const auto &channel : compressedChannels)
+    {
+        ds.writeRawData(channel.second.constData(), channel.second.size());
+    }
+    ds.setByteOrder(currentEndian);
+}
+
+/**
+ * @brief write selected layers and groups they need to a new PSD file.
+ *
+ * Compressed channel image data of selected layers are copied without decode,
+ * layer info lengths are recomputed and the merged image is recomposited from selected layers.
+ * Image resources indexed by layer and thumbnails are dropped.
+ *
+ * @param file source file.
+ * @param ds binary data stream of source file.
+ * @param layout section offsets of source file.
+ * @param header file header.
+ * @param imageResouceSection image resources.
+ * @param layerAndMaskInfoSection layer and mask info section.
+ * @param layerInfo layer info.
+ * @param records layer records.
+ * @param tree layer tree.
+ * @param selected selected flag per layer record.
+ * @param blendSpace color space in which merged image is composited.
+ * @param outputPath destination path.
+ * @return int 0 if successfully, -1 failed.
+ */
+int extractPSDLayers(QFile &file, QDataStream &ds, const PSDFileLayout &layout, const PSDFileHeaderSection &header,
+    const PSDImageResouceSection &imageResouceSection, const PSDLayerAndMaskInfoSection &layerAndMaskInfoSection,
+    const PSDLayerInfo &layerInfo, const QList<PSDLayerRecord> &records, const QList<PSDLayerNode> &tree,
+    const QList<bool> &selected, PSDBlendSpace blendSpace, const QString &outputPath)
+{
+    if (header.colorMode != 3 || header.depth != 8)
+    {
+        qDebug() << QString("extract supports 8 bit RGB document only, depth %1 color mode %2").arg(header.depth).arg(header.colorMode);
+        return -1;
+    }
+
+    // selected layers, their parent groups and bounding sections of the groups.
+    QList<bool> kept = selected;
+    for (int i = 0; i < records.size(); i++)
+    {
+        if (!selected.at(i))
+            continue;
+        for (int j = tree.at(i).parent; j >= 0; j = tree.at(j).parent)
+            kept[j] = true;
+    }
+    for (int i = 0; i < records.size(); i++)
+    {
+        if (tree.at(i).sectionType == PSDSectionDividerBoundingSection && tree.at(i).parent >= 0 && kept.at(tree.at(i).parent))
+            kept[i] = true;
+    }
+
+    QList<int> keptLayers;
+    QByteArray layerRecords;
+    QDataStream recordStream(&layerRecords, QIODevice::WriteOnly);
+    recordStream.setByteOrder(QDataStream::BigEndian);
+    qint64 channelImageDataSize = 0;
+    for (int i = 0; i < records.size(); i++)
+    {
+        if (!kept.at(i))
+            continue;
+        keptLayers.append(i);
+        recordStream << records.at(i);
+        channelImageDataSize += tree.at(i).channelDataLength;
+    }
+    qDebug() << QString("extract %1 of %2 layer records.").arg(keptLayers.size()).arg(records.size());
+
+    QHash<int, QImage> decoded;
+    QHash<int, PSDLayerSpans> spans;
+    if (decodePSDLayers(ds, records, tree, keptLayers, decoded, &spans) != 0)
+        return -1;
+    // 塗りつぶしレイヤーは decoded に無くても描かれるので、選ばれなかったレイヤーは明示的に隠す。
+    QList<PSDLayerState> states = defaultPSDLayerStates(records);
+    for (int i = 0; i < records.size(); i++)
+    {
+        if (!kept.at(i))
+            states[i].visible = false;
+    }
+    const QImage merged = compositePSDLayers(records, tree, decoded, states,
+        QRect(0, 0, header.width, header.height), blendSpace, &spans);
+
+    PSDImageResouceSection resources;
+    foreach(const PSDImageResourceBlock &block, imageResouceSection.imageResouces)
+    {
+        switch (block.id)
+        {
+        case PSDImageResourceLayerStateInfo:
+        case PSDImageResourceLayerGroupInfo:
+        case PSDImageResourceThumbnailOld:
+        case PSDImageResourceThumbnail:
+        case PSDImageResourceLayerSelectionIds:
+        case PSDImageResourceLayerGroupsEnabledId:
+            break;
+        default:
+            resources.imageResouces.append(block);
+            break;
+        }
+    }
+
+    // global layer mask info and global additional layer info follow layer info.
+    const qint64 layerInfoEnd = layout.layerRecordsOffset - sizeof(layerInfo.layerCount) + layerInfo.length;
+    const qint64 sectionEnd = layout.layerAndMaskInfoOffset + sizeof(layerAndMaskInfoSection.length) + layerAndMaskInfoSection.length;
+    const qint64 layerInfoLength = sizeof(layerInfo.layerCount) + layerRecords.size() + channelImageDataSize;
+    const qint64 layerInfoPadding = layerInfoLength % 2;
+    const qint64 layerAndMaskInfoLength = sizeof(layerInfo.length) + layerInfoLength + layerInfoPadding + (sectionEnd - layerInfoEnd);
+    const qint16 layerCount = static_cast<qint16>(layerInfo.layerCount < 0 ? -keptLayers.size() : keptLayers.size());
+    const bool transparency = layerInfo.layerCount < 0;
+    QList<QByteArray> extraChannels;
+    if (readPSDExtraChannels(ds, layout.imageDataOffset, header, transparency ? 4 : 3, &extraChannels) != 0)
+        return -1;
+
+    QSaveFile output(outputPath);
+    if (!output.open(QIODevice::WriteOnly))
+    {
+        qDebug() << QString("can't open output file: %1").arg(output.errorString());
+        return -1;
+    }
+    QDataStream out(&output);
+    out.setByteOrder(QDataStream::BigEndian);
+    // file header and color mode data.
+    if (copyPSDFileRange(file, 0, layout.imageResouceOffset, output) != 0)
+        goto io_error;
+    out << resources;
+    out << static_cast<quint32>(layerAndMaskInfoLength);
+    out << static_cast<quint32>(layerInfoLength + layerInfoPadding);
+    out << layerCount;
+    out.writeRawData(layerRecords.constData(), layerRecords.size());
+    foreach(int i, keptLayers)
+    {
+        if (copyPSDFileRange(file, tree.at(i).channelDataOffset, tree.at(i).channelDataLength, output) != 0)
+            goto io_error;
+    }
+    if (layerInfoPadding)
+        out << static_cast<quint8>(0);
+    if (copyPSDFileRange(file, layerInfoEnd, sectionEnd - layerInfoEnd, output) != 0)
+        goto io_error;
+    writePSDImageData(out, merged, header.channels, transparency, extraChannels);
+    if (out.status() != QDataStream::Ok || !output.commit())
+        goto io_error;
+    qDebug() << QString("extracted layers saved to %1").arg(outputPath);
+    return 0;
+io_error:
+    qDebug() << QString("failed to write extracted file: %1").arg(output.errorString());
+    output.cancelWriting();
+    return -1;
+}
+
+/**
+ * @brief output format of layer images.
+ */
+enum PSDLayerFormat
+{
+    PSDLayerFormatPNG,
+    PSDLayerFormatOpenEXR,
+    PSDLayerFormatPFM,
+};
+
+/**
+ * @brief scanline compression of OpenEXR, values are those of the file format.
+ */
+enum PSDExrCompression
+{
+    PSDExrCompressionNone = 0,
+    PSDExrCompressionRLE = 1, // 1 scanline per block.
+    PSDExrCompressionZip = 3, // 16 scanlines per block.
+};
+
+/**
+ * @brief zlib stream(RFC 1950) of data, used by OpenEXR ZIP blocks.
+ */
+static QByteArray psdZlibCompress(const QByteArray &data)
+{
+    // qCompress の先頭 4 byte は展開後サイズなので取り除く。
+    return qCompress(data).mid(4);
+}
+
+/**
+ * @brief one zlib stream(RFC 1950) of concatenated parts, parts are deflated in parallel.
+ *
+ * Each part is raw deflate primed with last 32 KiB of previous part as dictionary and ends with
+ * sync flush(last part finishes), so deflate data can be joined and adler32 is combined.
+ *
+ * @param parts data to compress in order.
+ * @return QByteArray zlib stream, empty if failed.
+ */
+static QByteArray psdZlibCompressParallel(const QList<QByteArray> &parts)
+{
+    const int windowSize = 1 << 15;
+    QList<int> indices;
+    for (int i = 0; i < parts.size(); i++)
+        indices.append(i);
+    const auto deflatePart = [&](int i) -> QPair<QByteArray, bool>
+    {
+        PSDTraceScope trace("deflatePart", i);
+        const QByteArray &part = parts.at(i);
+        z_stream stream {};
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return qMakePair(QByteArray(), false);
+        if (i > 0 && !parts.at(i - 1).isEmpty())
+        {
+            const QByteArray &previous = parts.at(i - 1);
+            const int dictionarySize = static_cast<int>(qMin<qsizetype>(previous.size(), windowSize));
+            deflateSetDictionary(&stream, reinterpret_cast<const Bytef *>(previous.constData() + previous.size() - dictionarySize),
+                dictionarySize);
+        }
+        QByteArray out(static_cast<qsizetype>(deflateBound(&stream, part.size())) + 16, Qt::Uninitialized);
+        stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(part.constData()));
+        stream.avail_in = static_cast<uInt>(part.size());
+        stream.next_out = reinterpret_cast<Bytef *>(out.data());
+        stream.avail_out = static_cast<uInt>(out.size());
+        const bool last = i == parts.size() - 1;
+        const int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+        const bool ok = last ? result == Z_STREAM_END : (result == Z_OK && stream.avail_in == 0);
+        out.resize(out.size() - stream.avail_out);
+        deflateEnd(&stream);
+        return qMakePair(out, ok);
+    };
+    const QList<QPair<QByteArray, bool>> deflated = QtConcurrent::blockingMapped<QList<QPair<QByteArray, bool>>>(
+        psdThreadPool(), indices, deflatePart);
+
+    QByteArray stream("\x78\x9C", 2);
+    uLong adler = adler32(0, nullptr, 0);
+    for (int i = 0; i < parts.size(); i++)
+    {
+        if (!deflated.at(i).second)
+        {
+            qDebug() << QString("deflate failed, part %1").arg(i);
+            return QByteArray();
+        }
+        stream += deflated.at(i).first;
+        adler = adler32_combine(adler, adler32(adler32(0, nullptr, 0), reinterpret_cast<const Bytef *>(parts.at(i).constData()),
+            static_cast<uInt>(parts.at(i).size())), parts.at(i).size());
+    }
+    if (parts.isEmpty())
+        stream += QByteArray("\x03\x00", 2); // empty final block.
+    char checksum[4];
+    qToBigEndian<quint32>(static_cast<quint32>(adler), checksum);
+    stream += QByteArray(checksum, 4);
+    return stream;
+}
+
+/**
+ * @brief reorder bytes and apply predictor shared by RLE and ZIP compression of OpenEXR.
+ */
+static QByteArray preprocessExrBlock(const QByteArray &raw)
+{
+    const qsizetype size = raw.size();
+    QByteArray block(size, Qt::Uninitialized);
+    const char *src = raw.constData();
+    char *t1 = block.data();
+    char *t2 = block.data() + (size + 1) / 2;
+    for (qsizetype i = 0; i < size; i += 2)
+    {
+        *t1++ = src[i];
+        if (i + 1 < size)
+            *t2++ = src[i + 1];
+    }
+    uchar *p = reinterpret_cast<uchar *>(block.data());
+    int previous = size ? p[0] : 0;
+    for (qsizetype i = 1; i < size; i++)
+    {
+        const int d = int(p[i]) - previous + (128 + 256);
+        previous = p[i];
+        p[i] = static_cast<uchar>(d);
+    }
+    return block;
+}
+
+/**
+ * @brief run length encoding of OpenEXR, not same as PackBits.
+ */
+static QByteArray compressExrRLE(const QByteArray &data)
+{
+    const int minRunLength = 3;
+    const int maxRunLength = 127;
+    const char *in = data.constData();
+    const char *inEnd = in + data.size();
+    const char *runStart = in;
+    const char *runEnd = in + 1;
+    QByteArray out;
+    out.reserve(data.size() + data.size() / 64 + 2);
+    while (runStart < inEnd)
+    {
+        while (runEnd < inEnd && *runStart == *runEnd && runEnd - runStart - 1 < maxRunLength)
+            ++runEnd;
+        if (runEnd - runStart >= minRunLength)
+        {
+            out.append(static_cast<char>((runEnd - runStart) - 1));
+            out.append(*runStart);
+            runStart = runEnd;
+        }
+        else
+        {
+            while (runEnd < inEnd
+                && ((runEnd + 1 >= inEnd || *runEnd != *(runEnd + 1)) || (runEnd + 2 >= inEnd || *(runEnd + 1) != *(runEnd + 2)))
+                && runEnd - runStart < maxRunLength)
+                ++runEnd;
+            out.append(static_cast<char>(runStart - runEnd));
+            out.append(runStart, runEnd - runStart);
+            runStart = runEnd;
+        }
+        ++runEnd;
+    }
+    return out;
+}
+
+/**
+ * @brief EXR channel name of PSD channel, empty if channel is not exported.
+ */
+static QString exrChannelName(int colorMode, qint16 channelId)
+{
+    if (channelId == -1)
+        return QString("A");
+    if (colorMode == 1 && channelId == 0)
+        return QString("Y");
+    if (colorMode == 3 && channelId >= 0 && channelId <= 2)
+        return QString("RGB").mid(channelId, 1);
+    return QString();
+}
+
+/**
+ * @brief write 32 bit float layer planes to OpenEXR scanline file.
+ *
+ * Data window is the layer rectangle inside the document display window.
+ * Color is premultiplied by alpha as OpenEXR requires, planes are otherwise copied as they are
+ * with only byte order swapped. Blocks are compressed in parallel.
+ *
+ * @param path output file path.
+ * @param planes decoded planes, depth must be 32.
+ * @param position document position of top left of layer.
+ * @param document document size.
+ * @param compression scanline compression.
+ * @return int 0 if successfully, -1 failed.
+ */
+int writePSDOpenEXR(const QString &path, const PSDLayerPlanes &planes, const QPoint &position, const QSize &document,
+    PSDExrCompression compression)
+{
+    PSDTraceScope trace("writePSDOpenEXR", planes.height);
+    if (planes.depth != 32 || planes.width <= 0 || planes.height <= 0)
+    {
+        qDebug() << QString("OpenEXR export requires non-empty 32 bit layer, depth %1").arg(planes.depth);
+        return -1;
+    }
+
+    // EXR のチャンネルは名前順に並べる。
+    QList<QPair<QString, int>> channels;
+    int alphaPlane = -1;
+    for (int i = 0; i < planes.channelIds.size(); i++)
+    {
+        const QString name = exrChannelName(planes.colorMode, planes.channelIds.at(i));
+        if (name.isEmpty())
+            continue;
+        channels.append(qMakePair(name, i));
+        if (planes.channelIds.at(i) == -1)
+            alphaPlane = i;
+    }
+    std::sort(channels.begin(), channels.end(), [](const QPair<QString, int> &a, const QPair<QString, int> &b) { return a.first < b.first; });
+    if (channels.isEmpty())
+    {
+        qDebug() << QString("no channel to export in color mode %1").arg(planes.colorMode);
+        return -1;
+    }
+
+    QByteArray header;
+    const auto appendInt = [&](qint32 value)
+    {
+        char bytes[4];
+        qToLittleEndian<qint32>(value, bytes);
+        header.append(bytes, 4);
+    };
+    const auto appendFloat = [&](float value)
+    {
+        quint32 bits;
+        memcpy(&bits, &value, 4);
+        appendInt(static_cast<qint32>(bits));
+    };
+    const auto appendAttribute = [&](const char *name, const char *type, qint32 size)
+    {
+        header.append(name, std::strlen(name) + 1);
+        header.append(type, std::strlen(type) + 1);
+        appendInt(size);
+    };
+    appendInt(20000630); // magic
+    appendInt(2); // version 2, single part scanline.
+    qint32 chlistSize = 1;
+    for (const auto &channel : channels)
+        chlistSize += channel.first.size() + 1 + 16;
+    appendAttribute("channels", "chlist", chlistSize);
+    for (const auto &channel : channels)
+    {
+        header.append(channel.first.toLatin1());
+        header.append('\0');
+        appendInt(2); // FLOAT
+        appendInt(0); // pLinear, reserved
+        appendInt(1); // xSampling
+        appendInt(1); // ySampling
+    }
+    header.append('\0');
+    appendAttribute("compression", "compression", 1);
+    header.append(static_cast<char>(compression));
+    appendAttribute("dataWindow", "box2i", 16);
+    appendInt(position.x());
+    appendInt(position.y());
+    appendInt(position.x() + planes.width - 1);
+    appendInt(position.y() + planes.height - 1);
+    appendAttribute("displayWindow", "box2i", 16);
+    appendInt(0);
+    appendInt(0);
+    appendInt(document.width() - 1);
+    appendInt(document.height() - 1);
+    appendAttribute("lineOrder", "lineOrder", 1);
+    header.append('\0'); // INCREASING_Y
+    appendAttribute("pixelAspectRatio", "float", 4);
+    appendFloat(1.0f);
+    appendAttribute("screenWindowCenter", "v2f", 8);
+    appendFloat(0.0f);
+    appendFloat(0.0f);
+    appendAttribute("screenWindowWidth", "float", 4);
+    appendFloat(1.0f);
+    header.append('\0');
+
+    const int linesPerBlock = compression == PSDExrCompressionZip ? 16 : 1;
+    const int blockCount = (planes.height + linesPerBlock - 1) / linesPerBlock;
+    QList<int> blocks;
+    for (int b = 0; b < blockCount; b++)
+        blocks.append(b);
+    const auto encodeBlock = [&](int b) -> QByteArray
+    {
+        PSDTraceScope blockTrace("encodeExrBlock", b);
+        const int top = b * linesPerBlock;
+        const int bottom = qMin(top + linesPerBlock, planes.height);
+        QByteArray raw(qsizetype(bottom - top) * channels.size() * planes.width * 4, Qt::Uninitialized);
+        uchar *dst = reinterpret_cast<uchar *>(raw.data());
+        for (int y = top; y < bottom; y++)
+        {
+            const qsizetype rowOffset = qsizetype(y) * planes.width * 4;
+            const uchar *alpha = alphaPlane >= 0 ? reinterpret_cast<const uchar *>(planes.planes.at(alphaPlane).constData()) + rowOffset : nullptr;
+            for (const auto &channel : channels)
+            {
+                const uchar *src = reinterpret_cast<const uchar *>(planes.planes.at(channel.second).constData()) + rowOffset;
+                const bool premultiply = alpha && channel.second != alphaPlane;
+                for (int x = 0; x < planes.width; x++, dst += 4)
+                {
+                    quint32 bits = qFromBigEndian<quint32>(src + 4 * x);
+                    if (premultiply)
+                    {
+                        float value;
+                        float a;
+                        const quint32 alphaBits = qFromBigEndian<quint32>(alpha + 4 * x);
+                        memcpy(&value, &bits, 4);
+                        memcpy(&a, &alphaBits, 4);
+                        value *= a;
+                        memcpy(&bits, &value, 4);
+                    }
+                    qToLittleEndian<quint32>(bits, dst);
+                }
+            }
+        }
+        QByteArray data;
+        switch (compression)
+        {
+        case PSDExrCompressionRLE:
+            data = compressExrRLE(preprocessExrBlock(raw));
+            break;
+        case PSDExrCompressionZip:
+            data = psdZlibCompress(preprocessExrBlock(raw));
+            break;
+        default:
+            break;
+        }
+        // 圧縮で大きくなるブロックは非圧縮で格納する、サイズが一致すれば読み込み側は非圧縮として扱う。
+        if (compression == PSDExrCompressionNone || data.size() >= raw.size())
+            data = raw;
+        QByteArray chunk(8, Qt::Uninitialized);
+        // チャンクの y は dataWindow と同じ文書座標で書く。
+        qToLittleEndian<qint32>(position.y() + top, chunk.data());
+        qToLittleEndian<qint32>(static_cast<qint32>(data.size()), chunk.data() + 4);
+        return chunk + data;
+    };
+    const QList<QByteArray> chunks = QtConcurrent::blockingMapped<QList<QByteArray>>(psdThreadPool(), blocks, encodeBlock);
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        qDebug() << QString("can't open %1").arg(path);
+        return -1;
+    }
+    QByteArray offsets(qsizetype(blockCount) * 8, Qt::Uninitialized);
+    quint64 offset = header.size() + offsets.size();
+    for (int b = 0; b < blockCount; b++)
+    {
+        qToLittleEndian<quint64>(offset, offsets.data() + 8 * b);
+        offset += chunks.at(b).size();
+    }
+    file.write(header);
+    file.write(offsets);
+    for (const auto &chunk : chunks)
+        file.write(chunk);
+    if (!file.commit())
+    {
+        qDebug() << QString("can't write %1: %2").arg(path).arg(file.errorString());
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief write 32 bit float layer planes to PFM.
+ *
+ * Big-endian PFM(positive scale) is used so that samples are copied as stored in PSD.
+ * Grayscale is written as "Pf", RGB as "PF", alpha is dropped.
+ *
+ * @return int 0 if successfully, -1 failed.
+ */
+int writePSDPortableFloatMap(const QString &path, const PSDLayerPlanes &planes)
+{
+    PSDTraceScope trace("writePSDPortableFloatMap", planes.height);
+    if (planes.depth != 32 || planes.width <= 0 || planes.height <= 0)
+    {
+        qDebug() << QString("PFM export requires non-empty 32 bit layer, depth %1").arg(planes.depth);
+        return -1;
+    }
+    const int colors = planes.colorMode == 1 ? 1 : 3;
+    QList<int> sources;
+    for (qint16 id = 0; id < colors; id++)
+    {
+        const int plane = planes.channelIds.indexOf(id);
+        if (plane < 0 || (planes.colorMode != 1 && planes.colorMode != 3))
+        {
+            qDebug() << QString("PFM export requires RGB or grayscale, color mode %1").arg(planes.colorMode);
+            return -1;
+        }
+        sources.append(plane);
+    }
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        qDebug() << QString("can't open %1").arg(path);
+        return -1;
+    }
+    file.write(QString("%1\n%2 %3\n1.0\n").arg(colors == 1 ? "Pf" : "PF").arg(planes.width).arg(planes.height).toLatin1());
+    QByteArray row(qsizetype(planes.width) * colors * 4, Qt::Uninitialized);
+    // PFM は下から上へ並ぶ。
+    for (int y = planes.height - 1; y >= 0; y--)
+    {
+        const qsizetype rowOffset = qsizetype(y) * planes.width * 4;
+        if (colors == 1)
+        {
+            file.write(planes.planes.at(sources.at(0)).constData() + rowOffset, row.size());
+            continue;
+        }
+        char *dst = row.data();
+        for (int x = 0; x < planes.width; x++)
+        {
+            for (int c = 0; c < colors; c++, dst += 4)
+                memcpy(dst, planes.planes.at(sources.at(c)).constData() + rowOffset + 4 * x, 4);
+        }
+        file.write(row);
+    }
+    if (!file.commit())
+    {
+        qDebug() << QString("can't write %1: %2").arg(path).arg(file.errorString());
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief CRC-32 of PNG chunk.
+ */
+static quint32 psdCRC32(const QByteArray &data)
+{
+    static const auto table = []()
+    {
+        QList<quint32> t(256);
+        for (quint32 n = 0; n < 256; n++)
+        {
+            quint32 c = n;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+    quint32 crc = 0xFFFFFFFFu;
+    const uchar *p = reinterpret_cast<const uchar *>(data.constData());
+    for (qsizetype i = 0; i < data.size(); i++)
+        crc = table.at((crc ^ p[i]) & 0xFF) ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+/**
+ * @brief filter one PNG scanline choosing filter of minimum sum of absolute differences.
+ *
+ * @param row unfiltered scanline.
+ * @param previous unfiltered previous scanline, nullptr for first scanline.
+ * @param length scanline length in bytes.
+ * @param bpp bytes per pixel.
+ * @param out receives filter type byte and filtered scanline.
+ */
+static void filterPNGRow(const uchar *row, const uchar *previous, qsizetype length, int bpp, QByteArray &out)
+{
+    QByteArray best;
+    quint64 bestSum = ~0ull;
+    QByteArray candidate(length + 1, Qt::Uninitialized);
+    for (int filter = 0; filter < 5; filter++)
+    {
+        uchar *dst = reinterpret_cast<uchar *>(candidate.data());
+        dst[0] = static_cast<uchar>(filter);
+        quint64 sum = 0;
+        for (qsizetype i = 0; i < length; i++)
+        {
+            const int a = i >= bpp ? row[i - bpp] : 0;
+            const int b = previous ? previous[i] : 0;
+            const int c = (previous && i >= bpp) ? previous[i - bpp] : 0;
+            int predictor = 0;
+            switch (filter)
+            {
+            case 1: predictor = a; break;
+            case 2: predictor = b; break;
+            case 3: predictor = (a + b) / 2; break;
+            case 4:
+                {
+                    const int p = a + b - c;
+                    const int pa = std::abs(p - a);
+                    const int pb = std::abs(p - b);
+                    const int pc = std::abs(p - c);
+                    predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+                }
+                break;
+            }
+            const uchar value = static_cast<uchar>(row[i] - predictor);
+            dst[i + 1] = value;
+            sum += value < 128 ? value : 256 - value;
+        }
+        if (sum < bestSum)
+        {
+            bestSum = sum;
+            best = candidate;
+            candidate = QByteArray(length + 1, Qt::Uninitialized);
+        }
+    }
+    out += best;
+}
+
+/**
+ * @brief write 16 bit layer planes to PNG without converting to 8 bit.
+ *
+ * PNG samples are big-endian as in PSD, so planes are only interleaved.
+ * Scanlines are interleaved, filtered and deflated in parallel bands,
+ * deflated bands are joined into one zlib stream as IDAT must be single stream.
+ * RGB is written as RGBA(or RGB without alpha channel), grayscale as GA(or G).
+ *
+ * @param path output file path.
+ * @param planes decoded planes, depth must be 16.
+ * @return int 0 if successfully, -1 failed.
+ */
+int writePSDPNG16(const QString &path, const PSDLayerPlanes &planes)
+{
+    PSDTraceScope trace("writePSDPNG16", planes.height);
+    if (planes.depth != 16 || planes.width <= 0 || planes.height <= 0 || (planes.colorMode != 1 && planes.colorMode != 3))
+    {
+        qDebug() << QString("16 bit PNG export requires non-empty 16 bit RGB or grayscale layer, depth %1 color mode %2")
+            .arg(planes.depth).arg(planes.colorMode);
+        return -1;
+    }
+    const int colors = planes.colorMode == 1 ? 1 : 3;
+    QList<int> sources;
+    for (qint16 id = 0; id < colors; id++)
+    {
+        const int plane = planes.channelIds.indexOf(id);
+        if (plane < 0)
+        {
+            qDebug() << QString("color channel %1 missing").arg(id);
+            return -1;
+        }
+        sources.append(plane);
+    }
+    const int alphaPlane = planes.channelIds.indexOf(-1);
+    if (alphaPlane >= 0)
+        sources.append(alphaPlane);
+    const int samples = sources.size();
+    const int bpp = samples * 2;
+    const qsizetype rowBytes = qsizetype(planes.width) * bpp;
+
+    const auto interleave = [&](int y, uchar *dst)
+    {
+        const qsizetype rowOffset = qsizetype(y) * planes.width * 2;
+        for (int c = 0; c < samples; c++)
+        {
+            const uchar *src = reinterpret_cast<const uchar *>(planes.planes.at(sources.at(c)).constData()) + rowOffset;
+            uchar *d = dst + 2 * c;
+            for (int x = 0; x < planes.width; x++, d += bpp)
+            {
+                d[0] = src[2 * x];
+                d[1] = src[2 * x + 1];
+            }
+        }
+    };
+    const int bandHeight = 64;
+    QList<int> bands;
+    for (int top = 0; top < planes.height; top += bandHeight)
+        bands.append(top);
+    const auto filterBand = [&](int top) -> QByteArray
+    {
+        PSDTraceScope bandTrace("filterPNGBand", top);
+        const int bottom = qMin(top + bandHeight, planes.height);
+        QByteArray filtered;
+        filtered.reserve((rowBytes + 1) * (bottom - top));
+        QByteArray previous(rowBytes, Qt::Uninitialized);
+        QByteArray current(rowBytes, Qt::Uninitialized);
+        if (top > 0)
+            interleave(top - 1, reinterpret_cast<uchar *>(previous.data()));
+        for (int y = top; y < bottom; y++)
+        {
+            interleave(y, reinterpret_cast<uchar *>(current.data()));
+            filterPNGRow(reinterpret_cast<const uchar *>(current.constData()),
+                y > 0 ? reinterpret_cast<const uchar *>(previous.constData()) : nullptr, rowBytes, bpp, filtered);
+            std::swap(previous, current);
+        }
+        return filtered;
+    };
+    const QList<QByteArray> filteredBands = QtConcurrent::blockingMapped<QList<QByteArray>>(psdThreadPool(), bands, filterBand);
+    const QByteArray idat = psdZlibCompressParallel(filteredBands);
+    if (idat.isEmpty())
+        return -1;
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        qDebug() << QString("can't open %1").arg(path);
+        return -1;
+    }
+    const auto writeChunk = [&](const char *type, const QByteArray &data)
+    {
+        char length[4];
+        qToBigEndian<quint32>(static_cast<quint32>(data.size()), length);
+        file.write(length, 4);
+        const QByteArray body = QByteArray(type, 4) + data;
+        char crc[4];
+        qToBigEndian<quint32>(psdCRC32(body), crc);
+        file.write(body);
+        file.write(crc, 4);
+    };
+    file.write("\x89PNG\r\n\x1a\n", 8);
+    QByteArray ihdr(13, 0);
+    qToBigEndian<quint32>(planes.width, ihdr.data());
+    qToBigEndian<quint32>(planes.height, ihdr.data() + 4);
+    ihdr[8] = 16; // bit depth
+    ihdr[9] = static_cast<char>(colors == 1 ? (alphaPlane >= 0 ? 4 : 0) : (alphaPlane >= 0 ? 6 : 2)); // color type
+    writeChunk("IHDR", ihdr);
+    writeChunk("IDAT", idat);
+    writeChunk("IEND", QByteArray());
+    if (!file.commit())
+    {
+        qDebug() << QString("can't write %1: %2").arg(path).arg(file.errorString());
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief layer mask rectangles read from mask data of layer record.
+ */
+struct PSDLayerMaskInfo
+{
+    QRect   rect; // rectangle of user mask(-2).
+    QRect   realRect; // rectangle of real user mask(-3), same as rect if absent.
+    quint8  defaultColor = 0;
+    quint8  flags = 0;
+};
+
+/**
+ * @brief parse layer mask data, mask data doesn't include its size field.
+ *
+ * @return bool false if layer has no mask data.
+ */
+bool readPSDLayerMaskInfo(const QByteArray &maskData, PSDLayerMaskInfo &mask)
+{
+    if (maskData.size() < 18)
+        return false;
+    const char *p = maskData.constData();
+    const auto readRect = [](const char *r)
+    {
+        const qint32 top = qFromBigEndian<qint32>(r);
+        const qint32 left = qFromBigEndian<qint32>(r + 4);
+        const qint32 bottom = qFromBigEndian<qint32>(r + 8);
+        const qint32 right = qFromBigEndian<qint32>(r + 12);
+        return QRect(left, top, right - left, bottom - top);
+    };
+    mask.rect = readRect(p);
+    mask.defaultColor = static_cast<quint8>(p[16]);
+    mask.flags = static_cast<quint8>(p[17]);
+    mask.realRect = mask.rect;
+    qsizetype pos = 18;
+    // bit 4 が立っている場合は mask parameters が続く。
+    if ((mask.flags & 0x10) && pos < maskData.size())
+    {
+        const quint8 parameters = static_cast<quint8>(p[pos++]);
+        pos += ((parameters & 0x01) ? 1 : 0) + ((parameters & 0x02) ? 8 : 0) + ((parameters & 0x04) ? 1 : 0) + ((parameters & 0x08) ? 8 : 0);
+    }
+    // size が 20 の場合は padding のみ、それ以上なら real flags, real background, real rect.
+    if (maskData.size() > 20 && pos + 18 <= maskData.size())
+        mask.realRect = readRect(p + pos + 2);
+    return true;
+}
+
+/**
+ * @brief output format of single channel export.
+ */
+enum PSDChannelFormat
+{
+    PSDChannelFormatGray, // 8 bit grayscale PNG.
+    PSDChannelFormatMono, // 1 bit PNG thresholded at 128.
+    PSDChannelFormatRLE, // compressed channel data as stored, in PSDC container.
+};
+
+/**
+ * @brief export alpha(-1) or layer mask(-2, -3) channels of selected layers as single channel images.
+ *
+ * Only requested channels are read, data of other channels is skipped by seek.
+ * PSDC container is "PSDC", version(u16), channel id(i16), compression(u16), depth(u16),
+ * top, left, bottom, right(i32), data length(u32) and data, all big-endian.
+ *
+ * @param ds binary data stream.
+ * @param header file header.
+ * @param records layer records.
+ * @param tree layer tree.
+ * @param selected selected flag per layer record.
+ * @param channelIds channel ids to export.
+ * @param format output format.
+ * @param outputPrefix prefix of output file names.
+ * @return int 0 if successfully, -1 failed.
+ */
+int exportPSDLayerChannels(QDataStream &ds, const PSDFileHeaderSection &header, const QList<PSDLayerRecord> &records,
+    const QList<PSDLayerNode> &tree, const QList<bool> &selected, const QList<qint16> &channelIds, PSDChannelFormat format,
+    const QString &outputPrefix)
+{
+    PSDTraceScope trace("exportPSDLayerChannels");
+    if (format != PSDChannelFormatRLE && header.depth != 8)
+    {
+        qDebug() << QString("gray and mono channel export require 8 bit document, depth %1").arg(header.depth);
+        return -1;
+    }
+    for (int i = 0; i < records.size(); i++)
+    {
+        if (!selected.at(i))
+            continue;
+        const auto &record = records.at(i);
+        PSDLayerMaskInfo mask;
+        const bool hasMask = readPSDLayerMaskInfo(record.extraData.maskData, mask);
+        qint64 offset = tree.at(i).channelDataOffset;
+        foreach(const PSDChannelInfo &info, record.channelInfos)
+        {
+            const qint64 channelOffset = offset;
+            offset += info.correspondingChannelDataLength;
+            if (!channelIds.contains(info.channelId))
+                continue;
+            QRect rect(static_cast<qint32>(record.left), static_cast<qint32>(record.top), record.right - record.left, record.bottom - record.top);
+            if (info.channelId == -2 || info.channelId == -3)
+            {
+                if (!hasMask)
+                    continue;
+                rect = info.channelId == -2 ? mask.rect : mask.realRect;
+            }
+            if (rect.isEmpty())
+                continue;
+            if (!ds.device()->seek(channelOffset))
+            {
+                qDebug() << QString("can't seek to channel %1, layer record=%2").arg(info.channelId).arg(i);
+                return -1;
+            }
+            PSDTraceScope channelTrace("exportPSDChannel", info.channelId);
+            const QString suffix = info.channelId == -1 ? QString("alpha") : (info.channelId == -2 ? QString("mask") : QString("realmask"));
+            QString fileName;
+            if (format == PSDChannelFormatRLE)
+            {
+                // 展開せずそのまま格納する。
+                QByteArray data(info.correspondingChannelDataLength, Qt::Uninitialized);
+                if (ds.readRawData(data.data(), data.size()) != data.size() || data.size() < 2)
+                    return -1;
+                fileName = psdOutputPath(outputPrefix, QString("layer%1_%2.psdc").arg(i).arg(suffix));
+                QSaveFile file(fileName);
+                if (!file.open(QIODevice::WriteOnly))
+                    return -1;
+                QDataStream out(&file);
+                out.setByteOrder(QDataStream::BigEndian);
+                out.writeRawData("PSDC", 4);
+                out << static_cast<quint16>(1) << info.channelId << qFromBigEndian<quint16>(data.constData()) << header.depth;
+                out << static_cast<qint32>(rect.top()) << static_cast<qint32>(rect.left())
+                    << static_cast<qint32>(rect.bottom() + 1) << static_cast<qint32>(rect.right() + 1);
+                out << static_cast<quint32>(data.size() - 2);
+                out.writeRawData(data.constData() + 2, data.size() - 2);
+                if (out.status() != QDataStream::Ok || !file.commit())
+                {
+                    qDebug() << QString("can't write %1").arg(fileName);
+                    return -1;
+                }
+            }
+            else
+            {
+                QByteArray plane = loadPSDChannelPlane(ds, info.correspondingChannelDataLength, rect.width(), rect.height(), 8);
+                if (plane.isEmpty())
+                {
+                    qDebug() << QString("can't decode channel %1, layer record=%2").arg(info.channelId).arg(i);
+                    return -1;
+                }
+                const uchar *src = reinterpret_cast<const uchar *>(plane.constData());
+                QImage image;
+                if (format == PSDChannelFormatGray)
+                {
+                    image = QImage(rect.size(), QImage::Format_Grayscale8);
+                    for (int y = 0; y < rect.height(); y++, src += rect.width())
+                        memcpy(image.scanLine(y), src, rect.width());
+                }
+                else
+                {
+                    image = QImage(rect.size(), QImage::Format_Mono);
+                    image.setColorCount(2);
+                    image.setColor(0, qRgb(0, 0, 0));
+                    image.setColor(1, qRgb(255, 255, 255));
+                    for (int y = 0; y < rect.height(); y++, src += rect.width())
+                    {
+                        uchar *dst = image.scanLine(y);
+                        memset(dst, 0, (rect.width() + 7) / 8);
+                        for (int x = 0; x < rect.width(); x++)
+                        {
+                            if (src[x] >= 128)
+                                dst[x >> 3] |= 0x80 >> (x & 7);
+                        }
+                    }
+                }
+                PSDBufferPool::local().release(plane);
+                fileName = psdOutputPath(outputPrefix, QString("layer%1_%2.png").arg(i).arg(suffix));
+                if (!image.save(fileName, "PNG"))
+                {
+                    qDebug() << QString("can't write %1").arg(fileName);
+                    return -1;
+                }
+            }
+            qDebug() << QString("layer %1 channel %2 rect %3,%4 %5x%6 saved to %7")
+                .arg(i).arg(info.channelId).arg(rect.left()).arg(rect.top()).arg(rect.width()).arg(rect.height()).arg(fileName);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief slice of slices resource(1050).
+ */
+struct PSDSlice
+{
+    qint32  id;
+    qint32  groupId;
+    qint32  origin; // 0 auto generated, 1 layer generated, 2 user generated.
+    QString name;
+    QRect   bounds;
+};
+
+/**
+ * @brief read slices from image resource 1050, version 6 and descriptor based version 7, 8 are supported.
+ */
+QList<PSDSlice> readPSDSlices(const PSDImageResouceSection &section)
+{
+    QList<PSDSlice> slices;
+    foreach(const PSDImageResourceBlock &block, section.imageResouces)
+    {
+        if (block.id != PSDImageResourceSlices || block.data.size() < 4)
+            continue;
+        QDataStream ds(block.data);
+        ds.setByteOrder(QDataStream::BigEndian);
+        quint32 version;
+        ds >> version;
+        if (version == 6)
+        {
+            qint32 top, left, bottom, right;
+            QString groupName;
+            quint32 count;
+            ds >> top >> left >> bottom >> right;
+            if (!readPSDUnicodeString(ds, &groupName))
+                break;
+            ds >> count;
+            for (quint32 i = 0; i < count && ds.status() == QDataStream::Ok; i++)
+            {
+                PSDSlice slice;
+                quint32 origin;
+                ds >> slice.id >> slice.groupId >> origin;
+                slice.origin = static_cast<qint32>(origin);
+                if (origin == 1)
+                {
+                    quint32 associatedLayerId;
+                    ds >> associatedLayerId;
+                }
+                quint32 type;
+                QString url, target, message, altTag, cellText;
+                quint8 cellTextIsHTML;
+                quint32 horizontalAlignment, verticalAlignment;
+                quint8 alpha, red, green, blue;
+                if (!readPSDUnicodeString(ds, &slice.name))
+                    break;
+                // slice の矩形は left, top, right, bottom の順。
+                ds >> type >> left >> top >> right >> bottom;
+                if (!readPSDUnicodeString(ds, &url) || !readPSDUnicodeString(ds, &target)
+                    || !readPSDUnicodeString(ds, &message) || !readPSDUnicodeString(ds, &altTag))
+                    break;
+                ds >> cellTextIsHTML;
+                if (!readPSDUnicodeString(ds, &cellText))
+                    break;
+                ds >> horizontalAlignment >> verticalAlignment >> alpha >> red >> green >> blue;
+                if (ds.status() != QDataStream::Ok)
+                    break;
+                slice.bounds = QRect(left, top, right - left, bottom - top);
+                slices.append(slice);
+            }
+        }
+        else if (version == 7 || version == 8)
+        {
+            QVariantMap descriptor;
+            if (!readPSDVersionedDescriptor(block.data, 4, &descriptor))
+            {
+                qDebug() << "invalid slices descriptor.";
+                break;
+            }
+            const QStringList origins = { "autoGenerated", "layerGenerated", "userGenerated" };
+            foreach(const QVariant &item, descriptor.value("slices").toList())
+            {
+                const QVariantMap map = item.toMap();
+                const QVariantMap bounds = map.value("bounds").toMap();
+                PSDSlice slice;
+                slice.id = map.value("sliceID").toInt();
+                slice.groupId = map.value("groupID").toInt();
+                slice.origin = qMax(0, static_cast<int>(origins.indexOf(map.value("origin").toString())));
+                slice.name = map.value("Nm  ").toString();
+                const int left = bounds.value("Left").toInt();
+                const int top = bounds.value("Top ").toInt();
+                slice.bounds = QRect(left, top, bounds.value("Rght").toInt() - left, bounds.value("Btom").toInt() - top);
+                slices.append(slice);
+            }
+        }
+        else
+        {
+            qDebug() << QString("unsupported slices resource version %1").arg(version);
+        }
+        qDebug() << QString("slices version %1 count %2").arg(version).arg(slices.size());
+    }
+    return slices;
+}
+
+/**
+ * @brief read area of merged image data section as ARGB32 image, 8 bit RGB only.
+ *
+ * Color of merged image with alpha is matted with white, the matte is removed.
+ *
+ * @return QImage area of merged image, null if failed.
+ */
+QImage readPSDImageDataImage(QDataStream &ds, const PSDImageDataLayout &imageData, const QRect &area)
+{
+    QImage image(area.size(), QImage::Format_ARGB32);
+    image.fill(0xFF000000U);
+    const int channels = qMin(imageData.channels, 4);
+    for (int c = 0; c < channels; c++)
+    {
+        QByteArray band = readPSDImageDataBand(ds, imageData, c, area.top(), area.height());
+        if (band.isEmpty())
+            return QImage();
+        const int shift = c == 3 ? 24 : 16 - 8 * c;
+        for (int y = 0; y < area.height(); y++)
+        {
+            const uchar *src = reinterpret_cast<const uchar *>(band.constData()) + qsizetype(y) * imageData.width + area.left();
+            QRgb *dst = reinterpret_cast<QRgb *>(image.scanLine(y));
+            for (int x = 0; x < area.width(); x++)
+                dst[x] = (dst[x] & ~(0xFFU << shift)) | (QRgb(src[x]) << shift);
+        }
+        PSDBufferPool::local().release(band);
+    }
+    if (channels < 4)
+        return image;
+    for (int y = 0; y < area.height(); y++)
+    {
+        QRgb *p = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < area.width(); x++)
+        {
+            const int a = qAlpha(p[x]);
+            const auto unmatte = [a](int m) { return a ? qBound(0, ((m - (255 - a)) * 255 + a / 2) / a, 255) : 0; };
+            p[x] = qRgba(unmatte(qRed(p[x])), unmatte(qGreen(p[x])), unmatte(qBlue(p[x])), a);
+        }
+    }
+    return image;
+}
+
+/**
+ * @brief export slices of slices resource as PNG files.
+ *
+ * Slices whose rows overlap are grouped into one band, each band is decoded(or composited) once
+ * and slices are cropped from it and encoded in parallel while next band is decoded.
+ *
+ * @param ds binary data stream.
+ * @param layout section offsets.
+ * @param header file header.
+ * @param imageResouceSection image resources, slices are read from it.
+ * @param records layer records.
+ * @param tree layer tree.
+ * @param fromComposite render from composited layers instead of merged image.
+ * @param blendSpace color space in which layers are blended.
+ * @param outputPrefix prefix of output file names.
+ * @return int 0 if successfully, -1 failed.
+ */
+int exportPSDSlices(QDataStream &ds, const PSDFileLayout &layout, const PSDFileHeaderSection &header,
+    const PSDImageResouceSection &imageResouceSection, const QList<PSDLayerRecord> &records, const QList<PSDLayerNode> &tree,
+    bool fromComposite, PSDBlendSpace blendSpace, const QString &outputPrefix)
+{
+    PSDTraceScope trace("exportPSDSlices");
+    if (header.colorMode != 3 || header.depth != 8)
+    {
+        qDebug() << QString("slice export supports 8 bit RGB document only, depth %1 color mode %2").arg(header.depth).arg(header.colorMode);
+        return -1;
+    }
+    const QRect document(0, 0, header.width, header.height);
+    QList<PSDSlice> slices;
+    foreach(PSDSlice slice, readPSDSlices(imageResouceSection))
+    {
+        slice.bounds = slice.bounds.intersected(document);
+        if (!slice.bounds.isEmpty())
+            slices.append(slice);
+    }
+    if (slices.isEmpty())
+    {
+        qDebug() << "no slice to export.";
+        return 0;
+    }
+    std::sort(slices.begin(), slices.end(), [](const PSDSlice &a, const PSDSlice &b) { return a.bounds.top() < b.bounds.top(); });
+
+    PSDImageDataLayout imageData;
+    QHash<int, QImage> decoded;
+    QHash<int, PSDLayerSpans> spans;
+    const QList<PSDLayerState> states = defaultPSDLayerStates(records);
+    if (fromComposite)
+    {
+        QList<int> layers;
+        for (int i = 0; i < records.size(); i++)
+        {
+            if (tree.at(i).sectionType == PSDSectionDividerAnyOther && isPSDLayerVisible(tree, states, i))
+                layers.append(i);
+        }
+        if (decodePSDLayers(ds, records, tree, layers, decoded, &spans) != 0)
+            return -1;
+    }
+    else if (readPSDImageDataLayout(ds, layout.imageDataOffset, header, imageData) != 0)
+        return -1;
+
+    QList<QFuture<bool>> saving;
+    int bands = 0;
+    for (int first = 0; first < slices.size();)
+    {
+        // 行が重なる slice を同じ帯にまとめる。
+        QRect band = slices.at(first).bounds;
+        int last = first + 1;
+        while (last < slices.size() && slices.at(last).bounds.top() <= band.bottom())
+            band |= slices.at(last++).bounds;
+        PSDTraceScope bandTrace("sliceBand", band.top());
+        const QImage image = fromComposite
+            ? compositePSDLayers(records, tree, decoded, states, band, blendSpace, &spans)
+            : readPSDImageDataImage(ds, imageData, band);
+        if (image.isNull())
+        {
+            qDebug() << QString("can't render slice band rows %1-%2").arg(band.top()).arg(band.bottom());
+            return -1;
+        }
+        for (int i = first; i < last; i++)
+        {
+            const PSDSlice &slice = slices.at(i);
+            const QString fileName = psdOutputPath(outputPrefix, QString("slice%1.png").arg(slice.id));
+            const QRect crop = slice.bounds.translated(-band.topLeft());
+            qDebug() << QString("slice %1 \"%2\" %3,%4 %5x%6 saved to %7").arg(slice.id).arg(slice.name)
+                .arg(slice.bounds.left()).arg(slice.bounds.top()).arg(slice.bounds.width()).arg(slice.bounds.height()).arg(fileName);
+            saving.append(QtConcurrent::run(psdThreadPool(), [image, crop, fileName, id = slice.id]()
+            {
+                PSDTraceScope saveTrace("savePNG", id);
+                return image.copy(crop).save(fileName, "PNG");
+            }));
+        }
+        bands++;
+        first = last;
+    }
+    qDebug() << QString("%1 slices rendered in %2 bands.").arg(slices.size()).arg(bands);
+
+    bool saved = true;
+    for (auto &future : saving)
+        saved = future.result() && saved;
+    return saved ? 0 : -1;
+}
+
+/**
+ * @brief artboard of group layer.
+ */
+struct PSDArtboard
+{
+    int     index; // record index of group.
+    QRect   bounds;
+    int     backgroundType; // 1 white, 2 black, 3 transparent, 4 other.
+    QRgb    background;
+};
+
+/**
+ * @brief read artboards from 'artb', 'artd' or 'abdd' of group layers.
+ */
+QList<PSDArtboard> readPSDArtboards(const QList<PSDLayerRecord> &records, const QList<PSDLayerNode> &tree)
+{
+    QList<PSDArtboard> artboards;
+    for (int i = 0; i < records.size(); i++)
+    {
+        if (tree.at(i).sectionType != PSDSectionDividerOpenFolder && tree.at(i).sectionType != PSDSectionDividerClosedFolder)
+            continue;
+        const auto &d = records.at(i).extraData;
+        const auto *block = findPSDAdditionalLayerInfo(d, PSDKeyArtboardData);
+        if (!block)
+            block = findPSDAdditionalLayerInfo(d, PSDKeyArtboardData2);
+        if (!block)
+            block = findPSDAdditionalLayerInfo(d, PSDKeyArtboardData3);
+        QVariantMap descriptor;
+        if (!block || !readPSDVersionedDescriptor(block->data, 0, &descriptor))
+            continue;
+        const QVariantMap rect = descriptor.value("artboardRect").toMap();
+        const QVariantMap color = descriptor.value("Clr ").toMap();
+        PSDArtboard artboard;
+        artboard.index = i;
+        const int left = qRound(rect.value("Left").toDouble());
+        const int top = qRound(rect.value("Top ").toDouble());
+        artboard.bounds = QRect(left, top, qRound(rect.value("Rght").toDouble()) - left, qRound(rect.value("Btom").toDouble()) - top);
+        artboard.backgroundType = descriptor.value("artboardBackgroundType", 1).toInt();
+        switch (artboard.backgroundType)
+        {
+        case 2: artboard.background = qRgb(0, 0, 0); break;
+        case 3: artboard.background = qRgba(0, 0, 0, 0); break;
+        case 4:
+            artboard.background = qRgb(qBound(0, qRound(color.value("Rd  ").toDouble()), 255),
+                qBound(0, qRound(color.value("Grn ").toDouble()), 255), qBound(0, qRound(color.value("Bl  ").toDouble()), 255));
+            break;
+        default: artboard.background = qRgb(255, 255, 255); break;
+        }
+        qDebug() << QString("artboard %1 \"%2\" %3,%4 %5x%6 background %7").arg(i).arg(tree.at(i).name)
+            .arg(artboard.bounds.left()).arg(artboard.bounds.top()).arg(artboard.bounds.width()).arg(artboard.bounds.height())
+            .arg(artboard.background, 8, 16, QChar('0'));
+        artboards.append(artboard);
+    }
+    return artboards;
+}
+
+/**
+ * @brief composite artboard, only layers under artboard and rows inside its bounds are read.
+ *
+ * @param path PSD file path, opened by each task.
+ * @param records layer records.
+ * @param tree layer tree.
+ * @param artboard artboard to render.
+ * @param blendSpace color space in which layers are blended.
+ * @return QImage artboard image, null if failed.
+ */
+QImage renderPSDArtboard(const QString &path, const QList<PSDLayerRecord> &records, const QList<PSDLayerNode> &tree,
+    const PSDArtboard &artboard, PSDBlendSpace blendSpace)
+{
+    PSDTraceScope trace("renderPSDArtboard", artboard.index);
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        qDebug() << QString("can't open %1").arg(path);
+        return QImage();
+    }
+    QDataStream ds(&file);
+    ds.setByteOrder(QDataStream::BigEndian);
+
+    QList<PSDLayerState> states = defaultPSDLayerStates(records);
+    QHash<int, QImage> decoded;
+    for (int i = 0; i < records.size(); i++)
+    {
+        const auto &record = records.at(i);
+        if (tree.at(i).sectionType != PSDSectionDividerAnyOther)
+            continue;
+        int parent = tree.at(i).parent;
+        while (parent >= 0 && parent != artboard.index)
+            parent = tree.at(parent).parent;
+        // 他の artboard や外にあるレイヤー、特に画素を持たない塗りつぶしレイヤーは隠す。
+        if (parent != artboard.index)
+        {
+            states[i].visible = false;
+            continue;
+        }
+        const QRect layerRect(QPoint(record.left, record.top), QPoint(record.right - 1, record.bottom - 1));
+        // 塗りつぶしレイヤーの画素は透明度として全体を使うので切り詰めない。
+        const QRect rows = tree.at(i).fill.type != PSDFillNone ? layerRect : layerRect.intersected(artboard.bounds);
+        if (!isPSDLayerVisible(tree, states, i) || rows.isEmpty() || !rows.intersects(artboard.bounds))
+            continue;
+        // 帯の行だけ読み、読んだ行の位置は状態の offset で補正する。
+        bool ok = ds.device()->seek(tree.at(i).channelDataOffset);
+        const QImage image = ok ? loadPSDLayerRows(ds, record, rows.top() - record.top, rows.height(), &ok) : QImage();
+        if (!ok)
+        {
+            qDebug() << QString("can't load layer record=%1 of artboard %2").arg(i).arg(artboard.index);
+            return QImage();
+        }
+        decoded.insert(i, image);
+        states[i].offset = QPoint(0, rows.top() - record.top);
+    }
+    QImage image = compositePSDLayers(records, tree, decoded, states, artboard.bounds, blendSpace);
+    if (qAlpha(artboard.background) != 0)
+    {
+        for (int y = 0; y < image.height(); y++)
+        {
+            QRgb *p = reinterpret_cast<QRgb *>(image.scanLine(y));
+            for (int x = 0; x < image.width(); x++)
+                p[x] = blendPSDPixel(artboard.background, p[x], 255);
+        }
+    }
+    return image;
+}
+
+/**
+ * @brief export each artboard as artboard<index>.png, artboards are rendered in parallel.
+ *
+ * @return int 0 if successfully, -1 failed.
+ */
+int exportPSDArtboards(const QString &path, const PSDFileHeaderSection &header, const QList<PSDLayerRecord> &records,
+    const QList<PSDLayerNode> &tree, PSDBlendSpace blendSpace, const QString &outputPrefix)
+{
+    PSDTraceScope trace("exportPSDArtboards");
+    if (header.colorMode != 3 || header.depth != 8)
+    {
+        qDebug() << QString("artboard export supports 8 bit RGB document only, depth %1 color mode %2").arg(header.depth).arg(header.colorMode);
+        return -1;
+    }
+    const QList<PSDArtboard> artboards = readPSDArtboards(records, tree);
+    if (artboards.isEmpty())
+    {
+        qDebug() << "no artboard to export.";
+        return 0;
+    }
+    const QList<bool> saved = QtConcurrent::blockingMapped<QList<bool>>(psdThreadPool(), artboards, [&](const PSDArtboard &artboard) -> bool
+    {
+        if (artboard.bounds.isEmpty())
+            return true;
+        const QImage image = renderPSDArtboard(path, records, tree, artboard, blendSpace);
+        const QString fileName = psdOutputPath(outputPrefix, QString("artboard%1.png").arg(artboard.index));
+        PSDTraceScope saveTrace("savePNG", artboard.index);
+        if (image.isNull() || !image.save(fileName, "PNG"))
+            return false;
+        qDebug() << QString("artboard %1 saved to %2").arg(artboard.index).arg(fileName);
+        return true;
+    });
+    return saved.contains(false) ? -1 : 0;
+}
+
+/**
+ * @brief pattern of 'Patt', 'Pat2' or 'Pat3' in global additional layer info.
+ */
+struct PSDPattern
+{
+    QString id; // unique id, referenced by pattern fills and overlays.
+    QString name;
+    quint32 imageMode;
+    QPoint  point;
+    QImage  image; // null if pattern could not be decoded.
+};
+
+/**
+ * @brief decode one pattern, the virtual memory array channels are PackBits compressed per row.
+ *
+ * @param bytes pattern data without length field.
+ * @return PSDPattern decoded pattern.
+ */
+PSDPattern decodePSDPattern(const QByteArray &bytes)
+{
+    PSDTraceScope trace("decodePSDPattern", bytes.size());
+    PSDPattern pattern { QString(), QString(), 0, QPoint(), QImage() };
+    QDataStream ds(bytes);
+    ds.setByteOrder(QDataStream::BigEndian);
+    quint32 version;
+    qint16 vertical, horizontal;
+    quint8 idLength;
+    ds >> version >> pattern.imageMode >> vertical >> horizontal;
+    pattern.point = QPoint(horizontal, vertical);
+    if (!readPSDUnicodeString(ds, &pattern.name))
+        return pattern;
+    ds >> idLength;
+    QByteArray id(idLength, Qt::Uninitialized);
+    ds.readRawData(id.data(), id.size());
+    pattern.id = QString::fromLatin1(id);
+    QList<QRgb> colorTable;
+    if (pattern.imageMode == 2)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            quint8 r, g, b;
+            ds >> r >> g >> b;
+            colorTable.append(qRgb(r, g, b));
+        }
+        // 仕様書には無いが、色テーブルの後に 4 byte あってから virtual memory array list が始まる。
+        ds.skipRawData(4);
+    }
+
+    // virtual memory array list.
+    quint32 vmaVersion, vmaLength, top, left, bottom, right, channels;
+    ds >> vmaVersion >> vmaLength >> top >> left >> bottom >> right >> channels;
+    const int width = static_cast<int>(right - left);
+    const int height = static_cast<int>(bottom - top);
+    if (ds.status() != QDataStream::Ok || width <= 0 || height <= 0 || width > 30000 || height > 30000)
+    {
+        qDebug() << QString("invalid pattern \"%1\" header.").arg(pattern.name);
+        return pattern;
+    }
+    QList<QByteArray> planes;
+    // 色チャンネルに続いて user mask と sheet mask があり、書かれたものだけ並べる。
+    for (quint32 c = 0; c < channels + 2 && ds.status() == QDataStream::Ok; c++)
+    {
+        quint32 written, length;
+        ds >> written;
+        if (!written)
+            continue;
+        ds >> length;
+        if (length == 0)
+            continue;
+        quint32 depth, channelTop, channelLeft, channelBottom, channelRight;
+        quint16 pixelDepth;
+        quint8 compression;
+        ds >> depth >> channelTop >> channelLeft >> channelBottom >> channelRight >> pixelDepth >> compression;
+        const qsizetype dataLength = static_cast<qsizetype>(length) - 23;
+        if (dataLength < 0 || dataLength > bytes.size() - ds.device()->pos())
+            break;
+        QByteArray data = bytes.mid(ds.device()->pos(), dataLength);
+        ds.skipRawData(static_cast<int>(dataLength));
+        if (pixelDepth != 8)
+        {
+            qDebug() << QString("unsupported pattern depth %1").arg(pixelDepth);
+            return pattern;
+        }
+        QByteArray plane = compression == 1 ? uncompressRLE(width, height, data) : data.left(qsizetype(width) * height);
+        if (plane.size() != qsizetype(width) * height)
+        {
+            qDebug() << QString("can't decode pattern \"%1\" channel %2, compression %3").arg(pattern.name).arg(c).arg(compression);
+            return pattern;
+        }
+        planes.append(plane);
+    }
+
+    const int colors = pattern.imageMode == 3 ? 3 : 1;
+    if ((pattern.imageMode != 1 && pattern.imageMode != 2 && pattern.imageMode != 3) || planes.size() < colors)
+    {
+        qDebug() << QString("unsupported pattern \"%1\" image mode %2 with %3 channels").arg(pattern.name).arg(pattern.imageMode).arg(planes.size());
+        return pattern;
+    }
+    const bool hasAlpha = planes.size() > colors;
+    QImage image(width, height, QImage::Format_ARGB32);
+    for (int y = 0; y < height; y++)
+    {
+        const qsizetype row = qsizetype(y) * width;
+        QRgb *dst = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < width; x++)
+        {
+            const int alpha = hasAlpha ? static_cast<uchar>(planes.at(colors).at(row + x)) : 255;
+            const uchar v = static_cast<uchar>(planes.at(0).at(row + x));
+            QRgb color;
+            if (pattern.imageMode == 3)
+                color = qRgb(v, static_cast<uchar>(planes.at(1).at(row + x)), static_cast<uchar>(planes.at(2).at(row + x)));
+            else if (pattern.imageMode == 2)
+                color = colorTable.at(v);
+            else
+                color = qRgb(v, v, v);
+            dst[x] = (color & 0x00FFFFFFU) | (QRgb(alpha) << 24);
+        }
+    }
+    pattern.image = image;
+    return pattern;
+}
+
+/**
+ * @brief read layers of 16 and 32 bit document from 'Lr16' or 'Lr32' of global additional layer info.
+ *
+ * Photoshop leaves layer info empty for such documents, the block holds layer count, layer records
+ * and channel image data in the same format as layer info. Channel offsets point into the block.
+ *
+ * @param file PSD file.
+ * @param ds binary data stream.
+ * @param layout section offsets, layer records and channel image data offsets are moved into the block.
+ * @param records receives layer records, left as is if there is no such block.
+ * @param tree receives layer tree.
+ * @return int 0 if successfully or no such block, -1 failed.
+ */
+int readPSDLayerInfoBlock(QFile &file, QDataStream &ds, PSDFileLayout &layout, QList<PSDLayerRecord> *records, QList<PSDLayerNode> *tree)
+{
+    PSDTraceScope trace("readPSDLayerInfoBlock");
+    if (!file.seek(layout.globalLayerMaskInfoOffset))
+    {
+        qDebug() << "can't seek to global layer mask info.";
+        return -1;
+    }
+    PSDGlobalLayerMaskInfo globalLayerMaskInfo;
+    ds >> globalLayerMaskInfo;
+    QList<PSDAdditionalLayerInfoBlock> blocks;
+    const QList<quint32> keys = { PSDKeyLayerInfo16, PSDKeyLayerInfo32 };
+    if (ds.status() != QDataStream::Ok || scanAdditionalLayerInfo(file, ds, layout.imageDataOffset - file.pos(), keys, &blocks, false) != 0)
+        return -1;
+    if (blocks.isEmpty())
+        return 0;
+
+    const auto &block = blocks.first();
+    qint16 layerCount = 0;
+    if (block.length < static_cast<qint64>(sizeof(layerCount)) || !file.seek(block.offset))
+        return -1;
+    ds >> layerCount;
+    QList<PSDLayerRecord> blockRecords;
+    quint32 layerRecordsSize = 0;
+    if (readPSDLayerRecords(ds, std::abs(layerCount), block.length - sizeof(layerCount), blockRecords, &layerRecordsSize) != 0)
+        return -1;
+    const qint64 channelImageDataOffset = file.pos();
+    QList<PSDLayerNode> blockTree = buildPSDLayerTree(blockRecords, channelImageDataOffset);
+    const qint64 channelImageDataEnd = blockTree.isEmpty() ? channelImageDataOffset
+        : blockTree.last().channelDataOffset + blockTree.last().channelDataLength;
+    if (channelImageDataEnd > block.offset + block.length)
+    {
+        qDebug() << QString("channel image data exceeds layer info block by %1 bytes.").arg(channelImageDataEnd - block.offset - block.length);
+        return -1;
+    }
+    layout.layerRecordsOffset = block.offset + sizeof(layerCount);
+    layout.channelImageDataOffset = channelImageDataOffset;
+    layout.layerInfoKey = block.key;
+    qDebug() << QString("%1 layers read from %2 of global additional layer info.").arg(blockRecords.size())
+        .arg(block.key == PSDKeyLayerInfo16 ? "Lr16" : "Lr32");
+    for (int layer = 0; layer < blockRecords.size(); layer++)
+    {
+        qDebug() << QString("### Layer %1").arg(layer);
+        dumpPSDLayerRecord(blockRecords.at(layer));
+    }
+    *records = blockRecords;
+    *tree = blockTree;
+    return 0;
+}
+
+/**
+ * @brief read patterns of global additional layer info, patterns are decoded in parallel.
+ *
+ * @param file PSD file.
+ * @param ds binary data stream.
+ * @param layout section offsets.
+ * @param patterns receives patterns in file order.
+ * @return int 0 if successfully, -1 failed.
+ */
+int readPSDPatterns(QFile &file, QDataStream &ds, const PSDFileLayout &layout, QList<PSDPattern> *patterns)
+{
+    PSDTraceScope trace("readPSDPatterns");
+    if (!file.seek(layout.globalLayerMaskInfoOffset))
+    {
+        qDebug() << "can't seek to global layer mask info.";
+        return -1;
+    }
+    PSDGlobalLayerMaskInfo globalLayerMaskInfo;
+    ds >> globalLayerMaskInfo;
+    QList<PSDAdditionalLayerInfoBlock> blocks;
+    const QList<quint32> keys = { PSDKeyPatterns, PSDKeyPatterns2, PSDKeyPatterns3 };
+    if (ds.status() != QDataStream::Ok || scanAdditionalLayerInfo(file, ds, layout.imageDataOffset - file.pos(), keys, &blocks) != 0)
+        return -1;
+
+    // 長さだけ辿って切り出し、展開は並列に行う。
+    QList<QByteArray> items;
+    foreach(const PSDAdditionalLayerInfoBlock &block, blocks)
+    {
+        qsizetype pos = 0;
+        while (block.data.size() - pos >= 4)
+        {
+            const qsizetype length = qFromBigEndian<quint32>(block.data.constData() + pos);
+            if (length > block.data.size() - pos - 4)
+            {
+                qDebug() << QString("invalid pattern length %1").arg(length);
+                return -1;
+            }
+            items.append(block.data.mid(pos + 4, length));
+            pos += 4 + ((length + 3) & ~qsizetype(3));
+        }
+    }
+    *patterns = QtConcurrent::blockingMapped<QList<PSDPattern>>(psdThreadPool(), items, decodePSDPattern);
+    qDebug() << QString("%1 patterns read.").arg(patterns->size());
+    return 0;
+}
+
+/**
+ * @brief resolve bounds and patterns of fill layers, fill layer without rectangle fills whole document.
+ */
+void resolvePSDFillLayers(QList<PSDLayerNode> &tree, const QRect &document, const QList<PSDPattern> &patterns)
+{
+    for (auto &node : tree)
+    {
+        auto &fill = node.fill;
+        if (fill.type == PSDFillNone)
+            continue;
+        if (fill.bounds.isEmpty())
+            fill.bounds = document;
+        if (fill.type == PSDFillPattern)
+        {
+            for (const auto &pattern : patterns)
+            {
+                if (pattern.id == fill.patternId)
+                    fill.pattern = pattern.image;
+            }
+            if (fill.pattern.isNull())
+                qDebug() << QString("pattern %1 of layer %2 not found.").arg(fill.patternId).arg(node.index);
+        }
+    }
+}
+
+/**
+ * @brief export patterns as pattern<index>.png.
+ *
+ * @return int 0 if successfully, -1 failed.
+ */
+int exportPSDPatterns(QFile &file, QDataStream &ds, const PSDFileLayout &layout, const QString &outputPrefix)
+{
+    QList<PSDPattern> patterns;
+    if (readPSDPatterns(file, ds, layout, &patterns) != 0)
+        return -1;
+    QList<int> indices;
+    for (int i = 0; i < patterns.size(); i++)
+    {
+        qDebug() << QString("pattern %1 \"%2\" id %3 %4x%5 mode %6").arg(i).arg(patterns.at(i).name).arg(patterns.at(i).id)
+            .arg(patterns.at(i).image.width()).arg(patterns.at(i).image.height()).arg(patterns.at(i).imageMode);
+        if (!patterns.at(i).image.isNull())
+            indices.append(i);
+    }
+    const QList<bool> saved = QtConcurrent::blockingMapped<QList<bool>>(psdThreadPool(), indices, [&](int i) -> bool
+    {
+        const QString fileName = psdOutputPath(outputPrefix, QString("pattern%1.png").arg(i));
+        PSDTraceScope saveTrace("savePNG", i);
+        return patterns.at(i).image.save(fileName, "PNG");
+    });
+    return saved.contains(false) ? -1 : 0;
+}
+
+/**
+ * @brief tight alpha bounds of layer, only alpha channel is read and color channels are skipped.
+ *
+ * @param ds binary data stream.
+ * @param record layer record.
+ * @param node layer tree node of record.
+ * @param bounds receives bounds in document coordinates, null QRect if layer is empty.
+ * @return int 0 if successfully, -1 failed.
+ */
+int analyzePSDLayerAlpha(QDataStream &ds, const PSDLayerRecord &record, const PSDLayerNode &node, QRect *bounds)
+{
+    PSDTraceScope trace("analyzePSDLayerAlpha", node.index);
+    *bounds = QRect();
+    const int width = record.right - record.left;
+    const int height = record.bottom - record.top;
+    if (width <= 0 || height <= 0)
+        return 0;
+    const QPoint origin(static_cast<qint32>(record.left), static_cast<qint32>(record.top));
+    qint64 offset = node.channelDataOffset;
+    foreach(const PSDChannelInfo &info, record.channelInfos)
+    {
+        if (info.channelId != -1)
+        {
+            offset += info.correspondingChannelDataLength;
+            continue;
+        }
+        quint16 compressionMode;
+        if (!ds.device()->seek(offset))
+            return -1;
+        const auto currentEndian = ds.byteOrder();
+        ds.setByteOrder(QDataStream::BigEndian);
+        ds >> compressionMode;
+        ds.setByteOrder(currentEndian);
+        const qsizetype length = info.correspondingChannelDataLength - 2;
+        auto &pool = PSDBufferPool::local();
+        if (compressionMode == 1)
+        {
+            QByteArray compressed = pool.acquire(length);
+            const bool read = ds.readRawData(compressed.data(), length) == length;
+            const bool valid = read && scanPSDAlphaBounds(width, height, compressed, bounds);
+            pool.release(compressed);
+            if (!valid)
+                return -1;
+        }
+        else
+        {
+            // raw と ZIP は展開した面を走査する。
+            if (!ds.device()->seek(offset))
+                return -1;
+            QByteArray plane = loadPSDChannelPlane(ds, info.correspondingChannelDataLength, width, height, 8);
+            if (plane.isEmpty())
+                return -1;
+            const uchar *alpha = reinterpret_cast<const uchar *>(plane.constData());
+            int left = width, right = -1, top = -1, bottom = -1;
+            for (int y = 0; y < height; y++)
+            {
+                const uchar *row = alpha + qsizetype(y) * width;
+                int first = 0, last = width - 1;
+                while (first < width && !row[first])
+                    first++;
+                if (first == width)
+                    continue;
+                while (!row[last])
+                    last--;
+                left = qMin(left, first);
+                right = qMax(right, last);
+                if (top < 0)
+                    top = y;
+                bottom = y;
+            }
+            if (top >= 0)
+                *bounds = QRect(QPoint(left, top), QPoint(right, bottom));
+        }
+        if (!bounds->isNull())
+            bounds->translate(origin);
+        return 0;
+    }
+    // alpha のないレイヤーは矩形全体が不透明。
+    *bounds = QRect(origin, QSize(width, height));
+    return 0;
+}
+
+/**
+ * @brief report emptiness and tight alpha bounds of selected pixel layers.
+ *
+ * @return int 0 if successfully, -1 failed.
+ */
+int reportPSDLayerAlphaBounds(QDataStream &ds, const PSDFileHeaderSection &header, const QList<PSDLayerRecord> &records,
+    const QList<PSDLayerNode> &tree, const QList<bool> &selected)
+{
+    PSDTraceScope trace("reportPSDLayerAlphaBounds");
+    if (header.depth != 8)
+    {
+        qDebug() << QString("alpha bounds supports 8 bit document only, depth %1").arg(header.depth);
+        return -1;
+    }
+    int layers = 0, empty = 0;
+    for (int i = 0; i < records.size(); i++)
+    {
+        if (!selected.at(i) || tree.at(i).sectionType != PSDSectionDividerAnyOther)
+            continue;
+        QRect bounds;
+        if (analyzePSDLayerAlpha(ds, records.at(i), tree.at(i), &bounds) != 0)
+        {
+            qDebug() << QString("can't analyze alpha of layer record=%1").arg(i);
+            return -1;
+        }
+        layers++;
+        if (bounds.isNull())
+        {
+            empty++;
+            qInfo() << QString("layer %1 \"%2\" empty").arg(i).arg(tree.at(i).path);
+            continue;
+        }
+        qInfo() << QString("layer %1 \"%2\" bounds %3,%4 %5x%6").arg(i).arg(tree.at(i).path)
+            .arg(bounds.left()).arg(bounds.top()).arg(bounds.width()).arg(bounds.height());
+    }
+    qInfo() << QString("%1 layers, %2 empty").arg(layers).arg(empty);
+    return 0;
+}
+
+/**
+ * @brief accumulated difference between two images.
+ */
+struct PSDImageDiff
+{
+    quint64 squaredError = 0;
+    quint64 samples = 0;
+    int     maxError = 0;
+    QRect   bounds; // differing pixels in document coordinates.
+};
+
+/**
+ * @brief compare two scanlines of 8 bit samples.
+ *
+ * @param first receives index of first differing sample, -1 if identical.
+ * @param last receives index of last differing sample.
+ */
+static void diffPSDRow(const uchar *a, const uchar *b, int length, PSDImageDiff &diff, int &first, int &last)
+{
+    first = -1;
+    last = -1;
+    int x = 0;
+    quint64 squaredError = 0;
+    int maxError = diff.maxError;
+#ifdef PSD_USE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    __m128i maximum = zero;
+    int blocks = 0;
+    const auto flush = [&]()
+    {
+        alignas(16) quint32 lanes[4];
+        _mm_store_si128(reinterpret_cast<__m128i *>(lanes), sum);
+        squaredError += quint64(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+        sum = zero;
+        blocks = 0;
+    };
+    for (; x + 16 <= length; x += 16)
+    {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + x));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + x));
+        const __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        maximum = _mm_max_epu8(maximum, d);
+        const __m128i lo = _mm_unpacklo_epi8(d, zero);
+        const __m128i hi = _mm_unpackhi_epi8(d, zero);
+        sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+        const quint32 differs = ~static_cast<quint32>(_mm_movemask_epi8(_mm_cmpeq_epi8(d, zero))) & 0xFFFFu;
+        if (differs)
+        {
+            if (first < 0)
+                first = x + static_cast<int>(qCountTrailingZeroBits(differs));
+            last = x + 31 - static_cast<int>(qCountLeadingZeroBits(differs));
+        }
+        // 32bit レーンが溢れる前に 64bit へ移す、1 ブロックで最大 4 * 255^2 加算される。
+        if (++blocks == 4096)
+            flush();
+    }
+    flush();
+    alignas(16) uchar lanes[16];
+    _mm_store_si128(reinterpret_cast<__m128i *>(lanes), maximum);
+    for (int i = 0; i < 16; i++)
+        maxError = qMax<int>(maxError, lanes[i]);
+#endif
+    for (; x < length; x++)
+    {
+        const int d = std::abs(int(a[x]) - int(b[x]));
+        if (d)
+        {
+            if (first < 0)
+                first = x;
+            last = x;
+        }
+        squaredError += quint64(d) * d;
+        maxError = qMax(maxError, d);
+    }
+    diff.squaredError += squaredError;
+    diff.samples += length;
+    diff.maxError = maxError;
+}
+
+/**
+ * @brief compare merged image data section with recomposited layers.
+ *
+ * Both images are processed in bands and only rows of visible layers inside a band are decoded,
+ * so that memory stays bounded by band rather than by layers. Coverage of fill layers is decoded whole
+ * once, as the fill is rendered from its own bounds.
+ * Merged color of transparent document is matted with white, so recomposited color is flattened
+ * over white before comparison, alpha is compared when merged image has it.
+ *
+ * @param ds binary data stream.
+ * @param layout section offsets.
+ * @param header file header.
+ * @param records layer records.
+ * @param tree layer tree.
+ * @param blendSpace color space in which layers are blended.
+ * @param minimumPSNR PSNR in dB below which document is reported as divergent.
+ * @return int 0 if matched, 1 diverged, -1 failed.
+ */
+int verifyPSDMergedImage(QDataStream &ds, const PSDFileLayout &layout, const PSDFileHeaderSection &header,
+    const QList<PSDLayerRecord> &records, const QList<PSDLayerNode> &tree, PSDBlendSpace blendSpace, double minimumPSNR)
+{
+    PSDTraceScope trace("verifyPSDMergedImage");
+    if (header.colorMode != 3 || header.depth != 8 || header.channels < 3)
+    {
+        qDebug() << QString("verify supports 8 bit RGB document only, depth %1 color mode %2").arg(header.depth).arg(header.colorMode);
+        return -1;
+    }
+    PSDImageDataLayout imageData;
+    if (readPSDImageDataLayout(ds, layout.imageDataOffset, header, imageData) != 0)
+        return -1;
+
+    const QList<PSDLayerState> baseStates = defaultPSDLayerStates(records);
+    QList<int> layers;
+    QList<int> fills;
+    for (int i = 0; i < records.size(); i++)
+    {
+        if (tree.at(i).sectionType != PSDSectionDividerAnyOther || !isPSDLayerVisible(tree, baseStates, i))
+            continue;
+        if (tree.at(i).fill.type != PSDFillNone)
+            fills.append(i);
+        else
+            layers.append(i);
+    }
+    QHash<int, QImage> fillCoverages;
+    if (decodePSDLayers(ds, records, tree, fills, fillCoverages) != 0)
+        return -1;
+
+    const int width = header.width;
+    const int channels = qMin<int>(header.channels, 4);
+    const int bandHeight = 256;
+    PSDImageDiff diff;
+    QByteArray ours(width, Qt::Uninitialized);
+    for (int top = 0; top < static_cast<int>(header.height); top += bandHeight)
+    {
+        const int height = qMin<int>(bandHeight, header.height - top);
+        PSDTraceScope bandTrace("verifyBand", top);
+        // 帯に掛かる行だけ読み、読んだ行の位置は状態の offset で補正する。
+        QList<PSDLayerState> states = baseStates;
+        QHash<int, QImage> decoded = fillCoverages;
+        foreach(int i, layers)
+        {
+            const auto &record = records.at(i);
+            const QRect rows = QRect(QPoint(record.left, record.top), QPoint(record.right - 1, record.bottom - 1))
+                .intersected(QRect(0, top, width, height));
+            if (rows.isEmpty())
+                continue;
+            bool ok = ds.device()->seek(tree.at(i).channelDataOffset);
+            const QImage image = ok ? loadPSDLayerRows(ds, record, rows.top() - record.top, rows.height(), &ok) : QImage();
+            if (!ok)
+            {
+                qDebug() << QString("can't load layer record=%1 rows %2-%3").arg(i).arg(top).arg(top + height);
+                return -1;
+            }
+            decoded.insert(i, image);
+            states[i].offset = QPoint(0, rows.top() - record.top);
+        }
+        const QImage band = compositePSDLayers(records, tree, decoded, states, QRect(0, top, width, height), blendSpace);
+        for (int c = 0; c < channels; c++)
+        {
+            QByteArray merged = readPSDImageDataBand(ds, imageData, c, top, height);
+            if (merged.isEmpty())
+            {
+                qDebug() << QString("can't read merged image channel %1 rows %2-%3").arg(c).arg(top).arg(top + height);
+                return -1;
+            }
+            for (int y = 0; y < height; y++)
+            {
+                const QRgb *src = reinterpret_cast<const QRgb *>(band.constScanLine(y));
+                uchar *dst = reinterpret_cast<uchar *>(ours.data());
+                for (int x = 0; x < width; x++)
+                {
+                    const int alpha = qAlpha(src[x]);
+                    const auto flatten = [&](int v) { return (v * alpha + 255 * (255 - alpha) + 127) / 255; };
+                    switch (c)
+                    {
+                    case 0: dst[x] = flatten(qRed(src[x])); break;
+                    case 1: dst[x] = flatten(qGreen(src[x])); break;
+                    case 2: dst[x] = flatten(qBlue(src[x])); break;
+                    default: dst[x] = alpha; break;
+                    }
+                }
+                int first;
+                int last;
+                diffPSDRow(dst, reinterpret_cast<const uchar *>(merged.constData()) + qsizetype(y) * width, width, diff, first, last);
+                if (first >= 0)
+                    diff.bounds |= QRect(first, top + y, last - first + 1, 1);
+            }
+            PSDBufferPool::local().release(merged);
+        }
+    }
+
+    const double mse = diff.samples ? static_cast<double>(diff.squaredError) / diff.samples : 0;
+    const double psnr = mse > 0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : std::numeric_limits<double>::infinity();
+    const bool diverged = psnr < minimumPSNR;
+    qInfo() << QString("verify: PSNR %1 dB, max error %2, differing bounds %3,%4 %5x%6%7")
+        .arg(psnr, 0, 'f', 2)
+        .arg(diff.maxError)
+        .arg(diff.bounds.left()).arg(diff.bounds.top()).arg(diff.bounds.width()).arg(diff.bounds.height())
+        .arg(diverged ? QString(" DIVERGED") : QString());
+    return diverged ? 1 : 0;
+}
+
+/**
+ * @brief true if merged image data section is missing or uniformly white or black.
+ *
+ * Files saved without Maximize Compatibility have such merged image.
+ *
+ * @return int 0 if successfully, -1 failed.
+ */
+int isPSDMergedImageBlank(QDataStream &ds, const PSDFileLayout &layout, const PSDFileHeaderSection &header, bool *blank)
+{
+    *blank = true;
+    if (layout.imageDataOffset + 2 > ds.device()->size())
+        return 0;
+    PSDImageDataLayout imageData;
+    if (readPSDImageDataLayout(ds, layout.imageDataOffset, header, imageData) != 0)
+        return -1;
+    const int colors = qMin<int>(header.channels, 3);
+    const int bandHeight = 256;
+    int uniform = -1;
+    for (int top = 0; top < imageData.height; top += bandHeight)
+    {
+        const int height = qMin(bandHeight, imageData.height - top);
+        for (int c = 0; c < colors; c++)
+        {
+            QByteArray band = readPSDImageDataBand(ds, imageData, c, top, height);
+            if (band.isEmpty())
+                return -1;
+            const uchar *p = reinterpret_cast<const uchar *>(band.constData());
+            if (uniform < 0)
+                uniform = p[0];
+            const bool same = std::all_of(p, p + band.size(), [uniform](uchar v) { return v == uniform; });
+            PSDBufferPool::local().release(band);
+            if (!same || (uniform != 0 && uniform != 255))
+            {
+                *blank = false;
+                return 0;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief find visible layer using what compositePSDLayers can't render.
+ *
+ * Blend modes other than normal, clipping, layer and vector masks, layer effects and adjustment layers
+ * are not rendered, groups must be pass through or normal at full opacity.
+ *
+ * @return QString description of first such layer, empty if every visible layer is rendered exactly.
+ */
+QString findPSDUncompositableLayer(const QList<PSDLayerRecord> &records, const QList<PSDLayerNode> &tree)
+{
+    const QList<PSDLayerState> states = defaultPSDLayerStates(records);
+    for (int i = 0; i < records.size(); i++)
+    {
+        const auto &record = records.at(i);
+        const auto &node = tree.at(i);
+        if (node.sectionType == PSDSectionDividerBoundingSection || !isPSDLayerVisible(tree, states, i))
+            continue;
+        const auto where = [&](const QString &feature) { return QString("layer %1 \"%2\" uses %3").arg(i).arg(node.path).arg(feature); };
+        if (node.sectionType != PSDSectionDividerAnyOther)
+        {
+            if (record.blendModeKey != PSDBlendModePassThrough && record.blendModeKey != PSDBlendModeNormal)
+                return where("group blend mode");
+            if (record.opacity != 255)
+                return where("group opacity");
+            continue;
+        }
+        if (record.blendModeKey != PSDBlendModeNormal)
+            return where("blend mode");
+        if (record.clipping != 0)
+            return where("clipping");
+        foreach(const PSDChannelInfo &info, record.channelInfos)
+        {
+            if (info.channelId == -2 || info.channelId == -3)
+                return where("layer mask");
+        }
+        foreach(const PSDAdditionalLayerInfoBlock &block, record.extraData.additionalLayerInfos)
+        {
+            if (block.key == PSDKeyVectorMask || block.key == PSDKeyVectorMask2)
+                return where("vector mask");
+            if (block.key == PSDKeyEffects || block.key == PSDKeyEffectsOld || block.key == PSDKeyMultipleEffects)
+                return where("layer effects");
+            if (std::find(std::begin(PSDAdjustmentLayerKeys), std::end(PSDAdjustmentLayerKeys), block.key) != std::end(PSDAdjustmentLayerKeys))
+                return where("adjustment layer");
+        }
+    }
+    return QString();
+}
+
+/**
+ * @brief write composited merged image into file whose merged image is blank.
+ *
+ * Everything except merged image data is copied as it is, hasRealMergedData of version info resource
+ * is set so that readers use merged image. Files with layers that can't be composited exactly
+ * are skipped, so that wrong merged image is never marked as real.
+ *
+ * @param file source file.
+ * @param ds binary data stream of source file.
+ * @param layout section offsets of source file.
+ * @param header file header.
+ * @param imageResouceSection image resources.
+ * @param records layer records.
+ * @param tree layer tree.
+ * @param blendSpace color space in which layers are blended.
+ * @param transparency true if document has transparency(negative layer count), it is written to channel 3.
+ * @param force write even if merged image is not blank.
+ * @param outputPath destination path, may be same as source.
+ * @return int 0 if successfully, -1 failed.
+ */
+int writePSDCompositeImage(QFile &file, QDataStream &ds, const PSDFileLayout &layout, const PSDFileHeaderSection &header,
+    const PSDImageResouceSection &imageResouceSection, const QList<PSDLayerRecord> &records, const QList<PSDLayerNode> &tree,
+    PSDBlendSpace blendSpace, bool transparency, bool force, const QString &outputPath)
+{
+    PSDTraceScope trace("writePSDCompositeImage");
+    if (header.colorMode != 3 || header.depth != 8)
+    {
+        qDebug() << QString("composite supports 8 bit RGB document only, depth %1 color mode %2").arg(header.depth).arg(header.colorMode);
+        return -1;
+    }
+    bool blank;
+    if (isPSDMergedImageBlank(ds, layout, header, &blank) != 0)
+        return -1;
+    if (!blank && !force)
+    {
+        qDebug() << QString("merged image already exists, not written: %1").arg(outputPath);
+        return 0;
+    }
+    const QString uncompositable = findPSDUncompositableLayer(records, tree);
+    if (!uncompositable.isEmpty())
+    {
+        qInfo() << QString("composite skipped, %1: %2").arg(uncompositable).arg(file.fileName());
+        return -1;
+    }
+
+    QList<int> layers;
+    for (int i = 0; i < records.size(); i++)
+    {
+        if (tree.at(i).sectionType == PSDSectionDividerAnyOther)
+            layers.append(i);
+    }
+    QImage merged;
+    {
+        QHash<int, QImage> decoded;
+        QHash<int, PSDLayerSpans> spans;
+        if (decodePSDLayers(ds, records, tree, layers, decoded, &spans) != 0)
+            return -1;
+        merged = compositePSDLayers(records, tree, decoded, defaultPSDLayerStates(records),
+            QRect(0, 0, header.width, header.height), blendSpace, &spans);
+    }
+
+    // 保存されたアルファやスポットチャンネルは元の合成画像から引き継ぐ。
+    QList<QByteArray> extraChannels;
+    if (readPSDExtraChannels(ds, layout.imageDataOffset, header, transparency ? 4 : 3, &extraChannels) != 0)
+        return -1;
+
+    PSDImageResouceSection resources = imageResouceSection;
+    for (auto &block : resources.imageResouces)
+    {
+        // version(4) の次の 1 byte が hasRealMergedData.
+        if (block.id == PSDImageResourceVersionInfo && block.data.size() > 4)
+            block.data[4] = 1;
+    }
+
+    QSaveFile output(outputPath);
+    if (!output.open(QIODevice::WriteOnly))
+    {
+        qDebug() << QString("can't open output file: %1").arg(output.errorString());
+        return -1;
+    }
+    QDataStream out(&output);
+    out.setByteOrder(QDataStream::BigEndian);
+    // file header and color mode data.
+    if (copyPSDFileRange(file, 0, layout.imageResouceOffset, output) != 0)
+        goto io_error;
+    out << resources;
+    if (copyPSDFileRange(file, layout.layerAndMaskInfoOffset, layout.imageDataOffset - layout.layerAndMaskInfoOffset, output) != 0)
+        goto io_error;
+    writePSDImageData(out, merged, header.channels, transparency, extraChannels);
+    if (out.status() != QDataStream::Ok || !output.commit())
+        goto io_error;
+    qDebug() << QString("composite image written to %1").arg(outputPath);
+    return 0;
+io_error:
+    qDebug() << QString("failed to write composite image: %1").arg(output.errorString());
+    output.cancelWriting();
+    return -1;
+}
+
+/**
+ * @brief one iteration of benchmark case.
+ */
+struct PSDPerfSample
+{
+    qint64  nsec = 0;
+    bool    hasCounters = false;
+    quint64 cycles = 0;
+    quint64 instructions = 0;
+    quint64 branchMisses = 0;
+    quint64 cacheMisses = 0; // last level cache.
+};
+
+/**
+ * @brief hardware performance counters of calling thread, read by perf_event_open on Linux.
+ *
+ * Counters are opened as one group so that all of them cover the same interval.
+ * If perf events are not permitted(perf_event_paranoid, container, VM) isAvailable() returns false
+ * and only wall clock time is measured.
+ */
+class PSDPerfCounters
+{
+public:
+    enum Counter { Cycles, Instructions, BranchMisses, CacheMisses, CounterCount };
+
+    PSDPerfCounters()
+    {
+        for (int c = 0; c < CounterCount; c++)
+        {
+            fds[c] = -1;
+            slots[c] = -1;
+        }
+#ifdef Q_OS_LINUX
+        const quint64 configs[CounterCount] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_BRANCH_MISSES,
+            PERF_COUNT_HW_CACHE_MISSES,
+        };
+        int slot = 0;
+        for (int c = 0; c < CounterCount; c++)
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[c];
+            attr.disabled = (c == Cycles) ? 1 : 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            const int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, fds[Cycles], 0));
+            if (fd < 0)
+            {
+                // cycles が無ければグループ自体作れないので諦める。他は欠けても続行。
+                qInfo() << QString("perf counter %1 unavailable: %2").arg(c).arg(QString::fromLocal8Bit(std::strerror(errno)));
+                if (c == Cycles)
+                    return;
+                continue;
+            }
+            fds[c] = fd;
+            slots[c] = slot++;
+        }
+#endif
+    }
+
+    ~PSDPerfCounters()
+    {
+#ifdef Q_OS_LINUX
+        for (int c = CounterCount - 1; c >= 0; c--)
+        {
+            if (fds[c] >= 0)
+                close(fds[c]);
+        }
+#endif
+    }
+
+    bool isAvailable() const
+    {
+        return fds[Cycles] >= 0;
+    }
+
+    void start()
+    {
+#ifdef Q_OS_LINUX
+        if (isAvailable())
+        {
+            ioctl(fds[Cycles], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(fds[Cycles], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#endif
+        timer.start();
+    }
+
+    void stop(PSDPerfSample &sample)
+    {
+        sample.nsec = timer.nsecsElapsed();
+        sample.hasCounters = false;
+#ifdef Q_OS_LINUX
+        if (!isAvailable())
+            return;
+        ioctl(fds[Cycles], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        // nr, time_enabled, time_running, value[nr]
+        quint64 values[3 + CounterCount] = {};
+        if (read(fds[Cycles], values, sizeof(values)) < static_cast<ssize_t>(3 * sizeof(quint64)) || values[2] == 0)
+            return;
+        // 多重化されていた場合は有効時間で補正する。
+        const double scale = static_cast<double>(values[1]) / static_cast<double>(values[2]);
+        const auto value = [&](Counter c) -> quint64
+        {
+            return slots[c] < 0 ? 0 : static_cast<quint64>(values[3 + slots[c]] * scale);
+        };
+        sample.cycles = value(Cycles);
+        sample.instructions = value(Instructions);
+        sample.branchMisses = value(BranchMisses);
+        sample.cacheMisses = value(CacheMisses);
+        sample.hasCounters = true;
+#endif
+    }
+
+private:
+    int             fds[CounterCount];
+    int             slots[CounterCount]; // position in group read, -1 if not opened.
+    QElapsedTimer   timer;
+};
+
+/**
+ * @brief samples of one benchmark case.
+ */
+struct PSDBenchmarkResult
+{
+    QString                 name;
+    qint64                  bytes = 0; // bytes processed by one iteration.
+    QList<PSDPerfSample>    samples;
+    qint64                  peakRss = 0; // KiB, peak resident set size of process after the case.
+    QString                 file; // file name, set by analyzePSDFile.
+};
+
+/**
+ * @brief peak resident set size of process in KiB, 0 if unknown.
+ */
+qint64 psdPeakRss()
+{
+#ifdef Q_OS_LINUX
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss;
+#endif
+    return 0;
+}
+
+/**
+ * @brief compressed channel loaded into memory for benchmark.
+ */
+struct PSDBenchmarkChannel
+{
+    int         layer;
+    int         width;
+    int         height;
+    qint16      channelId;
+    quint16     compression;
+    QByteArray  data; // without compression mode.
+    QByteArray  raw; // uncompressed.
+};
+
+/**
+ * @brief median of values, values are sorted.
+ */
+double psdMedian(QList<double> &values)
+{
+    if (values.isEmpty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    const auto half = values.size() / 2;
+    return (values.size() % 2) ? values.at(half) : (values.at(half - 1) + values.at(half)) / 2;
+}
+
+/**
+ * @brief run benchmark case once for warm up and then iterations times under counters.
+ *
+ * @return bool false if body failed.
+ */
+template<typename Body>
+bool runPSDBenchmarkCase(PSDPerfCounters &counters, int iterations, Body body, PSDBenchmarkResult &result)
+{
+    PSDTraceScope trace("benchmarkCase");
+    if (!body())
+        return false;
+    for (int i = 0; i < iterations; i++)
+    {
+        PSDPerfSample sample;
+        counters.start();
+        const bool ok = body();
+        counters.stop(sample);
+        if (!ok)
+            return false;
+        result.samples.append(sample);
+    }
+    result.peakRss = psdPeakRss();
+    return true;
+}
+
+/**
+ * @brief print wall clock and counter derived metrics of benchmark case.
+ */
+void dumpPSDBenchmarkResult(const PSDBenchmarkResult &result)
+{
+    QList<double> times;
+    PSDPerfSample total;
+    total.hasCounters = !result.samples.isEmpty();
+    foreach(const PSDPerfSample &sample, result.samples)
+    {
+        times.append(sample.nsec);
+        total.hasCounters = total.hasCounters && sample.hasCounters;
+        total.cycles += sample.cycles;
+        total.instructions += sample.instructions;
+        total.branchMisses += sample.branchMisses;
+        total.cacheMisses += sample.cacheMisses;
+    }
+    const double median = psdMedian(times);
+    const double throughput = median > 0 ? (result.bytes / (1024.0 * 1024.0)) / (median / 1e9) : 0;
+    qInfo() << QString("%1: %2 iterations, median %3 ms, min %4 ms, %5 MiB/s")
+        .arg(result.name, -24)
+        .arg(result.samples.size())
+        .arg(median / 1e6, 0, 'f', 3)
+        .arg(times.isEmpty() ? 0 : times.first() / 1e6, 0, 'f', 3)
+        .arg(throughput, 0, 'f', 1);
+    if (!total.hasCounters)
+        return;
+    const double totalBytes = static_cast<double>(result.bytes) * result.samples.size();
+    qInfo() << QString("%1  IPC %2, cycles/byte %3, branch misses/KiB %4, LLC misses/KiB %5")
+        .arg(QString(), -24)
+        .arg(total.cycles ? static_cast<double>(total.instructions) / total.cycles : 0, 0, 'f', 2)
+        .arg(totalBytes > 0 ? total.cycles / totalBytes : 0, 0, 'f', 3)
+        .arg(totalBytes > 0 ? total.branchMisses * 1024.0 / totalBytes : 0, 0, 'f', 2)
+        .arg(totalBytes > 0 ? total.cacheMisses * 1024.0 / totalBytes : 0, 0, 'f', 2);
+}
+
+/**
+ * @brief benchmark decoder stages and compositing on selected layers.
+ *
+ * Cases run on the calling thread, counters are per thread.
+ * Compressed channels are read into memory first so that RLE decode and merge are measured without I/O.
+ *
+ * @param iterations measured iterations of each case.
+ * @param results receives samples of each case.
+ * @return int 0 if successfully, -1 failed.
+ */
+int benchmarkPSDLayers(QDataStream &ds, const PSDFileHeaderSection &header, const QList<PSDLayerRecord> &records,
+    const QList<PSDLayerNode> &tree, const QList<bool> &selected, int iterations, QList<PSDBenchmarkResult> *results)
+{
+    PSDTraceScope trace("benchmarkPSDLayers");
+    auto &pool = PSDBufferPool::local();
+    QList<int> layers;
+    QList<PSDBenchmarkChannel> channels;
+    QHash<int, QImage> images;
+    qint64 rleBytes = 0;
+    qint64 channelBytes = 0;
+    qint64 layerBytes = 0;
+    for (int i = 0; i < records.size(); i++)
+    {
+        const auto &record = records.at(i);
+        const int width = record.right - record.left;
+        const int height = record.bottom - record.top;
+        if (!selected.at(i) || width <= 0 || height <= 0)
+            continue;
+        layers.append(i);
+        images.insert(i, QImage(width, height, QImage::Format_ARGB32));
+        layerBytes += qint64(width) * height * 4;
+        if (!ds.device()->seek(tree.at(i).channelDataOffset))
+            return -1;
+        foreach(const PSDChannelInfo &info, record.channelInfos)
+        {
+            PSDBenchmarkChannel channel { i, width, height, info.channelId, 0, QByteArray(), QByteArray() };
+            ds >> channel.compression;
+            channel.data.resize(info.correspondingChannelDataLength - 2);
+            if (ds.readRawData(channel.data.data(), channel.data.size()) != channel.data.size())
+                return -1;
+            if (info.channelId < -1 || channel.compression > 1)
+                continue;
+            channel.raw = channel.compression == 1 ? uncompressRLE(width, height, channel.data) : channel.data;
+            if (channel.raw.size() != qsizetype(width) * height)
+            {
+                qDebug() << QString("benchmark: bad channel data, layer record=%1").arg(i);
+                return -1;
+            }
+            if (channel.compression == 1)
+                rleBytes += channel.raw.size();
+            channelBytes += channel.raw.size();
+            channels.append(channel);
+        }
+    }
+
+    PSDPerfCounters counters;
+    if (!counters.isAvailable())
+        qInfo() << "hardware performance counters unavailable, reporting wall clock only.";
+
+    PSDBenchmarkResult rle { "uncompressRLE", rleBytes, {} };
+    const bool rleOk = runPSDBenchmarkCase(counters, iterations, [&]()
+    {
+        foreach(const PSDBenchmarkChannel &channel, channels)
+        {
+            if (channel.compression != 1)
+                continue;
+            QByteArray raw = uncompressRLE(channel.width, channel.height, channel.data);
+            if (raw.size() != channel.raw.size())
+                return false;
+            pool.release(raw);
+        }
+        return true;
+    }, rle);
+
+    PSDBenchmarkResult merge { "compoundLayerChannel", channelBytes, {} };
+    const bool mergeOk = runPSDBenchmarkCase(counters, iterations, [&]()
+    {
+        foreach(const PSDBenchmarkChannel &channel, channels)
+        {
+            compoundLayerChannel(images[channel.layer], channel.raw, channel.channelId);
+        }
+        return true;
+    }, merge);
+
+    PSDBenchmarkResult load { "loadPSDLayer", layerBytes, {} };
+    QHash<int, QImage> decoded;
+    const bool loadOk = runPSDBenchmarkCase(counters, iterations, [&]()
+    {
+        decoded.clear();
+        return decodePSDLayers(ds, records, tree, layers, decoded) == 0;
+    }, load);
+
+    const QRect area(0, 0, header.width, header.height);
+    const QList<PSDLayerState> states = defaultPSDLayerStates(records);
+    PSDBenchmarkResult composite { "compositePSDLayers", qint64(area.width()) * area.height() * 4, {} };
+    const bool compositeOk = runPSDBenchmarkCase(counters, iterations, [&]()
+    {
+        return !compositePSDLayers(records, tree, decoded, states, area).isNull();
+    }, composite);
+
+    // linear light の常用可否を判断するため sRGB との差を見る。
+    PSDBenchmarkResult linearComposite { "compositePSDLayersLinear", composite.bytes, {} };
+    const bool linearOk = runPSDBenchmarkCase(counters, iterations, [&]()
+    {
+        return !compositePSDLayers(records, tree, decoded, states, area, PSDBlendSpaceLinear).isNull();
+    }, linearComposite);
+
+    // alpha の span で透明部分を飛ばし不透明部分を複写した場合と比べる。
+    QHash<int, QImage> spanDecoded;
+    QHash<int, PSDLayerSpans> spans;
+    PSDBenchmarkResult spanComposite { "compositePSDLayersSpans", composite.bytes, {} };
+    const bool spanOk = decodePSDLayers(ds, records, tree, layers, spanDecoded, &spans) == 0
+        && runPSDBenchmarkCase(counters, iterations, [&]()
+    {
+        return !compositePSDLayers(records, tree, spanDecoded, states, area, PSDBlendSpaceSRGB, &spans).isNull();
+    }, spanComposite);
+
+    if (!rleOk || !mergeOk || !loadOk || !compositeOk || !linearOk || !spanOk)
+    {
+        qDebug() << "benchmark case failed.";
+        return -1;
+    }
+    *results << rle << merge << load << composite << linearComposite << spanComposite;
+    foreach(const PSDBenchmarkResult &result, *results)
+    {
+        dumpPSDBenchmarkResult(result);
+    }
+    return 0;
+}
+
+static const int PSDBenchmarkBaselineVersion = 1;
+
+/**
+ * @brief median absolute deviation of values around median.
+ */
+double psdMedianAbsoluteDeviation(const QList<double> &values, double median)
+{
+    QList<double> deviations;
+    foreach(double value, values)
+    {
+        deviations.append(std::abs(value - median));
+    }
+    return psdMedian(deviations);
+}
+
+/**
+ * @brief one sided Mann-Whitney U test.
+ *
+ * Normal approximation with tie and continuity correction, enough for 5 or more samples each.
+ *
+ * @return double p-value of hypothesis that a tends to be greater than b.
+ */
+double psdMannWhitneyPValue(const QList<double> &a, const QList<double> &b)
+{
+    const qsizetype na = a.size();
+    const qsizetype nb = b.size();
+    const qsizetype n = na + nb;
+    if (na == 0 || nb == 0)
+        return 1;
+    QList<QPair<double, bool>> all; // value, belongs to a.
+    foreach(double value, a)
+    {
+        all.append(qMakePair(value, true));
+    }
+    foreach(double value, b)
+    {
+        all.append(qMakePair(value, false));
+    }
+    std::sort(all.begin(), all.end(), [](const QPair<double, bool> &x, const QPair<double, bool> &y) { return x.first < y.first; });
+
+    // 同値は平均順位を与える。
+    double rankSumA = 0;
+    double tieSum = 0;
+    for (qsizetype i = 0; i < n;)
+    {
+        qsizetype j = i;
+        while (j < n && all.at(j).first == all.at(i).first)
+            j++;
+        const double rank = (i + 1 + j) / 2.0;
+        for (qsizetype k = i; k < j; k++)
+        {
+            if (all.at(k).second)
+                rankSumA += rank;
+        }
+        const double t = static_cast<double>(j - i);
+        tieSum += t * t * t - t;
+        i = j;
+    }
+    const double u = rankSumA - na * (na + 1) / 2.0;
+    const double mean = na * nb / 2.0;
+    const double variance = na * nb / 12.0 * ((n + 1) - tieSum / (static_cast<double>(n) * (n - 1)));
+    if (variance <= 0)
+        return 1;
+    const double z = (u - mean - 0.5) / std::sqrt(variance);
+    return 0.5 * std::erfc(z / std::sqrt(2.0));
+}
+
+/**
+ * @brief key of benchmark case in baseline, "<file>/<case>".
+ */
+QString psdBenchmarkKey(const PSDBenchmarkResult &result)
+{
+    return result.file + QChar('/') + result.name;
+}
+
+/**
+ * @brief save benchmark results as versioned JSON baseline.
+ *
+ * Per case: median and MAD of wall clock time, throughput, peak RSS and all samples.
+ *
+ * @return int 0 if successfully, -1 failed.
+ */
+int savePSDBenchmarkBaseline(const QString &path, const QList<PSDBenchmarkResult> &results)
+{
+    QJsonArray cases;
+    foreach(const PSDBenchmarkResult &result, results)
+    {
+        QList<double> times;
+        QJsonArray samples;
+        foreach(const PSDPerfSample &sample, result.samples)
         {
-            channel[y * width + x] = scanLine[x];
+            times.append(sample.nsec);
+            samples.append(sample.nsec);
         }
+        const double median = psdMedian(times);
+        QJsonObject item;
+        item.insert("key", psdBenchmarkKey(result));
+        item.insert("bytes", result.bytes);
+        item.insert("medianNsec", median);
+        item.insert("madNsec", psdMedianAbsoluteDeviation(times, median));
+        item.insert("throughputMiBs", median > 0 ? (result.bytes / (1024.0 * 1024.0)) / (median / 1e9) : 0.0);
+        item.insert("peakRssKiB", result.peakRss);
+        item.insert("samplesNsec", samples);
+        cases.append(item);
     }
-    qDebug() << "uncompress RLE done.";
-    return channel;
+    QJsonObject root;
+    root.insert("version", PSDBenchmarkBaselineVersion);
+    root.insert("cases", cases);
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        qDebug() << QString("can't open baseline file %1").arg(path);
+        return -1;
+    }
+    file.write(QJsonDocument(root).toJson(QJsonDocument::Indented));
+    if (!file.commit())
+    {
+        qDebug() << QString("can't write baseline file %1: %2").arg(path).arg(file.errorString());
+        return -1;
+    }
+    qInfo() << QString("benchmark baseline saved to %1").arg(path);
+    return 0;
 }
 
 /**
- * @brief load PSD layer.
- * 
- * @param ds binary data stream.
- * @param record layer record.
- * @param ok set true if load successfully, false failed.
- * @return QImage loaded layer image(channels are compounded).
+ * @brief compare benchmark results with baseline.
+ *
+ * Case is a regression if its median is slower than baseline by more than threshold percent
+ * and Mann-Whitney U test says the slowdown is significant(p < 0.05).
+ *
+ * @param thresholds percent per case, key is "<file>/<case>" or "<case>", "" is default.
+ * @return int 0 if no regression, 1 regression found, -1 failed.
  */
-QImage loadPSDLayer(QDataStream &ds, const PSDLayerRecord &record, bool *ok)
+int comparePSDBenchmarkBaseline(const QString &path, const QList<PSDBenchmarkResult> &results, const QHash<QString, double> &thresholds)
 {
-    *ok = false;
-
-    const auto currentEndian = ds.byteOrder();
-    ds.setByteOrder(QDataStream::BigEndian);
-
-    qsizetype totalSize = 0;
-
-    const int width = record.right - record.left;
-    const int height = record.bottom - record.top;
-    QImage image(width, height, QImage::Format_ARGB32);
-    foreach(const PSDChannelInfo &info, record.channelInfos)
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
     {
-        const auto fileOffset = ds.device()->pos();
-        qDebug() << QString("loadPSDLayer file offset %1 length %2").arg(fileOffset, 8, 16, QChar('0')).arg(info.correspondingChannelDataLength);
+        qDebug() << QString("can't open baseline file %1").arg(path);
+        return -1;
+    }
+    QJsonParseError error;
+    const QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &error);
+    if (error.error != QJsonParseError::NoError || !document.isObject())
+    {
+        qDebug() << QString("invalid baseline file %1: %2").arg(path).arg(error.errorString());
+        return -1;
+    }
+    const QJsonObject root = document.object();
+    if (root.value("version").toInt() != PSDBenchmarkBaselineVersion)
+    {
+        qDebug() << QString("unsupported baseline version %1").arg(root.value("version").toInt());
+        return -1;
+    }
+    QHash<QString, QJsonObject> baseline;
+    const QJsonArray cases = root.value("cases").toArray();
+    for (const auto &value : cases)
+    {
+        const QJsonObject item = value.toObject();
+        baseline.insert(item.value("key").toString(), item);
+    }
 
-        quint16 compressionMode;
-        ds >> compressionMode;
-        if (ds.status() != QDataStream::Ok)
+    int regressions = 0;
+    foreach(const PSDBenchmarkResult &result, results)
+    {
+        const QString key = psdBenchmarkKey(result);
+        if (!baseline.contains(key))
         {
-            qDebug() << "loadPSDLayer: bad data stream status.";
-            goto compression_error;
+            qInfo() << QString("%1: not in baseline, skipped.").arg(key);
+            continue;
         }
-
-        const qsizetype length = info.correspondingChannelDataLength - 2;
-        totalSize += info.correspondingChannelDataLength;
-
-        switch(compressionMode)
+        QList<double> before;
+        const QJsonArray samples = baseline.value(key).value("samplesNsec").toArray();
+        for (const auto &sample : samples)
         {
-        case 0: // raw image.
-            {
-                QByteArray raw(length, '\0');
-                ds.readRawData(raw.data(), length);
-                compoundLayerChannel(image, raw, info.channelId);
-            }
-            break;
-        case 1: // RLE compressed image.
-            {
-                QByteArray compressed(length, '\0');
-                ds.readRawData(compressed.data(), length);
-                QByteArray raw = uncompressRLE(width, height, compressed);
-                if (raw.size() != (width * height))
-                {
-                    qDebug() << QString("uncompressRLE failed. compression length %1").arg(compressed.size());
-                    goto compression_error;
-                }
-                compoundLayerChannel(image, raw, info.channelId);
-                qDebug() << QString("RLE compression channel %1 loaded.").arg(info.channelId);
-            }
-            break;
-        case 2:
-            qDebug() << QString("ZIP without prediction not supported.");
-            goto compression_error;
-        case 3:
-            qDebug() << QString("ZIP with prediction not supported.");
-            goto compression_error;
-        default:
-            qDebug() << QString("unsupported compression mode %1").arg(compressionMode);
-            goto compression_error;
+            before.append(sample.toDouble());
+        }
+        QList<double> after;
+        foreach(const PSDPerfSample &sample, result.samples)
+        {
+            after.append(sample.nsec);
         }
+        const double threshold = thresholds.value(key, thresholds.value(result.name, thresholds.value(QString(), 5.0)));
+        const double p = psdMannWhitneyPValue(after, before);
+        const double beforeMedian = psdMedian(before);
+        const double afterMedian = psdMedian(after);
+        const double change = beforeMedian > 0 ? (afterMedian - beforeMedian) * 100.0 / beforeMedian : 0;
+        const bool regression = change > threshold && p < 0.05;
+        qInfo() << QString("%1: median %2 ms -> %3 ms (%4%), p=%5, threshold %6%%7")
+            .arg(key)
+            .arg(beforeMedian / 1e6, 0, 'f', 3)
+            .arg(afterMedian / 1e6, 0, 'f', 3)
+            .arg(change, 0, 'f', 1)
+            .arg(p, 0, 'g', 3)
+            .arg(threshold)
+            .arg(regression ? QString(" REGRESSION") : QString());
+        if (regression)
+            regressions++;
     }
-
-    ds.setByteOrder(currentEndian);
-    *ok = true;
-    return image;
-compression_error:
-    ds.setByteOrder(currentEndian);
-    *ok = false;
-    return QImage();
+    if (regressions)
+    {
+        qInfo() << QString("%1 benchmark regression(s) against %2").arg(regressions).arg(path);
+        return 1;
+    }
+    return 0;
 }
 
-int main(int argc, char *argv[])
+/**
+ * @brief parse threshold option, "[case=]percent".
+ *
+ * @return bool false if text is malformed.
+ */
+bool parsePSDBenchmarkThreshold(const QString &text, QHash<QString, double> &thresholds)
 {
-    QCoreApplication app(argc, argv);
-
-    qDebug() << "cwd: " << QDir::currentPath();
-    if (argc < 1)
+    const auto separator = text.lastIndexOf(QChar('='));
+    bool ok;
+    const double percent = text.mid(separator + 1).toDouble(&ok);
+    if (!ok || percent < 0)
     {
-        qDebug() << "argument missing, require path to PSD file.";
-        return -1;
+        qDebug() << QString("invalid threshold: %1").arg(text);
+        return false;
     }
+    thresholds.insert(separator < 0 ? QString() : text.left(separator), percent);
+    return true;
+}
+
+/**
+ * @brief command line options shared by all files.
+ */
+struct PSDAnalyzeOptions
+{
+    QList<PSDLayerSelector> selectors;
+    QList<PSDLayerEdit>     edits;
+    bool                    comps = false;
+    bool                    timeline = false;
+    bool                    spriteSheet = false;
+    QString                 outputPath;
+    QString                 extractPath;
+    QString                 outputPrefix; // "<base name>_" in batch mode.
+    int                     benchmarkIterations = 0; // 0 if benchmark is disabled.
+    PSDBlendSpace           blendSpace = PSDBlendSpaceSRGB;
+    PSDLayerFormat          layerFormat = PSDLayerFormatPNG;
+    PSDExrCompression       exrCompression = PSDExrCompressionZip;
+    QList<qint16>           exportChannels; // alpha or mask channels exported alone, empty if disabled.
+    PSDChannelFormat        channelFormat = PSDChannelFormatGray;
+    bool                    writeComposite = false;
+    bool                    forceComposite = false;
+    bool                    alphaBounds = false;
+    bool                    artboards = false;
+    bool                    patterns = false;
+    bool                    slices = false;
+    bool                    slicesFromComposite = false;
+    bool                    verify = false;
+    double                  verifyPSNR = 40.0; // dB
+};
 
-    QFile file(argv[1]);
+/**
+ * @brief scan PSD file and run the mode given by options.
+ *
+ * @param path path to PSD file.
+ * @param options parsed command line options.
+ * @param benchmarkResults receives benchmark results of this file if benchmark is enabled.
+ * @return int 0 if successfully, -1 failed, 1 if verify found merged image diverged.
+ */
+int analyzePSDFile(const QString &path, const PSDAnalyzeOptions &options, QList<PSDBenchmarkResult> *benchmarkResults)
+{
+    PSDTraceScope trace("analyzePSDFile");
+    QFile file(path);
     if (!file.open(QIODevice::ReadOnly))
     {
-        qDebug() << "failed to open file processed.psd";
+        qDebug() << QString("failed to open file %1").arg(path);
         return -1;
     }
     
     QDataStream in(&file);
     in.setByteOrder(QDataStream::BigEndian);
 
+    PSDTraceScope sectionTrace("readFileHeaderSection");
     PSDFileHeaderSection fileHeader;
     in >> fileHeader;
     if (file.error() != QFileDevice::NoError)
@@ -655,23 +7371,30 @@ int main(int argc, char *argv[])
     }
     dumpPSDFileHeaderSection(fileHeader);
 
+    sectionTrace.restart("readColorModeDataSection");
     PSDColorModeDataSection colorModeDataSection;
     in >> colorModeDataSection;
     if (file.error() != QFileDevice::NoError)
         qDebug() << "file i/o error occurred.";
     dumpPSDColorModeDataSection(colorModeDataSection);
 
+    PSDFileLayout layout;
+    layout.imageResouceOffset = file.pos();
+    sectionTrace.restart("readImageResouceSection");
     PSDImageResouceSection imageResouceSection;
     in >> imageResouceSection;
     if (file.error() != QFileDevice::NoError)
         qDebug() << "file i/o error occurred.";
     dumpPSDImageResouceSection(imageResouceSection);
 
+    sectionTrace.restart("readLayerRecords");
+    layout.layerAndMaskInfoOffset = file.pos();
     PSDLayerAndMaskInfoSection layerAndMaskInfoSection;
     in >> layerAndMaskInfoSection;
     if (file.error() != QFileDevice::NoError)
         qDebug() << "file i/o error occurred.";
     dumpPSDLayerAndMaskInfoSection(layerAndMaskInfoSection);
+    layout.imageDataOffset = layout.layerAndMaskInfoOffset + sizeof(layerAndMaskInfoSection.length) + layerAndMaskInfoSection.length;
 
     // layerAndMaskInfoSection.length の内読み込んだかスキップしたバイト数。
     quint32 consumedLayerInfoSize = 0;
@@ -681,44 +7404,186 @@ int main(int argc, char *argv[])
     if (file.error() != QFileDevice::NoError)
         qDebug() << "file i/o error occurred.";
     dumpPSDLayerInfo(layerInfo);
-    consumedLayerInfoSize += sizeof(layerInfo.layerCount);
+    // 空の layer info には layer count も無い。
+    if (layerInfo.length == 0)
+    {
+        layerInfo.layerCount = 0;
+        file.seek(file.pos() - sizeof(layerInfo.layerCount));
+    }
+    else
+        consumedLayerInfoSize += sizeof(layerInfo.layerCount);
+    layout.layerRecordsOffset = file.pos();
 
     // layerCountが負の場合最終的に透過したイメージになる事を示す。
     const auto absoluteLayerCount = static_cast<quint16>(std::abs(layerInfo.layerCount));
     qDebug() << QString("absolute layer count: %1").arg(absoluteLayerCount);
 
     QList<PSDLayerRecord> records;
-    for (int layer = 0; layer < absoluteLayerCount; layer++)
+    quint32 layerRecordsSize = 0;
+    if (readPSDLayerRecords(in, absoluteLayerCount, qint64(layerInfo.length) - consumedLayerInfoSize, records, &layerRecordsSize) != 0)
+        return -1;
+    consumedLayerInfoSize += layerRecordsSize;
+    for (int layer = 0; layer < records.size(); layer++)
     {
         qDebug() << QString("### Layer %1").arg(layer);
-        PSDLayerRecord record;
-        in >> record;
-        if (file.error() != QFileDevice::NoError)
-        {
-            qDebug() << "file i/o error occurred.";
+        dumpPSDLayerRecord(records.at(layer));
+    }
+
+    // resolve layer tree and selection before any pixels are read.
+    const qint64 channelImageDataOffset = file.pos();
+    layout.channelImageDataOffset = channelImageDataOffset;
+    layout.globalLayerMaskInfoOffset = channelImageDataOffset;
+    layout.layerInfoKey = 0;
+    sectionTrace.restart("buildPSDLayerTree");
+    QList<PSDLayerNode> layerTree = buildPSDLayerTree(records, channelImageDataOffset);
+    foreach(const PSDLayerNode &node, layerTree)
+    {
+        layout.globalLayerMaskInfoOffset += node.channelDataLength;
+    }
+    // channel image data 全体は 2 byte 境界に合わせられている。
+    layout.globalLayerMaskInfoOffset += (layout.globalLayerMaskInfoOffset - channelImageDataOffset) % 2;
+    // 16/32 bit のレイヤーは global additional layer info の 'Lr16'/'Lr32' にある。
+    if (records.isEmpty() && fileHeader.depth > 8 && readPSDLayerInfoBlock(file, in, layout, &records, &layerTree) != 0)
+        return -1;
+    const QList<bool> selected = selectPSDLayers(layerTree, options.selectors);
+    foreach(const PSDLayerNode &node, layerTree)
+    {
+        dumpPSDLayerNode(node);
+    }
+    QList<PSDPattern> patterns;
+    const bool hasPatternFill = std::any_of(layerTree.cbegin(), layerTree.cend(),
+        [](const PSDLayerNode &node) { return node.fill.type == PSDFillPattern; });
+    if (hasPatternFill && (readPSDPatterns(file, in, layout, &patterns) != 0 || !file.seek(layout.channelImageDataOffset)))
+        return -1;
+    resolvePSDFillLayers(layerTree, QRect(0, 0, fileHeader.width, fileHeader.height), patterns);
+
+    sectionTrace.restart("readChannelImageData");
+    if (options.benchmarkIterations > 0)
+    {
+        QList<PSDBenchmarkResult> results;
+        if (benchmarkPSDLayers(in, fileHeader, records, layerTree, selected, options.benchmarkIterations, &results) != 0)
             return -1;
+        for (auto &result : results)
+        {
+            result.file = QFileInfo(path).fileName();
         }
-        dumpPSDLayerRecord(record);
-        records.append(record);
-        consumedLayerInfoSize += PSDLayerRecordSize + (PSDChannelInfosize * record.channelInfos.size());
-
-        //! @note not implemented, Additional Layer Info を読みユニコードレイヤー名やグループを解析しなければならない。
-        consumedLayerInfoSize += record.extraDataFieldLength;
-        in.skipRawData(record.extraDataFieldLength);
-        if (file.error() != QFileDevice::NoError)
+        *benchmarkResults += results;
+        return 0;
+    }
+    if (options.comps)
+        return renderPSDLayerComps(in, fileHeader, imageResouceSection, records, layerTree, options.blendSpace, options.outputPrefix);
+    if (options.timeline)
+    {
+        return renderPSDAnimationFrames(in, fileHeader, imageResouceSection, records, layerTree,
+            options.spriteSheet, options.blendSpace, options.outputPrefix);
+    }
+    if (!options.edits.isEmpty())
+    {
+        if (layout.layerInfoKey != 0)
         {
-            qDebug() << "file i/o error occurred.";
+            qDebug() << "editing layers of 16 or 32 bit document is not supported.";
             return -1;
         }
-    }    
+        const QString outputPath = options.outputPath.isEmpty() ? QString() : psdOutputPath(options.outputPrefix, options.outputPath);
+        return editPSDLayers(file, layout, imageResouceSection, layerAndMaskInfoSection, layerInfo, records, layerTree, options.edits, outputPath);
+    }
+    if (options.writeComposite)
+    {
+        const QString outputPath = options.outputPath.isEmpty() ? path : psdOutputPath(options.outputPrefix, options.outputPath);
+        return writePSDCompositeImage(file, in, layout, fileHeader, imageResouceSection, records, layerTree,
+            options.blendSpace, layerInfo.layerCount < 0, options.forceComposite, outputPath);
+    }
+    if (options.patterns)
+        return exportPSDPatterns(file, in, layout, options.outputPrefix);
+    if (options.artboards)
+        return exportPSDArtboards(path, fileHeader, records, layerTree, options.blendSpace, options.outputPrefix);
+    if (options.slices)
+    {
+        return exportPSDSlices(in, layout, fileHeader, imageResouceSection, records, layerTree,
+            options.slicesFromComposite, options.blendSpace, options.outputPrefix);
+    }
+    if (options.alphaBounds)
+        return reportPSDLayerAlphaBounds(in, fileHeader, records, layerTree, selected);
+    if (options.verify)
+        return verifyPSDMergedImage(in, layout, fileHeader, records, layerTree, options.blendSpace, options.verifyPSNR);
+    if (!options.exportChannels.isEmpty())
+    {
+        return exportPSDLayerChannels(in, fileHeader, records, layerTree, selected, options.exportChannels,
+            options.channelFormat, options.outputPrefix);
+    }
+    if (!options.extractPath.isEmpty())
+    {
+        return extractPSDLayers(file, in, layout, fileHeader, imageResouceSection, layerAndMaskInfoSection, layerInfo,
+            records, layerTree, selected, options.blendSpace, psdOutputPath(options.outputPrefix, options.extractPath));
+    }
 
     // read image(layer and channels).
     for (int i = 0; i < records.size(); i++)
     {
+        if (!selected.at(i))
+            continue;
         const auto &record = records.at(i);
         const int width = record.right - record.left;
         const int height = record.bottom - record.top;
         qDebug() << QString("layer %1 width %2 height %3").arg(i).arg(width).arg(height);
+        // 選択されていないレイヤーのチャンネルデータは読まずにシークで飛ばす。
+        if (!file.seek(layerTree.at(i).channelDataOffset))
+        {
+            qDebug() << QString("can't seek to channel image data, layer record=%1").arg(i);
+            return -1;
+        }
+        const auto &fill = layerTree.at(i).fill;
+        if (fill.type != PSDFillNone && fileHeader.depth == 8)
+        {
+            // 塗りつぶしレイヤーは設定から描き、画素があれば透明度として使う。
+            QImage image = renderPSDFillTile(fill, fill.bounds);
+            if (width > 0 && height > 0)
+            {
+                bool ok;
+                const QImage coverage = loadPSDLayer(in, record, &ok);
+                if (ok && coverage.size() == image.size())
+                    maskPSDFillTile(image, coverage, QPoint());
+            }
+            QString fileName = psdOutputPath(options.outputPrefix, QString("layer%1.png").arg(i));
+            PSDTraceScope saveTrace("savePNG", i);
+            image.save(fileName, "PNG");
+            qDebug() << QString("fill layer %1 saved to %2").arg(i).arg(fileName);
+            continue;
+        }
+        // 16 bit は 8 bit に落とさず PNG にする。
+        if (options.layerFormat != PSDLayerFormatPNG || fileHeader.depth == 16)
+        {
+            if (width <= 0 || height <= 0)
+                continue;
+            PSDLayerPlanes planes;
+            if (loadPSDLayerPlanes(in, record, fileHeader, planes) != 0)
+            {
+                qDebug() << QString("loadPSDLayerPlanes failed, layer record=%1").arg(i);
+                return -1;
+            }
+            const QPoint position(static_cast<qint32>(record.left), static_cast<qint32>(record.top));
+            QString fileName;
+            int written = -1;
+            switch (options.layerFormat)
+            {
+            case PSDLayerFormatPNG:
+                fileName = psdOutputPath(options.outputPrefix, QString("layer%1.png").arg(i));
+                written = writePSDPNG16(fileName, planes);
+                break;
+            case PSDLayerFormatOpenEXR:
+                fileName = psdOutputPath(options.outputPrefix, QString("layer%1.exr").arg(i));
+                written = writePSDOpenEXR(fileName, planes, position, QSize(fileHeader.width, fileHeader.height), options.exrCompression);
+                break;
+            case PSDLayerFormatPFM:
+                fileName = psdOutputPath(options.outputPrefix, QString("layer%1.pfm").arg(i));
+                written = writePSDPortableFloatMap(fileName, planes);
+                break;
+            }
+            if (written != 0)
+                return -1;
+            qDebug() << QString("layer %1 saved to %2").arg(i).arg(fileName);
+            continue;
+        }
         bool ok;
         QImage image = loadPSDLayer(in, record, &ok);
         if (!ok)
@@ -726,21 +7591,32 @@ int main(int argc, char *argv[])
             qDebug() << QString("loadPSDLayer failed, layer record=%1").arg(i);
             return -1;
         }
-        QString fileName = QString("layer%1.png").arg(i);
+        QString fileName = psdOutputPath(options.outputPrefix, QString("layer%1.png").arg(i));
+        PSDTraceScope saveTrace("savePNG", i);
         image.save(fileName, "PNG");
         qDebug() << QString("layer %1 saved to %2").arg(i).arg(fileName);
     }
 
     quint32 channelImageDataSize = 0;
     bool requirePadding = false;
-    foreach(const PSDLayerRecord &record, records)
+    // 'Lr16'/'Lr32' のチャンネルデータは layer info の外にある。
+    if (layout.layerInfoKey == 0)
     {
-        foreach(const PSDChannelInfo &info, record.channelInfos)
+        foreach(const PSDLayerRecord &record, records)
         {
-            channelImageDataSize += info.correspondingChannelDataLength;
+            foreach(const PSDChannelInfo &info, record.channelInfos)
+            {
+                channelImageDataSize += info.correspondingChannelDataLength;
+            }
         }
     }
 
+    if (!file.seek(channelImageDataOffset + channelImageDataSize))
+    {
+        qDebug() << "can't seek to end of channel image data.";
+        return -1;
+    }
+
     const quint32 align = 2;
     const quint32 rem = channelImageDataSize % align;
     const quint32 padding = (rem == 0 ? 0 : align - rem);
@@ -758,6 +7634,7 @@ int main(int argc, char *argv[])
     quint32 layerAndMaskInfoRem = layerAndMaskInfoSection.length - (sizeof(layerAndMaskInfoSection.length) + consumedLayerInfoSize + channelImageDataSize);
     qDebug() << QString("layerAndMaskInfoRem: %1").arg(layerAndMaskInfoRem);
 
+    sectionTrace.restart("readGlobalLayerInfo");
     PSDGlobalLayerMaskInfo globalLayerMaskInfo;
     in >> globalLayerMaskInfo;
     if (file.error() != QFileDevice::NoError)
@@ -778,6 +7655,379 @@ int main(int argc, char *argv[])
     return 0;
 }
 
+/**
+ * @brief process files in turn, or concurrently with each file kept on one NUMA node.
+ *
+ * With scheduler each node takes next file when it finishes one, so read, decode, composite and encode
+ * of a file run on workers and buffers of one node.
+ *
+ * @param files PSD files.
+ * @param options analyze options, outputPrefix is set for each file in batch.
+ * @param scheduler NUMA scheduler, nullptr to process files in turn with global thread pool.
+ * @param benchmarkResults receives benchmark results in file order.
+ * @param diverged receives files whose merged image diverged from layers.
+ * @return int 0 if successfully, -1 if some file failed.
+ */
+int runPSDBatch(const QStringList &files, const PSDAnalyzeOptions &options, PSDNumaScheduler *scheduler,
+    QList<PSDBenchmarkResult> *benchmarkResults, QStringList *diverged)
+{
+    QList<int> analyzed(files.size(), 0);
+    QList<QList<PSDBenchmarkResult>> fileResults(files.size());
+    int *analyzedData = analyzed.data();
+    QList<PSDBenchmarkResult> *fileResultsData = fileResults.data();
+    const auto process = [&](int i)
+    {
+        PSDAnalyzeOptions fileOptions = options;
+        fileOptions.outputPrefix = files.size() > 1 ? QFileInfo(files.at(i)).completeBaseName() + QChar('_') : QString();
+        analyzedData[i] = analyzePSDFile(files.at(i), fileOptions, &fileResultsData[i]);
+    };
+    if (!scheduler)
+    {
+        for (int i = 0; i < files.size(); i++)
+            process(i);
+    }
+    else
+    {
+        QAtomicInt next(0);
+        scheduler->runOnEachNode([&](int)
+        {
+            for (int i = next.fetchAndAddRelaxed(1); i < files.size(); i = next.fetchAndAddRelaxed(1))
+                process(i);
+        });
+    }
+
+    int result = 0;
+    for (int i = 0; i < files.size(); i++)
+    {
+        *benchmarkResults += fileResults.at(i);
+        if (analyzed.at(i) > 0)
+            diverged->append(files.at(i));
+        else if (analyzed.at(i) != 0)
+        {
+            qDebug() << QString("failed to process %1").arg(files.at(i));
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief compare wall clock of batch with global thread pool and with NUMA scheduler at increasing thread counts.
+ *
+ * A warm-up pass fills page cache and creates output files first. Then each thread count is measured
+ * in rounds which alternate which scheduler goes first, and median of the rounds is reported.
+ *
+ * @return int 0 if successfully, -1 failed.
+ */
+int benchmarkPSDBatchScaling(const QStringList &files, const PSDAnalyzeOptions &options)
+{
+    QLoggingCategory::setFilterRules("default.debug=false");
+    const int maxThreads = qMax(1, QThread::idealThreadCount());
+    const int rounds = 4;
+    QList<int> threadCounts;
+    for (int threads = 1; threads < maxThreads; threads *= 2)
+        threadCounts.append(threads);
+    threadCounts.append(maxThreads);
+
+    auto *globalPool = QThreadPool::globalInstance();
+    const int globalThreads = globalPool->maxThreadCount();
+    qInfo() << QString("batch scaling: %1 files, %2 NUMA nodes, %3 threads, median of %4 rounds").arg(files.size())
+        .arg(PSDNumaTopology::instance().nodeCount()).arg(maxThreads).arg(rounds);
+    int result = 0;
+    const auto measure = [&](PSDNumaScheduler *scheduler) -> double
+    {
+        QList<PSDBenchmarkResult> benchmarkResults;
+        QStringList diverged;
+        QElapsedTimer timer;
+        timer.start();
+        if (runPSDBatch(files, options, scheduler, &benchmarkResults, &diverged) != 0)
+            result = -1;
+        return timer.nsecsElapsed() / 1e6;
+    };
+    const auto median = [](QList<double> values) -> double
+    {
+        std::sort(values.begin(), values.end());
+        const int middle = values.size() / 2;
+        return values.size() % 2 ? values.at(middle) : (values.at(middle - 1) + values.at(middle)) / 2;
+    };
+
+    // 最初の計測だけがコールドキャッシュと出力ファイルの作成を負担しないよう、計測しない 1 回を先に流す。
+    measure(nullptr);
+    double defaultBase = 0, numaBase = 0;
+    foreach(int threads, threadCounts)
+    {
+        globalPool->setMaxThreadCount(threads);
+        PSDNumaScheduler scheduler(threads);
+        QList<double> defaultMsecs, numaMsecs;
+        for (int round = 0; round < rounds; round++)
+        {
+            if (round % 2 == 0)
+            {
+                defaultMsecs.append(measure(nullptr));
+                numaMsecs.append(measure(&scheduler));
+            }
+            else
+            {
+                numaMsecs.append(measure(&scheduler));
+                defaultMsecs.append(measure(nullptr));
+            }
+        }
+        const double defaultMsec = median(defaultMsecs);
+        const double numaMsec = median(numaMsecs);
+        if (threads == 1)
+        {
+            defaultBase = defaultMsec;
+            numaBase = numaMsec;
+        }
+        qInfo() << QString("threads %1: default %2 ms (x%3), numa %4 ms (x%5), %6 pools")
+            .arg(threads, 3)
+            .arg(defaultMsec, 0, 'f', 1).arg(defaultBase / defaultMsec, 0, 'f', 2)
+            .arg(numaMsec, 0, 'f', 1).arg(numaBase / numaMsec, 0, 'f', 2)
+            .arg(scheduler.poolCount());
+    }
+    globalPool->setMaxThreadCount(globalThreads);
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("psd_analyze");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("scan PSD file and save layers as PNG.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("files", "path to PSD files, each file is processed in turn.", "<files...>");
+    QCommandLineOption selectOption(QStringList() << "s" << "select",
+        "select layers to save, may be specified multiple times. "
+        "<selector> is #<index>, id:<layer id>, path:<group/name glob> or <name glob>. "
+        "selecting a group selects all layers in it.",
+        "selector");
+    parser.addOption(selectOption);
+    QCommandLineOption compsOption("comps", "render each layer comp to comp<n>.png instead of saving layers.");
+    parser.addOption(compsOption);
+    QCommandLineOption timelineOption("timeline", "render each animation frame to frame<n>.png instead of saving layers.");
+    parser.addOption(timelineOption);
+    QCommandLineOption spriteSheetOption("sprite-sheet", "with --timeline, save all frames to frames.png.");
+    parser.addOption(spriteSheetOption);
+    QCommandLineOption renameOption("rename", "rename layers, only layer records are rewritten.", "selector=name");
+    parser.addOption(renameOption);
+    QCommandLineOption hideOption("hide", "hide layers, only layer records are rewritten.", "selector");
+    parser.addOption(hideOption);
+    QCommandLineOption showOption("show", "show layers, only layer records are rewritten.", "selector");
+    parser.addOption(showOption);
+    QCommandLineOption opacityOption("opacity", "set layer opacity 0-255, only layer records are rewritten.", "selector=opacity");
+    parser.addOption(opacityOption);
+    QCommandLineOption moveUpOption("move-up", "move layers above next sibling, channel image data is copied in new order.", "selector");
+    parser.addOption(moveUpOption);
+    QCommandLineOption moveDownOption("move-down", "move layers below previous sibling, channel image data is copied in new order.", "selector");
+    parser.addOption(moveDownOption);
+    QCommandLineOption outputOption(QStringList() << "o" << "output", "output PSD file of edit or --write-composite, source file is overwritten if omitted.", "file");
+    parser.addOption(outputOption);
+    QCommandLineOption extractOption("extract", "write selected layers and groups they need to a new PSD file.", "file");
+    parser.addOption(extractOption);
+    QCommandLineOption traceOption("trace", "write Chrome trace event JSON of parsing and decoding, open with Perfetto or chrome://tracing.", "file");
+    parser.addOption(traceOption);
+    QCommandLineOption benchmarkOption("benchmark", "measure RLE decode, channel merge, layer load and composite of selected layers.");
+    parser.addOption(benchmarkOption);
+    QCommandLineOption iterationsOption("iterations", "measured iterations of each benchmark case.", "n", "10");
+    parser.addOption(iterationsOption);
+    QCommandLineOption saveBaselineOption("save-baseline", "save benchmark results to JSON baseline.", "file");
+    parser.addOption(saveBaselineOption);
+    QCommandLineOption compareBaselineOption("compare-baseline", "compare benchmark results with JSON baseline, exit with 1 on regression.", "file");
+    parser.addOption(compareBaselineOption);
+    QCommandLineOption thresholdOption("threshold", "regression threshold in percent for --compare-baseline, \"5\" or \"uncompressRLE=10\".", "[case=]percent");
+    parser.addOption(thresholdOption);
+    QCommandLineOption linearOption("linear", "blend layers in linear light instead of sRGB values.");
+    parser.addOption(linearOption);
+    QCommandLineOption formatOption("format", "output format of layers, png, exr or pfm. exr and pfm require 32 bit document, 16 bit document is saved as 16 bit PNG.", "format", "png");
+    parser.addOption(formatOption);
+    QCommandLineOption exrCompressionOption("exr-compression", "OpenEXR compression, none, rle or zip.", "compression", "zip");
+    parser.addOption(exrCompressionOption);
+    QCommandLineOption channelOption("channel", "export only this channel of selected layers, alpha, mask or realmask.", "channel");
+    parser.addOption(channelOption);
+    QCommandLineOption channelFormatOption("channel-format", "format of --channel export, gray, mono or rle.", "format", "gray");
+    parser.addOption(channelFormatOption);
+    QCommandLineOption verifyOption("verify", "compare merged image with recomposited layers and report diverged files.");
+    parser.addOption(verifyOption);
+    QCommandLineOption verifyPSNROption("verify-psnr", "PSNR in dB below which --verify reports file as diverged.", "dB", "40");
+    parser.addOption(verifyPSNROption);
+    QCommandLineOption compositeOption("write-composite", "write composited merged image into file saved without Maximize Compatibility, source file is overwritten if --output is omitted.");
+    parser.addOption(compositeOption);
+    QCommandLineOption numaOption("numa", "process files concurrently, each file on workers pinned to one NUMA node.");
+    parser.addOption(numaOption);
+    QCommandLineOption scalingBenchmarkOption("scaling-benchmark", "compare batch scaling of global thread pool and NUMA scheduler.");
+    parser.addOption(scalingBenchmarkOption);
+    QCommandLineOption alphaBoundsOption("alpha-bounds", "report emptiness and tight alpha bounds of selected layers without decoding color.");
+    parser.addOption(alphaBoundsOption);
+    QCommandLineOption patternsOption("patterns", "export patterns as pattern<index>.png.");
+    parser.addOption(patternsOption);
+    QCommandLineOption artboardsOption("artboards", "export each artboard as artboard<index>.png.");
+    parser.addOption(artboardsOption);
+    QCommandLineOption slicesOption("slices", "export slices of slices resource as slice<id>.png.");
+    parser.addOption(slicesOption);
+    QCommandLineOption sliceSourceOption("slice-source", "render slices from merged image or composite of layers.", "merged|composite", "merged");
+    parser.addOption(sliceSourceOption);
+    QCommandLineOption forceCompositeOption("force-composite", "write merged image even if file already has one.");
+    parser.addOption(forceCompositeOption);
+    parser.process(app);
+
+    qDebug() << "cwd: " << QDir::currentPath();
+    if (parser.positionalArguments().isEmpty())
+    {
+        qDebug() << "argument missing, require path to PSD file.";
+        return -1;
+    }
+
+    PSDAnalyzeOptions options;
+    foreach(const QString &text, parser.values(selectOption))
+    {
+        PSDLayerSelector selector;
+        if (!parsePSDLayerSelector(text, &selector))
+            return -1;
+        options.selectors.append(selector);
+    }
+
+    const QList<QPair<QCommandLineOption, PSDLayerEdit::Kind>> editOptions = {
+        { renameOption, PSDLayerEdit::Rename },
+        { hideOption, PSDLayerEdit::Hide },
+        { showOption, PSDLayerEdit::Show },
+        { opacityOption, PSDLayerEdit::Opacity },
+        { moveUpOption, PSDLayerEdit::MoveUp },
+        { moveDownOption, PSDLayerEdit::MoveDown },
+    };
+    for (const auto &editOption : editOptions)
+    {
+        foreach(const QString &text, parser.values(editOption.first))
+        {
+            PSDLayerEdit edit;
+            if (!parsePSDLayerEdit(editOption.second, text, &edit))
+                return -1;
+            options.edits.append(edit);
+        }
+    }
+    options.comps = parser.isSet(compsOption);
+    options.timeline = parser.isSet(timelineOption);
+    options.spriteSheet = parser.isSet(spriteSheetOption);
+    options.outputPath = parser.value(outputOption);
+    options.extractPath = parser.value(extractOption);
+    options.blendSpace = parser.isSet(linearOption) ? PSDBlendSpaceLinear : PSDBlendSpaceSRGB;
+    const QHash<QString, PSDLayerFormat> formats = {
+        { "png", PSDLayerFormatPNG },
+        { "exr", PSDLayerFormatOpenEXR },
+        { "pfm", PSDLayerFormatPFM },
+    };
+    const QHash<QString, PSDExrCompression> exrCompressions = {
+        { "none", PSDExrCompressionNone },
+        { "rle", PSDExrCompressionRLE },
+        { "zip", PSDExrCompressionZip },
+    };
+    if (!formats.contains(parser.value(formatOption)) || !exrCompressions.contains(parser.value(exrCompressionOption)))
+    {
+        qDebug() << QString("unknown format %1 or OpenEXR compression %2").arg(parser.value(formatOption)).arg(parser.value(exrCompressionOption));
+        return -1;
+    }
+    options.layerFormat = formats.value(parser.value(formatOption));
+    const QHash<QString, qint16> channelNames = {
+        { "alpha", -1 },
+        { "mask", -2 },
+        { "realmask", -3 },
+    };
+    const QHash<QString, PSDChannelFormat> channelFormats = {
+        { "gray", PSDChannelFormatGray },
+        { "mono", PSDChannelFormatMono },
+        { "rle", PSDChannelFormatRLE },
+    };
+    foreach(const QString &name, parser.values(channelOption))
+    {
+        if (!channelNames.contains(name))
+        {
+            qDebug() << QString("unknown channel %1").arg(name);
+            return -1;
+        }
+        options.exportChannels.append(channelNames.value(name));
+    }
+    if (!channelFormats.contains(parser.value(channelFormatOption)))
+    {
+        qDebug() << QString("unknown channel format %1").arg(parser.value(channelFormatOption));
+        return -1;
+    }
+    options.channelFormat = channelFormats.value(parser.value(channelFormatOption));
+    options.verify = parser.isSet(verifyOption);
+    options.writeComposite = parser.isSet(compositeOption);
+    options.alphaBounds = parser.isSet(alphaBoundsOption);
+    options.patterns = parser.isSet(patternsOption);
+    options.artboards = parser.isSet(artboardsOption);
+    options.slices = parser.isSet(slicesOption);
+    if (parser.value(sliceSourceOption) != "merged" && parser.value(sliceSourceOption) != "composite")
+    {
+        qDebug() << QString("unknown slice source %1").arg(parser.value(sliceSourceOption));
+        return -1;
+    }
+    options.slicesFromComposite = parser.value(sliceSourceOption) == "composite";
+    options.forceComposite = parser.isSet(forceCompositeOption);
+    bool validPSNR = false;
+    options.verifyPSNR = parser.value(verifyPSNROption).toDouble(&validPSNR);
+    if (!validPSNR || options.verifyPSNR <= 0)
+    {
+        qDebug() << QString("invalid verify PSNR: %1").arg(parser.value(verifyPSNROption));
+        return -1;
+    }
+    options.exrCompression = exrCompressions.value(parser.value(exrCompressionOption));
+
+    QHash<QString, double> thresholds;
+    foreach(const QString &text, parser.values(thresholdOption))
+    {
+        if (!parsePSDBenchmarkThreshold(text, thresholds))
+            return -1;
+    }
+    if ((parser.isSet(saveBaselineOption) || parser.isSet(compareBaselineOption)) && !parser.isSet(benchmarkOption))
+    {
+        qDebug() << "--save-baseline and --compare-baseline require --benchmark.";
+        return -1;
+    }
+    if (parser.isSet(benchmarkOption))
+    {
+        options.benchmarkIterations = parser.value(iterationsOption).toInt();
+        if (options.benchmarkIterations <= 0)
+        {
+            qDebug() << QString("invalid iterations: %1").arg(parser.value(iterationsOption));
+            return -1;
+        }
+        // ログ出力が計測を支配しないよう、ベンチマーク中は debug を抑止して結果は qInfo で出す。
+        QLoggingCategory::setFilterRules("default.debug=false");
+    }
+    if (parser.isSet(traceOption))
+        PSDTracer::instance().start();
+
+    // batch mode, outputs are prefixed by base name of each file.
+    const QStringList files = parser.positionalArguments();
+    if (parser.isSet(scalingBenchmarkOption))
+        return benchmarkPSDBatchScaling(files, options);
+    QList<PSDBenchmarkResult> benchmarkResults;
+    QStringList diverged;
+    QScopedPointer<PSDNumaScheduler> scheduler;
+    if (parser.isSet(numaOption))
+        scheduler.reset(new PSDNumaScheduler(qMax(1, QThread::idealThreadCount())));
+    int result = runPSDBatch(files, options, scheduler.data(), &benchmarkResults, &diverged);
+    if (options.verify)
+    {
+        qInfo() << QString("verify: %1 of %2 files diverged from merged image.").arg(diverged.size()).arg(files.size());
+        foreach(const QString &path, diverged)
+            qInfo() << QString("  %1").arg(path);
+        if (result == 0 && !diverged.isEmpty())
+            result = 1;
+    }
+    if (result == 0 && parser.isSet(saveBaselineOption) && savePSDBenchmarkBaseline(parser.value(saveBaselineOption), benchmarkResults) != 0)
+        result = -1;
+    if (result == 0 && parser.isSet(compareBaselineOption))
+        result = comparePSDBenchmarkBaseline(parser.value(compareBaselineOption), benchmarkResults, thresholds);
+    if (parser.isSet(traceOption) && PSDTracer::instance().write(parser.value(traceOption)) != 0)
+        result = -1;
+    return result;
+}
+
+
 void sjisToQStringTest()
 {
     QFile sjisFile("shiftjis.txt");